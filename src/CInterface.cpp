@@ -1,12 +1,25 @@
 #include "VMEngine.h"
 
+#include <algorithm>
+#include <cstring>
+
 using namespace Pip2;
 
 #define PIP2_API __attribute__((visibility("default")))
 
 extern "C" {
+    PIP2_API VMEngine *vm_engine_create_with_options_size(const char *module_name, Pip2::VMConfigParameters *config,
+                                                          Pip2::VMOptions *options, std::size_t options_size) {
+        // Hosts built against an older VMOptions pass a shorter struct, the fields they don't know keep their defaults
+        Pip2::VMOptions full_options{};
+        std::memcpy(&full_options, options, std::min(options_size, sizeof(Pip2::VMOptions)));
+
+        return new Pip2::VMEngine(module_name, *config, std::move(full_options));
+    }
+
     PIP2_API VMEngine *vm_engine_create(const char *module_name, Pip2::VMConfigParameters *config, Pip2::VMOptions *options) {
-        return new Pip2::VMEngine(module_name, *config, std::move(*options));
+        // Only reads the struct as it was before it got versioned, use vm_engine_create_with_options_size for the rest
+        return vm_engine_create_with_options_size(module_name, config, options, VM_OPTIONS_V1_SIZE);
     }
 
     PIP2_API void vm_engine_destroy(VMEngine *engine) {
@@ -24,4 +37,34 @@ extern "C" {
     PIP2_API void vm_engine_set_reg(VMEngine *engine, Pip2::Register reg, std::uint32_t value) {
         engine->reg(reg, value);
     }
+
+    PIP2_API bool vm_engine_guest_pc(VMEngine *engine, const void *return_address, std::uint32_t *pc) {
+        // For a return address found walking the host stack. Returns false when it isn't an HLE call site
+        auto guest_pc = engine->guest_pc(return_address);
+
+        if (guest_pc.has_value()) {
+            *pc = guest_pc.value();
+        }
+
+        return guest_pc.has_value();
+    }
+
+    PIP2_API std::size_t vm_engine_call_site_cache_counters(VMEngine *engine, std::uint32_t *addrs, std::uint64_t *hits,
+                                                            std::uint64_t *misses, std::size_t capacity) {
+        // Fills up to capacity entries, and returns how many sites there are. Sites are only known with
+        // call_site_counters_ set
+        std::size_t index = 0;
+
+        for (const auto &[addr, cache]: engine->call_site_caches()) {
+            if (index < capacity) {
+                addrs[index] = addr;
+                hits[index] = cache->hits_;
+                misses[index] = cache->misses_;
+            }
+
+            index++;
+        }
+
+        return index;
+    }
 }
\ No newline at end of file
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+
+namespace Pip2 {
+    /**
+     * @brief Inline cache of a CALLr site, remembering the last target and its function from the lookup table.
+     * Laid out the same way as the translator's CallSiteCache type.
+     */
+    struct CallSiteCache {
+        std::uint32_t target_;
+        std::uint32_t padding_;
+        std::uint64_t function_;
+
+        // Calls that found the target in the cache, and calls that had to go through the lookup table
+        std::uint64_t hits_;
+        std::uint64_t misses_;
+    };
+}
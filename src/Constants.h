@@ -7,5 +7,8 @@
 namespace Pip2
 {
     static constexpr std::uint32_t INSTRUCTION_SIZE = 4;
-    static constexpr std::uint32_t CACHE_VERSION = 3;
+    static constexpr std::uint32_t CACHE_VERSION = 8;
+
+    // Bump when the output of ProgramAnalysis changes, to invalidate persisted analysis results
+    static constexpr std::uint32_t ANALYSIS_VERSION = 7;
 }
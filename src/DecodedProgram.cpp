@@ -0,0 +1,91 @@
+#include "DecodedProgram.h"
+#include "Common.h"
+#include "Constants.h"
+
+#include <algorithm>
+#include <format>
+#include <stdexcept>
+
+namespace Pip2
+{
+    DecodedProgram::DecodedProgram(const std::uint32_t *memory_base, std::size_t memory_size, const PoolItems &pool_items)
+        : memory_base_(memory_base)
+        , word_count_(memory_size / INSTRUCTION_SIZE)
+        , pool_items_(pool_items)
+        , chunk_count_((memory_size / INSTRUCTION_SIZE + CHUNK_WORD_COUNT - 1) / CHUNK_WORD_COUNT)
+    {
+        chunks_ = std::make_unique<std::atomic<DecodedInstruction *>[]>(chunk_count_);
+
+        for (std::size_t i = 0; i < chunk_count_; i++) {
+            chunks_[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    DecodedProgram::~DecodedProgram()
+    {
+        for (std::size_t i = 0; i < chunk_count_; i++) {
+            delete[] chunks_[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    DecodedInstruction *DecodedProgram::decode_chunk(std::size_t chunk_index) const
+    {
+        const std::size_t first_word = chunk_index * CHUNK_WORD_COUNT;
+        const std::size_t chunk_word_count = std::min(CHUNK_WORD_COUNT, word_count_ - first_word);
+
+        auto *chunk = new DecodedInstruction[chunk_word_count];
+
+        for (std::size_t i = 0; i < chunk_word_count; i++) {
+            const std::size_t word = first_word + i;
+            const std::uint32_t next_word = (word + 1 < word_count_) ? memory_base_[word + 1] : 0;
+
+            DecodedInstruction &decoded = chunk[i];
+            decoded.instruction_ = Instruction{ memory_base_[word] };
+            decoded.properties_ = OPCODE_PROPERTIES[decoded.instruction_.word_encoding.opcode];
+            decoded.operand_ = next_word;
+            decoded.operand_kind_ = DECODED_OPERAND_RAW;
+
+            if (std::optional<std::uint32_t> immediate = Common::get_immediate_pip_dword(next_word)) {
+                decoded.operand_ = immediate.value();
+                decoded.operand_kind_ = DECODED_OPERAND_IMMEDIATE;
+            } else if (pool_items_.is_pool_item_constant(next_word)) {
+                decoded.operand_ = pool_items_.get_pool_item_constant(next_word);
+                decoded.operand_kind_ = DECODED_OPERAND_POOL_CONSTANT;
+            } else if (pool_items_.is_pool_item_terminate_function(next_word)) {
+                decoded.operand_kind_ = DECODED_OPERAND_TERMINATE_FUNCTION;
+            }
+        }
+
+        // Another thread may have decoded the same chunk meanwhile, keep whichever was published first
+        DecodedInstruction *expected = nullptr;
+        if (!chunks_[chunk_index].compare_exchange_strong(expected, chunk, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            delete[] chunk;
+            return expected;
+        }
+
+        return chunk;
+    }
+
+    bool DecodedProgram::contains(std::uint32_t addr) const
+    {
+        return addr / INSTRUCTION_SIZE < word_count_;
+    }
+
+    const DecodedInstruction &DecodedProgram::at(std::uint32_t addr) const
+    {
+        const std::size_t word = addr / INSTRUCTION_SIZE;
+
+        if (word >= word_count_) {
+            throw std::runtime_error(std::format("Address {:08X} is out of guest memory", addr));
+        }
+
+        const std::size_t chunk_index = word / CHUNK_WORD_COUNT;
+        DecodedInstruction *chunk = chunks_[chunk_index].load(std::memory_order_acquire);
+
+        if (chunk == nullptr) {
+            chunk = decode_chunk(chunk_index);
+        }
+
+        return chunk[word % CHUNK_WORD_COUNT];
+    }
+}
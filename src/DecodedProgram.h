@@ -0,0 +1,174 @@
+#pragma once
+
+#include "Instruction.h"
+#include "PoolItems.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+
+namespace Pip2
+{
+    enum OpcodeProperty : std::uint8_t
+    {
+        // Branch with its target known at decode time (BEQ.., JPl, CALLl)
+        OPCODE_PROPERTY_DIRECT_BRANCH = 1 << 0,
+        // Branch to a register (JPr, CALLr, RET)
+        OPCODE_PROPERTY_INDIRECT_BRANCH = 1 << 1,
+        // Branch offset is stored in the rt field instead of the next dword
+        OPCODE_PROPERTY_OFFSET_IN_INSTRUCTION = 1 << 2,
+        // The next dword is an operand of this instruction, not an instruction
+        OPCODE_PROPERTY_CONSUMES_DWORD = 1 << 3,
+        // Control flow never falls through to the next instruction as a plain continuation
+        OPCODE_PROPERTY_BLOCK_CUTOFF = 1 << 4
+    };
+
+    constexpr std::array<std::uint8_t, 256> make_opcode_properties()
+    {
+        std::array<std::uint8_t, 256> properties{};
+
+        constexpr Opcode register_branches[] = {
+            Opcode::BEQ, Opcode::BNE, Opcode::BLT, Opcode::BLTU, Opcode::BLE, Opcode::BLEU,
+            Opcode::BGT, Opcode::BGTU, Opcode::BGE, Opcode::BGEU
+        };
+
+        constexpr Opcode immediate_branches[] = {
+            Opcode::BEQI, Opcode::BEQIB, Opcode::BNEI, Opcode::BNEIB, Opcode::BLTI, Opcode::BLTIB,
+            Opcode::BLTUI, Opcode::BLTUIB, Opcode::BLEI, Opcode::BLEIB, Opcode::BLEUI, Opcode::BLEUIB,
+            Opcode::BGTI, Opcode::BGTIB, Opcode::BGTUI, Opcode::BGTUIB, Opcode::BGEI, Opcode::BGEIB,
+            Opcode::BGEUI, Opcode::BGEUIB
+        };
+
+        constexpr Opcode dword_operand_instructions[] = {
+            Opcode::STWd, Opcode::STHd, Opcode::STBd, Opcode::LDI, Opcode::LDWd, Opcode::LDHUd, Opcode::LDHd,
+            Opcode::LDBUd, Opcode::LDBd, Opcode::ADDi, Opcode::SUBi, Opcode::MULi, Opcode::DIVi, Opcode::DIVUi,
+            Opcode::ANDi, Opcode::ORi, Opcode::XORi
+        };
+
+        for (const auto opcode: register_branches) {
+            properties[opcode] = OPCODE_PROPERTY_DIRECT_BRANCH | OPCODE_PROPERTY_CONSUMES_DWORD | OPCODE_PROPERTY_BLOCK_CUTOFF;
+        }
+
+        for (const auto opcode: immediate_branches) {
+            properties[opcode] = OPCODE_PROPERTY_DIRECT_BRANCH | OPCODE_PROPERTY_OFFSET_IN_INSTRUCTION | OPCODE_PROPERTY_BLOCK_CUTOFF;
+        }
+
+        for (const auto opcode: dword_operand_instructions) {
+            properties[opcode] = OPCODE_PROPERTY_CONSUMES_DWORD;
+        }
+
+        properties[Opcode::JPl] = OPCODE_PROPERTY_DIRECT_BRANCH | OPCODE_PROPERTY_CONSUMES_DWORD | OPCODE_PROPERTY_BLOCK_CUTOFF;
+
+        // A call only cuts off the block when it calls a terminate function, which depends on the operand
+        properties[Opcode::CALLl] = OPCODE_PROPERTY_DIRECT_BRANCH | OPCODE_PROPERTY_CONSUMES_DWORD;
+
+        properties[Opcode::JPr] = OPCODE_PROPERTY_INDIRECT_BRANCH | OPCODE_PROPERTY_BLOCK_CUTOFF;
+        properties[Opcode::RET] = OPCODE_PROPERTY_INDIRECT_BRANCH | OPCODE_PROPERTY_BLOCK_CUTOFF;
+        properties[Opcode::CALLr] = OPCODE_PROPERTY_INDIRECT_BRANCH;
+
+        return properties;
+    }
+
+    inline constexpr std::array<std::uint8_t, 256> OPCODE_PROPERTIES = make_opcode_properties();
+
+    enum DecodedOperandKind : std::uint8_t
+    {
+        // Operand holds the raw next dword, which is not a constant
+        DECODED_OPERAND_RAW,
+        // Operand holds the inline immediate of the next dword
+        DECODED_OPERAND_IMMEDIATE,
+        // Operand holds the value of the pool constant referenced by the next dword
+        DECODED_OPERAND_POOL_CONSTANT,
+        // Operand holds the raw next dword, which references a terminate function
+        DECODED_OPERAND_TERMINATE_FUNCTION
+    };
+
+    struct DecodedInstruction
+    {
+        Instruction instruction_;
+        std::uint32_t operand_;
+        std::uint8_t properties_;
+        DecodedOperandKind operand_kind_;
+
+        [[nodiscard]] bool has(OpcodeProperty property) const { return (properties_ & property) != 0; }
+        [[nodiscard]] Opcode opcode() const { return instruction_.word_encoding.opcode; }
+
+        [[nodiscard]] bool has_constant_operand() const
+        {
+            return (operand_kind_ == DECODED_OPERAND_IMMEDIATE) || (operand_kind_ == DECODED_OPERAND_POOL_CONSTANT);
+        }
+
+        /**
+         * @brief Get the target of a direct branch located at the given address.
+         *
+         * Returns std::nullopt when the target is not a constant, for example a HLE call.
+         */
+        [[nodiscard]] std::optional<std::uint32_t> direct_branch_target(std::uint32_t addr) const
+        {
+            if (has(OPCODE_PROPERTY_OFFSET_IN_INSTRUCTION)) {
+                return addr + static_cast<std::int8_t>(instruction_.two_sources_encoding.rt) * 4;
+            }
+
+            switch (operand_kind_) {
+                case DECODED_OPERAND_IMMEDIATE:
+                    return addr + static_cast<std::int32_t>(operand_);
+
+                case DECODED_OPERAND_POOL_CONSTANT:
+                    return operand_;
+
+                default:
+                    return std::nullopt;
+            }
+        }
+
+        /**
+         * @brief Check if the instruction ends the current block, so the following address starts a new one.
+         */
+        [[nodiscard]] bool is_block_cutoff() const
+        {
+            return has(OPCODE_PROPERTY_BLOCK_CUTOFF) ||
+                ((opcode() == Opcode::CALLl) && (operand_kind_ == DECODED_OPERAND_TERMINATE_FUNCTION));
+        }
+    };
+
+    /**
+     * @brief The guest memory decoded once into instructions, shared by program analysis and translation.
+     *
+     * Every word is decoded as if it was an instruction, with the word following it resolved as an operand. Decoding
+     * happens in chunks on first access, so data and heap pages that no function reaches are never decoded. Access is
+     * thread-safe.
+     */
+    class DecodedProgram
+    {
+    private:
+        static constexpr std::size_t CHUNK_WORD_COUNT = 4096;
+
+        const std::uint32_t *memory_base_;
+        std::size_t word_count_;
+        const PoolItems &pool_items_;
+
+        std::unique_ptr<std::atomic<DecodedInstruction *>[]> chunks_;
+        std::size_t chunk_count_;
+
+        DecodedInstruction *decode_chunk(std::size_t chunk_index) const;
+
+    public:
+        explicit DecodedProgram(const std::uint32_t *memory_base, std::size_t memory_size, const PoolItems &pool_items);
+        ~DecodedProgram();
+
+        DecodedProgram(const DecodedProgram &) = delete;
+        DecodedProgram &operator=(const DecodedProgram &) = delete;
+
+        /**
+         * @brief Get the decoded instruction at the given address.
+         */
+        [[nodiscard]] const DecodedInstruction &at(std::uint32_t addr) const;
+
+        /**
+         * @brief Check if the given address lies in guest memory.
+         */
+        [[nodiscard]] bool contains(std::uint32_t addr) const;
+    };
+}
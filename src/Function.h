@@ -4,9 +4,20 @@
 
 #include <cstdint>
 #include <vector>
-#include <set>
 
 namespace Pip2 {
+    enum FunctionAttribute : std::uint8_t
+    {
+        // Makes no calls at all, neither to guest functions nor to the host
+        FUNCTION_ATTRIBUTE_LEAF = 1 << 0,
+        // Neither the function nor anything it calls reaches HLE, special functions or indirect calls
+        FUNCTION_ATTRIBUTE_NO_HOST_CALL = 1 << 1,
+        // Neither the function nor anything it calls writes guest memory
+        FUNCTION_ATTRIBUTE_NO_MEMORY_WRITE = 1 << 2,
+        // No loops, no recursion and no host calls anywhere down the call graph, so a call always returns
+        FUNCTION_ATTRIBUTE_ALWAYS_RETURNS = 1 << 3
+    };
+
     struct JumpTable
     {
         std::uint32_t jump_instruction_addr_;
@@ -16,15 +27,40 @@ namespace Pip2 {
         std::vector<std::size_t> labels_;
     };
 
+    struct ResolvedBranch
+    {
+        std::uint32_t instruction_addr_;
+        std::uint32_t target_addr_;
+    };
+
+    struct GuardedCall
+    {
+        std::uint32_t instruction_addr_;
+        // Likely targets, each one gets a compare and a direct call before the lookup table call
+        std::vector<std::uint32_t> targets_;
+    };
+
     struct Function
     {
         std::uint32_t addr_;
         std::size_t length_;
 
-        // Label separate function into code blocks
-        std::set<std::uint32_t> labels_;
+        // Label separate function into code blocks, sorted and unique
+        std::vector<std::uint32_t> labels_;
         std::vector<JumpTable> jump_tables_;
 
+        // Functions called directly with CALLl, or through a register known to hold their address
+        std::vector<std::uint32_t> callees_;
+
+        // CALLr and JPr whose register holds the same function address every time they run
+        std::vector<ResolvedBranch> resolved_branches_;
+
+        // CALLr loading their target from a slot of the pool's function tables
+        std::vector<GuardedCall> guarded_calls_;
+
+        // FunctionAttribute flags, from the whole program call graph
+        std::uint8_t attributes_;
+
         bool is_entry_point_;
     };
 }
\ No newline at end of file
@@ -1,20 +1,158 @@
 #include "ObjectCache.h"
 #include "Constants.h"
 
-#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <format>
 #include <filesystem>
+#include <utility>
+#include <vector>
 
+#include <llvm/Support/Compression.h>
 #include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Process.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/TargetParser/Host.h>
+#include <llvm/Support/xxhash.h>
+#include <llvm/ADT/StringMap.h>
 
 #include <llvm/IR/Module.h>
-#include <nlohmann/json.hpp>
-
-using namespace nlohmann;
 
 namespace Pip2 {
-    ObjectCache::ObjectCache(const std::string &cache_root_path)
-        : cache_root_path_(cache_root_path) {
+    static constexpr std::uint32_t OBJECT_CACHE_MAGIC = 0x434F3250; // P2OC
+    static constexpr std::uint32_t OBJECT_CACHE_FLAG_USE_TASK = 1 << 0;
+    static constexpr int ZSTD_MAX_COMPRESSION_LEVEL = 22;
+
+    static constexpr std::uint32_t ANALYSIS_CACHE_MAGIC = 0x4E413250; // P2AN
+    static constexpr std::uint32_t ANALYSIS_CACHE_FLAG_USE_TASK = 1 << 0;
+
+    // Bytes stored for each entry with all its arrays empty, to tell a corrupt count from a real one
+    static constexpr std::size_t MIN_ANALYSIS_FUNCTION_SIZE = 4 + 4 + 1 + 1 + 4 * 5;
+    static constexpr std::size_t MIN_ANALYSIS_RESOLVED_BRANCH_SIZE = 4 + 4;
+    static constexpr std::size_t MIN_ANALYSIS_GUARDED_CALL_SIZE = 4 + 4;
+    static constexpr std::size_t MIN_ANALYSIS_JUMP_TABLE_SIZE = 4 + 4 + 4 + 1 + 4;
+
+    static constexpr std::uint32_t PARTITION_MANIFEST_MAGIC = 0x4D503250; // P2PM
+
+    ObjectCacheLock::ObjectCacheLock(int fd)
+        : fd_(fd) {
+    }
+
+    ObjectCacheLock::~ObjectCacheLock() {
+        if (fd_ != -1) {
+            llvm::sys::fs::unlockFile(fd_);
+            llvm::sys::Process::SafelyCloseFileDescriptor(fd_);
+        }
+    }
+
+    ObjectCacheLock::ObjectCacheLock(ObjectCacheLock &&other) noexcept
+        : fd_(std::exchange(other.fd_, -1)) {
+    }
+
+    ObjectCacheLock &ObjectCacheLock::operator=(ObjectCacheLock &&other) noexcept {
+        if (this != &other) {
+            ObjectCacheLock released(std::move(*this));
+            fd_ = std::exchange(other.fd_, -1);
+        }
+
+        return *this;
+    }
+
+    ObjectCache::ObjectCache(const std::string &cache_root_path, int compression_level)
+        : cache_root_path_(cache_root_path)
+        , compression_level_(compression_level) {
+    }
+
+    std::string ObjectCache::get_analysis_key(const VMConfig &config, const VMOptions &options) {
+        // The heap, the stack and the BSS don't change the analysis, and hashing them would cost more than the text
+        const std::uint64_t text_hash = llvm::xxHash64(llvm::ArrayRef<std::uint8_t>(config.memory_base() + options.text_base_,
+                                                                                    options.text_size_));
+        const std::uint64_t pool_items_hash = llvm::xxHash64(llvm::ArrayRef<std::uint8_t>(
+                reinterpret_cast<const std::uint8_t*>(config.pool_items().pool_items_base()),
+                config.pool_items().pool_item_count() * sizeof(std::uint64_t)));
+
+        const std::string key_data = std::format("{}|{:016X}|{}|{}|{:016X}|{}|{}", Pip2::ANALYSIS_VERSION, text_hash, options.text_base_,
+                                                 options.text_size_, pool_items_hash, config.pool_items().pool_item_count(),
+                                                 options.entry_point_);
+
+        return std::format("{:016X}", llvm::xxHash64(key_data));
+    }
+
+    std::string ObjectCache::get_module_key(const std::string &analysis_key, const VMOptions &options) {
+        std::vector<std::string> host_features;
+        llvm::StringMap<bool> host_feature_map;
+
+        if (llvm::sys::getHostCPUFeatures(host_feature_map)) {
+            for (const auto &feature: host_feature_map) {
+                if (feature.second) {
+                    host_features.push_back(feature.first().str());
+                }
+            }
+
+            std::sort(host_features.begin(), host_features.end());
+        }
+
+        std::string key_data = std::format("{}|{}|{}|{}|{}|{}|{}|{}|{}", Pip2::CACHE_VERSION, LLVM_VERSION_STRING,
+                                           llvm::sys::getProcessTriple(), llvm::sys::getHostCPUName().str(),
+                                           analysis_key, options.divide_by_zero_result_zero, options.cache_registers_,
+                                           options.host_calling_convention_, options.call_site_counters_);
+
+        for (const auto &feature: host_features) {
+            key_data += "|" + feature;
+        }
+
+        return std::format("{:016X}", llvm::xxHash64(key_data));
+    }
+
+    ObjectCacheLock ObjectCache::lock_module(const std::string &module_name) {
+        const std::filesystem::path lock_path = cache_root_path_ / std::filesystem::path(module_name).replace_extension(".lock");
+        std::error_code ec;
+
+        std::filesystem::create_directories(lock_path.parent_path(), ec);
+
+        int fd = -1;
+        if (llvm::sys::fs::openFileForReadWrite(lock_path.string(), fd, llvm::sys::fs::CD_OpenAlways, llvm::sys::fs::OF_None)) {
+            // Without a lock file, compile anyway. Atomic writes keep the cache consistent, only the work is duplicated
+            return {};
+        }
+
+        if (llvm::sys::fs::lockFile(fd)) {
+            llvm::sys::Process::SafelyCloseFileDescriptor(fd);
+            return {};
+        }
+
+        return ObjectCacheLock(fd);
+    }
+
+    // Write to a temporary file first and rename it over the destination, so a reader sees either nothing or a
+    // complete file, even if this process dies halfway
+    static bool write_file_atomically(const std::filesystem::path &path, std::initializer_list<llvm::StringRef> parts) {
+        int fd = -1;
+        llvm::SmallString<256> temp_path;
+
+        if (llvm::sys::fs::createUniqueFile(path.string() + ".%%%%%%%%.tmp", fd, temp_path)) {
+            return false;
+        }
+
+        bool written = false;
+
+        {
+            llvm::raw_fd_ostream os(fd, /*shouldClose=*/true);
+            for (const auto &part: parts) {
+                os.write(part.data(), part.size());
+            }
+            os.close();
+
+            written = !os.has_error();
+            os.clear_error();
+        }
+
+        if (!written || llvm::sys::fs::rename(temp_path, path.string())) {
+            llvm::sys::fs::remove(temp_path);
+            return false;
+        }
+
+        return true;
     }
 
     std::filesystem::path ObjectCache::get_cache_path(const std::string &module_name)
@@ -22,63 +160,374 @@ namespace Pip2 {
         return cache_root_path_ / std::filesystem::path(module_name).replace_extension(".obj");
     }
 
-    std::filesystem::path ObjectCache::get_cache_meta_path(const std::string &module_name)
-    {
-        return cache_root_path_ / std::filesystem::path(module_name).replace_extension(".obj.meta");
-    }
+    static std::unique_ptr<llvm::MemoryBuffer> decompress_object(const ObjectCacheHeader &header,
+                                                                 std::unique_ptr<llvm::MemoryBuffer> stored_buffer,
+                                                                 const std::string &buffer_name) {
+        if (header.compression_ == OBJECT_CACHE_COMPRESSION_NONE) {
+            return (header.object_size_ == header.stored_size_) ? std::move(stored_buffer) : nullptr;
+        }
 
-    std::unique_ptr<llvm::MemoryBuffer> ObjectCache::load(const std::string &module_name, bool *does_module_use_task) {
-        auto cache_meta_path = get_cache_meta_path(module_name);
-        if (!std::filesystem::exists(cache_meta_path)) {
+        auto object_buffer = llvm::WritableMemoryBuffer::getNewUninitMemBuffer(header.object_size_, buffer_name);
+        if (!object_buffer) {
             return nullptr;
         }
 
-        std::ifstream meta_file_stream(cache_meta_path.string());
-        try {
-            json meta_file = json::parse(meta_file_stream);
-            if (meta_file["version"] != Pip2::CACHE_VERSION) {
-                // Force recompile
+        llvm::ArrayRef<std::uint8_t> input(reinterpret_cast<const std::uint8_t*>(stored_buffer->getBufferStart()),
+                                           stored_buffer->getBufferSize());
+        auto *output = reinterpret_cast<std::uint8_t*>(object_buffer->getBufferStart());
+        std::size_t object_size = header.object_size_;
+
+        llvm::Error error = llvm::Error::success();
+
+        switch (header.compression_) {
+            case OBJECT_CACHE_COMPRESSION_ZLIB:
+                if (!llvm::compression::zlib::isAvailable()) {
+                    return nullptr;
+                }
+                error = llvm::compression::zlib::decompress(input, output, object_size);
+                break;
+
+            case OBJECT_CACHE_COMPRESSION_ZSTD:
+                if (!llvm::compression::zstd::isAvailable()) {
+                    return nullptr;
+                }
+                error = llvm::compression::zstd::decompress(input, output, object_size);
+                break;
+
+            default:
                 return nullptr;
-            }
-            if (does_module_use_task != nullptr) {
-                *does_module_use_task = meta_file.value<bool>("use_task", false);
-            }
-        } catch (std::exception &ex) {
         }
 
-        auto cache_path = get_cache_path(module_name);
-        if (!std::filesystem::exists(cache_path)) {
+        if (error) {
+            llvm::consumeError(std::move(error));
             return nullptr;
         }
 
-        std::error_code ec;
-        auto buffer = llvm::MemoryBuffer::getFile(cache_path.string(), -1, false);
-        if (buffer) {
-            return std::move(*buffer);
+        if (object_size != header.object_size_) {
+            return nullptr;
         }
-        return nullptr;
+
+        return object_buffer;
     }
 
-    bool ObjectCache::does_cache_exist(const std::string &module_name) {
-        return std::filesystem::exists(get_cache_path(module_name).string());
+    std::unique_ptr<llvm::MemoryBuffer> ObjectCache::load(const std::string &module_name, bool *does_module_use_task) {
+        const std::string cache_path = get_cache_path(module_name).string();
+
+        auto file = llvm::sys::fs::openNativeFileForRead(cache_path);
+        if (!file) {
+            llvm::consumeError(file.takeError());
+            return nullptr;
+        }
+
+        std::unique_ptr<llvm::MemoryBuffer> object_buffer;
+        ObjectCacheHeader header{};
+        llvm::sys::fs::file_status status;
+
+        auto read_size = llvm::sys::fs::readNativeFile(*file, llvm::MutableArrayRef<char>(reinterpret_cast<char*>(&header), sizeof(header)));
+        if (!read_size) {
+            llvm::consumeError(read_size.takeError());
+        } else if ((*read_size == sizeof(header)) && (header.magic_ == OBJECT_CACHE_MAGIC) &&
+            (header.version_ == Pip2::CACHE_VERSION) && !llvm::sys::fs::status(*file, status) &&
+            (status.getSize() == sizeof(header) + header.stored_size_)) {
+            // Map only the stored object, the header has already been consumed
+            auto buffer = llvm::MemoryBuffer::getOpenFileSlice(*file, cache_path, header.stored_size_, sizeof(header));
+            if (buffer) {
+                object_buffer = decompress_object(header, std::move(*buffer), cache_path);
+
+                if (object_buffer && (does_module_use_task != nullptr)) {
+                    *does_module_use_task = (header.flags_ & OBJECT_CACHE_FLAG_USE_TASK) != 0;
+                }
+            }
+        }
+
+        llvm::sys::fs::closeFile(*file);
+        return object_buffer;
     }
 
     void ObjectCache::notifyObjectCompiled(const llvm::Module *M, llvm::MemoryBufferRef Obj) {
         std::string module_name = M->getName().str();
-        std::string cache_path = get_cache_path(module_name).string();
+        std::filesystem::path cache_path = get_cache_path(module_name);
         std::error_code ec;
-        llvm::raw_fd_ostream os(cache_path, ec, llvm::sys::fs::OF_None);
-        os.write(Obj.getBufferStart(), Obj.getBufferSize());
 
-        {
-            std::string cache_meta_path = get_cache_meta_path(M->getName().str()).string();
-            std::ofstream meta_file_stream(cache_meta_path);
-            json meta_file;
-            meta_file["version"] = Pip2::CACHE_VERSION;
-            meta_file["use_task"] =
-                    (use_task_modules_.find(module_name) != use_task_modules_.end()) && use_task_modules_[module_name];
-            meta_file_stream << meta_file.dump(4);
+        // Lazily compiled functions are grouped in a sub-directory per module
+        std::filesystem::create_directories(cache_path.parent_path(), ec);
+
+        auto use_task = use_task_modules_.find(module_name);
+
+        llvm::ArrayRef<std::uint8_t> stored_object(reinterpret_cast<const std::uint8_t*>(Obj.getBufferStart()),
+                                                   Obj.getBufferSize());
+        llvm::SmallVector<std::uint8_t, 0> compressed_object;
+
+        ObjectCacheHeader header{};
+        header.magic_ = OBJECT_CACHE_MAGIC;
+        header.version_ = Pip2::CACHE_VERSION;
+        header.flags_ = ((use_task != use_task_modules_.end()) && use_task->second) ? OBJECT_CACHE_FLAG_USE_TASK : 0;
+        header.compression_ = OBJECT_CACHE_COMPRESSION_NONE;
+        header.object_size_ = Obj.getBufferSize();
+
+        if (compression_level_ > 0) {
+            if (llvm::compression::zstd::isAvailable()) {
+                llvm::compression::zstd::compress(stored_object, compressed_object,
+                                                   std::min(compression_level_, ZSTD_MAX_COMPRESSION_LEVEL));
+                header.compression_ = OBJECT_CACHE_COMPRESSION_ZSTD;
+            } else if (llvm::compression::zlib::isAvailable()) {
+                llvm::compression::zlib::compress(stored_object, compressed_object,
+                                                   std::min(compression_level_, llvm::compression::zlib::BestSizeCompression));
+                header.compression_ = OBJECT_CACHE_COMPRESSION_ZLIB;
+            }
+
+            if (header.compression_ != OBJECT_CACHE_COMPRESSION_NONE) {
+                stored_object = compressed_object;
+            }
         }
+
+        header.stored_size_ = stored_object.size();
+
+        write_file_atomically(cache_path, { llvm::StringRef(reinterpret_cast<const char*>(&header), sizeof(header)),
+                                            llvm::StringRef(reinterpret_cast<const char*>(stored_object.data()), stored_object.size()) });
+    }
+
+    namespace {
+        struct AnalysisCacheHeader {
+            std::uint32_t magic_;
+            std::uint32_t version_;
+            std::uint32_t flags_;
+            std::uint32_t function_count_;
+        };
+
+        class AnalysisWriter {
+        private:
+            std::string data_;
+
+        public:
+            template <typename T>
+            void write(T value) {
+                data_.append(reinterpret_cast<const char*>(&value), sizeof(T));
+            }
+
+            template <typename T, typename C>
+            void write_array(const C &values) {
+                write(static_cast<std::uint32_t>(values.size()));
+                for (const auto value: values) {
+                    write(static_cast<T>(value));
+                }
+            }
+
+            [[nodiscard]] const std::string &data() const { return data_; }
+        };
+
+        class AnalysisReader {
+        private:
+            const char *current_;
+            const char *end_;
+            bool failed_ = false;
+
+        public:
+            explicit AnalysisReader(llvm::StringRef data)
+                : current_(data.begin()), end_(data.end()) {
+            }
+
+            template <typename T>
+            T read() {
+                T value{};
+
+                if (failed_ || (static_cast<std::size_t>(end_ - current_) < sizeof(T))) {
+                    failed_ = true;
+                    return value;
+                }
+
+                std::memcpy(&value, current_, sizeof(T));
+                current_ += sizeof(T);
+
+                return value;
+            }
+
+            // Don't trust a count of elements the data left is too short to hold, it would only waste memory
+            bool check_count(std::uint64_t count, std::size_t min_element_size) {
+                if (failed_ || (count * min_element_size > static_cast<std::size_t>(end_ - current_))) {
+                    failed_ = true;
+                }
+
+                return !failed_;
+            }
+
+            std::uint32_t read_count(std::size_t min_element_size) {
+                const auto count = read<std::uint32_t>();
+                return check_count(count, min_element_size) ? count : 0;
+            }
+
+            template <typename T, typename C>
+            void read_array(C &values) {
+                values.resize(read_count(sizeof(T)));
+                for (auto &value: values) {
+                    value = read<T>();
+                }
+            }
+
+            [[nodiscard]] bool failed() const { return failed_; }
+            [[nodiscard]] bool at_end() const { return current_ == end_; }
+        };
+    }
+
+    bool ObjectCache::load_analysis(const std::string &analysis_key, std::vector<Function> &functions,
+                                    bool &does_program_use_task) {
+        const std::filesystem::path analysis_path = cache_root_path_ / (analysis_key + ".analysis");
+
+        auto buffer = llvm::MemoryBuffer::getFile(analysis_path.string(), /*IsText=*/false, /*RequiresNullTerminator=*/false);
+        if (!buffer) {
+            return false;
+        }
+
+        AnalysisReader reader((*buffer)->getBuffer());
+        const auto header = reader.read<AnalysisCacheHeader>();
+
+        if (reader.failed() || (header.magic_ != ANALYSIS_CACHE_MAGIC) || (header.version_ != Pip2::ANALYSIS_VERSION)) {
+            return false;
+        }
+
+        if (!reader.check_count(header.function_count_, MIN_ANALYSIS_FUNCTION_SIZE)) {
+            return false;
+        }
+
+        std::vector<Function> loaded_functions(header.function_count_);
+
+        for (auto &function: loaded_functions) {
+            function.addr_ = reader.read<std::uint32_t>();
+            function.length_ = reader.read<std::uint32_t>();
+            function.is_entry_point_ = reader.read<std::uint8_t>() != 0;
+            function.attributes_ = reader.read<std::uint8_t>();
+
+            reader.read_array<std::uint32_t>(function.labels_);
+            reader.read_array<std::uint32_t>(function.callees_);
+
+            function.resolved_branches_.resize(reader.read_count(MIN_ANALYSIS_RESOLVED_BRANCH_SIZE));
+
+            for (auto &branch: function.resolved_branches_) {
+                branch.instruction_addr_ = reader.read<std::uint32_t>();
+                branch.target_addr_ = reader.read<std::uint32_t>();
+            }
+
+            function.guarded_calls_.resize(reader.read_count(MIN_ANALYSIS_GUARDED_CALL_SIZE));
+
+            for (auto &guarded_call: function.guarded_calls_) {
+                guarded_call.instruction_addr_ = reader.read<std::uint32_t>();
+                reader.read_array<std::uint32_t>(guarded_call.targets_);
+            }
+
+            function.jump_tables_.resize(reader.read_count(MIN_ANALYSIS_JUMP_TABLE_SIZE));
+
+            for (auto &jump_table: function.jump_tables_) {
+                jump_table.jump_instruction_addr_ = reader.read<std::uint32_t>();
+                jump_table.jump_table_base_addr_ = reader.read<std::uint32_t>();
+                jump_table.switch_value_resolved_addr_ = reader.read<std::uint32_t>();
+                jump_table.switch_value_register_ = static_cast<Register>(reader.read<std::uint8_t>());
+
+                reader.read_array<std::uint32_t>(jump_table.labels_);
+            }
+
+            if (reader.failed()) {
+                return false;
+            }
+        }
+
+        if (!reader.at_end()) {
+            return false;
+        }
+
+        functions = std::move(loaded_functions);
+        does_program_use_task = (header.flags_ & ANALYSIS_CACHE_FLAG_USE_TASK) != 0;
+
+        return true;
+    }
+
+    void ObjectCache::store_analysis(const std::string &analysis_key, const std::vector<Function> &functions,
+                                     bool does_program_use_task) {
+        std::error_code ec;
+        std::filesystem::create_directories(cache_root_path_, ec);
+
+        AnalysisWriter writer;
+        writer.write(AnalysisCacheHeader {
+            .magic_ = ANALYSIS_CACHE_MAGIC,
+            .version_ = Pip2::ANALYSIS_VERSION,
+            .flags_ = does_program_use_task ? ANALYSIS_CACHE_FLAG_USE_TASK : 0,
+            .function_count_ = static_cast<std::uint32_t>(functions.size())
+        });
+
+        for (const auto &function: functions) {
+            writer.write(function.addr_);
+            writer.write(static_cast<std::uint32_t>(function.length_));
+            writer.write(static_cast<std::uint8_t>(function.is_entry_point_));
+            writer.write(function.attributes_);
+
+            writer.write_array<std::uint32_t>(function.labels_);
+            writer.write_array<std::uint32_t>(function.callees_);
+
+            writer.write(static_cast<std::uint32_t>(function.resolved_branches_.size()));
+
+            for (const auto &branch: function.resolved_branches_) {
+                writer.write(branch.instruction_addr_);
+                writer.write(branch.target_addr_);
+            }
+
+            writer.write(static_cast<std::uint32_t>(function.guarded_calls_.size()));
+
+            for (const auto &guarded_call: function.guarded_calls_) {
+                writer.write(guarded_call.instruction_addr_);
+                writer.write_array<std::uint32_t>(guarded_call.targets_);
+            }
+
+            writer.write(static_cast<std::uint32_t>(function.jump_tables_.size()));
+
+            for (const auto &jump_table: function.jump_tables_) {
+                writer.write(jump_table.jump_instruction_addr_);
+                writer.write(jump_table.jump_table_base_addr_);
+                writer.write(jump_table.switch_value_resolved_addr_);
+                writer.write(static_cast<std::uint8_t>(jump_table.switch_value_register_));
+
+                writer.write_array<std::uint32_t>(jump_table.labels_);
+            }
+        }
+
+        write_file_atomically(cache_root_path_ / (analysis_key + ".analysis"), { writer.data() });
+    }
+
+    namespace {
+        struct PartitionManifest {
+            std::uint32_t magic_;
+            std::uint32_t version_;
+            std::uint32_t partition_count_;
+            std::uint32_t reserved_;
+        };
+    }
+
+    std::size_t ObjectCache::load_partition_count(const std::string &module_name) {
+        const std::filesystem::path manifest_path = cache_root_path_ / std::filesystem::path(module_name).replace_extension(".manifest");
+
+        auto buffer = llvm::MemoryBuffer::getFile(manifest_path.string(), /*IsText=*/false, /*RequiresNullTerminator=*/false);
+        if (!buffer || ((*buffer)->getBufferSize() != sizeof(PartitionManifest))) {
+            return 0;
+        }
+
+        PartitionManifest manifest{};
+        std::memcpy(&manifest, (*buffer)->getBufferStart(), sizeof(PartitionManifest));
+
+        if ((manifest.magic_ != PARTITION_MANIFEST_MAGIC) || (manifest.version_ != Pip2::CACHE_VERSION)) {
+            return 0;
+        }
+
+        return manifest.partition_count_;
+    }
+
+    void ObjectCache::store_partition_count(const std::string &module_name, std::size_t partition_count) {
+        const PartitionManifest manifest {
+            .magic_ = PARTITION_MANIFEST_MAGIC,
+            .version_ = Pip2::CACHE_VERSION,
+            .partition_count_ = static_cast<std::uint32_t>(partition_count),
+            .reserved_ = 0
+        };
+
+        write_file_atomically(cache_root_path_ / std::filesystem::path(module_name).replace_extension(".manifest"),
+                              { llvm::StringRef(reinterpret_cast<const char*>(&manifest), sizeof(manifest)) });
     }
 
     std::unique_ptr<llvm::MemoryBuffer> ObjectCache::getObject(const llvm::Module *M) {
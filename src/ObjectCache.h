@@ -2,25 +2,121 @@
 
 #include <llvm/ExecutionEngine/ObjectCache.h>
 
+#include "Function.h"
+#include "VMConfig.h"
+#include "VMOptions.h"
+
+#include <cstdint>
 #include <filesystem>
 #include <map>
 #include <string>
+#include <vector>
 
 namespace Pip2 {
+    /**
+     * @brief Header at the start of every cached object file, followed directly by the stored object.
+     *
+     * The size is kept a multiple of 16 so the object stays aligned when the file is mapped.
+     */
+    struct ObjectCacheHeader {
+        std::uint32_t magic_;
+        std::uint32_t version_;
+        std::uint32_t flags_;
+        std::uint32_t compression_;
+        std::uint64_t object_size_;
+        std::uint64_t stored_size_;
+    };
+
+    enum ObjectCacheCompression : std::uint32_t {
+        OBJECT_CACHE_COMPRESSION_NONE = 0,
+        OBJECT_CACHE_COMPRESSION_ZLIB = 1,
+        OBJECT_CACHE_COMPRESSION_ZSTD = 2
+    };
+
+    static_assert(sizeof(ObjectCacheHeader) % 16 == 0);
+
+    /**
+     * @brief Advisory lock on a cached module, shared between all processes using the same cache directory.
+     *
+     * The lock is released when the object is destroyed, or by the OS when the owning process dies.
+     */
+    class ObjectCacheLock {
+    private:
+        int fd_ = -1;
+
+    public:
+        ObjectCacheLock() = default;
+        explicit ObjectCacheLock(int fd);
+        ~ObjectCacheLock();
+
+        ObjectCacheLock(const ObjectCacheLock &) = delete;
+        ObjectCacheLock &operator=(const ObjectCacheLock &) = delete;
+
+        ObjectCacheLock(ObjectCacheLock &&other) noexcept;
+        ObjectCacheLock &operator=(ObjectCacheLock &&other) noexcept;
+    };
+
     class ObjectCache: public llvm::ObjectCache {
     private:
         std::filesystem::path cache_root_path_;
+        int compression_level_;
 
         std::filesystem::path get_cache_path(const std::string &module_name);
-        std::filesystem::path get_cache_meta_path(const std::string &module_name);
 
         std::map<std::string, bool> use_task_modules_;
 
     public:
-        explicit ObjectCache(const std::string &cache_root_path_);
+        explicit ObjectCache(const std::string &cache_root_path_, int compression_level = 0);
+
+        /**
+         * @brief Get the key of the analysis results of a program.
+         *
+         * The key is a hash of the text segment, the pool items, their bases and sizes and the entry point, so it
+         * survives LLVM upgrades and cache version bumps. options.text_size_ must already be set.
+         */
+        static std::string get_analysis_key(const VMConfig &config, const VMOptions &options);
 
+        /**
+         * @brief Get the cache key of a program, used as the base name of its modules.
+         *
+         * The key extends the analysis key with the options affecting the generated code, the LLVM version and the
+         * host CPU.
+         */
+        static std::string get_module_key(const std::string &analysis_key, const VMOptions &options);
+
+        /**
+         * @brief Load the analysis results stored for a program.
+         *
+         * Returns false when there are none or they are unusable, leaving the outputs untouched.
+         */
+        bool load_analysis(const std::string &analysis_key, std::vector<Function> &functions, bool &does_program_use_task);
+        void store_analysis(const std::string &analysis_key, const std::vector<Function> &functions, bool does_program_use_task);
+
+        /**
+         * @brief Open the cached object of a module, mapping it read-only when possible.
+         *
+         * An uncompressed object is returned as a slice right after the header, so it can be handed to the JIT without
+         * copying. A compressed one is decompressed straight into the returned buffer.
+         * Returns nullptr when there is no usable cache for the module.
+         */
         std::unique_ptr<llvm::MemoryBuffer> load(const std::string &module_name, bool *does_module_use_task = nullptr);
-        bool does_cache_exist(const std::string &module_name);
+
+        /**
+         * @brief Wait until no other process is compiling the module, then hold it for this one.
+         *
+         * A process that fails to find a module in the cache takes this lock, looks up the cache again, and only
+         * compiles when it is still missing, so processes sharing a cache directory compile each program once.
+         */
+        ObjectCacheLock lock_module(const std::string &module_name);
+
+        /**
+         * @brief Get the number of partitions of a module whose objects were all written to the cache.
+         *
+         * The manifest is only stored once every partition has been compiled, so a module left half written by a
+         * crashed or concurrent process reads as 0, which is a miss.
+         */
+        std::size_t load_partition_count(const std::string &module_name);
+        void store_partition_count(const std::string &module_name, std::size_t partition_count);
 
         void notifyObjectCompiled(const llvm::Module *M, llvm::MemoryBufferRef Obj) override;
         std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *M) override;
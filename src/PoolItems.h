@@ -19,6 +19,7 @@ namespace Pip2
       {
       }
 
+      const std::uint64_t *pool_items_base() const { return pool_items_; }
       std::size_t pool_item_count() const { return pool_item_count_; }
       bool is_pool_item_constant(const std::size_t number) const;
       bool is_pool_item_terminate_function(const std::size_t number) const;
@@ -1,4 +1,5 @@
 #include "ProgramAnalysis.h"
+#include "DecodedProgram.h"
 #include "Instruction.h"
 #include "Common.h"
 #include "Constants.h"
@@ -6,10 +7,18 @@
 #include <optional>
 #include <stdexcept>
 #include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <limits>
 #include <map>
+#include <mutex>
 #include <iostream>
 #include <format>
+#include <thread>
+#include <unordered_map>
 
 /**
  * The analysis process makes some assumptions about the compiled assembly, primarily:
@@ -52,197 +61,997 @@
  *
  * Where 49/353 is the pool item index containing the jump table base. The size of the jump table lies in either the bgt or the ble argument (which is 12/4 in this case).
  *
- * So far, these twos are the only jump table patterns that I found, they mainly make use of the temporary register r0.
+ * Rather than matching these patterns, the instructions leading to the jump are evaluated symbolically (see slice_jump_table). Any sequence that
+ * ends up loading the target from base + index * 4, with the index bounded by a compare on the way, is recognized, whatever the scaling, the
+ * order of the add or the kind of branch used for the bound.
  *
  * 2. Vtable
  *
  * So far, can't see any Vtable in Da Vinci's Code and Carmageddon. These twos are kind of the AAA of Mophun ecosystem already, but let just sees.
+ *
+ * 3. Callbacks
+ *
+ * CALLr and JPr often go through a register just loaded with a function address from the pool, either right before the branch or by every caller
+ * before a CALLl to the function doing the branch. The same slicing proves those registers constant, using only paths that are the single way
+ * to the branch, and the branch is then translated as a direct call (see resolve_register_branches and find_entry_constant_branches).
  */
 
-namespace Pip2
-{
-    static bool is_direct_branch(const Instruction &instruction)
-    {
-        switch (instruction.word_encoding.opcode)
-        {
-        case Opcode::BEQ:
-        case Opcode::BEQI:
-        case Opcode::BEQIB:
-        case Opcode::BNE:
-        case Opcode::BNEI:
-        case Opcode::BNEIB:
-        case Opcode::BLT:
-        case Opcode::BLTI:
-        case Opcode::BLTIB:
-        case Opcode::BLTU:
-        case Opcode::BLTUI:
-        case Opcode::BLTUIB:
-        case Opcode::BLE:
-        case Opcode::BLEI:
-        case Opcode::BLEIB:
-        case Opcode::BLEU:
-        case Opcode::BLEUI:
-        case Opcode::BLEUIB:
-        case Opcode::BGT:
-        case Opcode::BGTI:
-        case Opcode::BGTIB:
-        case Opcode::BGTU:
-        case Opcode::BGTUI:
-        case Opcode::BGTUIB:
-        case Opcode::BGE:
-        case Opcode::BGEI:
-        case Opcode::BGEIB:
-        case Opcode::BGEU:
-        case Opcode::BGEUI:
-        case Opcode::BGEUIB:
-        case Opcode::JPl:
-        case Opcode::CALLl:
-            return true;
-        default:
-            return false;
+namespace Pip2
+{
+    namespace
+    {
+        /**
+         * Work-stealing queue of function offsets to sweep. Each worker takes the newest item from its own queue and
+         * steals the oldest one from the others when it runs dry. Sweeping ends when no item is queued or in flight.
+         */
+        class SweepScheduler
+        {
+        private:
+            struct WorkerQueue
+            {
+                std::mutex mutex_;
+                std::deque<std::uint32_t> items_;
+            };
+
+            std::vector<WorkerQueue> queues_;
+
+            std::atomic<std::size_t> queued_count_{0};
+            std::atomic<std::size_t> pending_count_{0};
+            std::atomic<bool> stopped_{false};
+
+            std::mutex idle_mutex_;
+            std::condition_variable idle_condition_;
+
+            std::optional<std::uint32_t> try_take(std::size_t worker, bool steal)
+            {
+                WorkerQueue &queue = queues_[worker];
+                std::lock_guard<std::mutex> lock(queue.mutex_);
+
+                if (queue.items_.empty())
+                {
+                    return std::nullopt;
+                }
+
+                std::uint32_t item;
+
+                if (steal)
+                {
+                    item = queue.items_.front();
+                    queue.items_.pop_front();
+                }
+                else
+                {
+                    item = queue.items_.back();
+                    queue.items_.pop_back();
+                }
+
+                queued_count_--;
+                return item;
+            }
+
+            void wake_all()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(idle_mutex_);
+                }
+
+                idle_condition_.notify_all();
+            }
+
+        public:
+            explicit SweepScheduler(std::size_t worker_count)
+                : queues_(worker_count)
+            {
+            }
+
+            void push(std::size_t worker, std::uint32_t offset)
+            {
+                pending_count_++;
+
+                {
+                    std::lock_guard<std::mutex> lock(queues_[worker].mutex_);
+                    queues_[worker].items_.push_back(offset);
+                    queued_count_++;
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(idle_mutex_);
+                }
+
+                idle_condition_.notify_one();
+            }
+
+            std::optional<std::uint32_t> pop(std::size_t worker)
+            {
+                while (!stopped_)
+                {
+                    if (auto item = try_take(worker, false))
+                    {
+                        return item;
+                    }
+
+                    for (std::size_t i = 1; i < queues_.size(); i++)
+                    {
+                        if (auto item = try_take((worker + i) % queues_.size(), true))
+                        {
+                            return item;
+                        }
+                    }
+
+                    std::unique_lock<std::mutex> lock(idle_mutex_);
+                    idle_condition_.wait(lock, [this]()
+                    {
+                        return stopped_ || (queued_count_ != 0) || (pending_count_ == 0);
+                    });
+
+                    if (pending_count_ == 0)
+                    {
+                        return std::nullopt;
+                    }
+                }
+
+                return std::nullopt;
+            }
+
+            // Called once an item returned by pop has been swept, after its callees were pushed
+            void finish()
+            {
+                if (--pending_count_ == 0)
+                {
+                    wake_all();
+                }
+            }
+
+            void stop()
+            {
+                stopped_ = true;
+                wake_all();
+            }
+        };
+    }
+
+    namespace
+    {
+        /**
+         * Forward branch targets not reached yet by the sweep. The sweep address only grows, so the targets are kept in
+         * a min-heap and only the smallest one is ever compared against it. Targets that were stepped over (they land
+         * on a consumed dword) are never resolved, but still count as pending, like they did with a set.
+         */
+        class PendingLabels
+        {
+        private:
+            std::vector<std::uint32_t> heap_;
+            std::size_t passed_count_ = 0;
+
+        public:
+            void insert(std::uint32_t addr)
+            {
+                heap_.push_back(addr);
+                std::push_heap(heap_.begin(), heap_.end(), std::greater<>());
+            }
+
+            bool take(std::uint32_t addr)
+            {
+                bool found = false;
+
+                while (!heap_.empty() && (heap_.front() <= addr))
+                {
+                    if (heap_.front() == addr)
+                    {
+                        found = true;
+                    }
+                    else
+                    {
+                        passed_count_++;
+                    }
+
+                    std::pop_heap(heap_.begin(), heap_.end(), std::greater<>());
+                    heap_.pop_back();
+                }
+
+                return found;
+            }
+
+            [[nodiscard]] bool empty() const
+            {
+                return heap_.empty() && (passed_count_ == 0);
+            }
+        };
+    }
+
+    namespace
+    {
+        // Instructions followed back from an indirect jump when looking for its jump table
+        static constexpr std::size_t MAX_SLICE_LENGTH = 64;
+        static constexpr std::size_t MAX_JUMP_TABLE_CASES = 4096;
+
+        // Register fields are byte offsets into the register file, any 8-bit value fits in here
+        static constexpr std::size_t SLICE_REGISTER_COUNT = 64;
+
+        // More candidates than this are not worth a chain of compares in front of the indirect call
+        static constexpr std::size_t MAX_GUARDED_CALL_TARGETS = 4;
+
+        enum SymbolicValueKind
+        {
+            // scale_ * symbol + offset_, a constant when scale_ is zero
+            SYMBOLIC_LINEAR,
+            // Dword loaded from scale_ * symbol + offset_
+            SYMBOLIC_LOAD
+        };
+
+        /**
+         * Value of a register in terms of a symbol, which is an unknown value some register held at some point of the
+         * slice. Arithmetic wraps like the guest does.
+         */
+        struct SymbolicValue
+        {
+            SymbolicValueKind kind_ = SYMBOLIC_LINEAR;
+            std::size_t symbol_ = 0;
+            std::uint32_t scale_ = 0;
+            std::uint32_t offset_ = 0;
+
+            static SymbolicValue constant(std::uint32_t value)
+            {
+                return SymbolicValue{ SYMBOLIC_LINEAR, 0, 0, value };
+            }
+
+            static SymbolicValue symbol(std::size_t symbol)
+            {
+                return SymbolicValue{ SYMBOLIC_LINEAR, symbol, 1, 0 };
+            }
+
+            [[nodiscard]] bool is_constant() const
+            {
+                return (kind_ == SYMBOLIC_LINEAR) && (scale_ == 0);
+            }
+
+            [[nodiscard]] bool is_symbol(std::size_t symbol) const
+            {
+                return (kind_ == SYMBOLIC_LINEAR) && (symbol_ == symbol) && (scale_ == 1) && (offset_ == 0);
+            }
+        };
+
+        std::optional<SymbolicValue> symbolic_add(const SymbolicValue &lhs, const SymbolicValue &rhs)
+        {
+            if ((lhs.kind_ != SYMBOLIC_LINEAR) || (rhs.kind_ != SYMBOLIC_LINEAR))
+            {
+                return std::nullopt;
+            }
+
+            if (lhs.is_constant())
+            {
+                return SymbolicValue{ SYMBOLIC_LINEAR, rhs.symbol_, rhs.scale_, lhs.offset_ + rhs.offset_ };
+            }
+
+            if (rhs.is_constant() || (lhs.symbol_ == rhs.symbol_))
+            {
+                return SymbolicValue{ SYMBOLIC_LINEAR, lhs.symbol_, lhs.scale_ + rhs.scale_, lhs.offset_ + rhs.offset_ };
+            }
+
+            return std::nullopt;
+        }
+
+        std::optional<SymbolicValue> symbolic_multiply(const SymbolicValue &value, std::uint32_t factor)
+        {
+            if (value.kind_ != SYMBOLIC_LINEAR)
+            {
+                return std::nullopt;
+            }
+
+            return SymbolicValue{ SYMBOLIC_LINEAR, value.symbol_, value.scale_ * factor, value.offset_ * factor };
+        }
+
+        std::optional<SymbolicValue> symbolic_subtract(const SymbolicValue &lhs, const SymbolicValue &rhs)
+        {
+            auto negated = symbolic_multiply(rhs, std::numeric_limits<std::uint32_t>::max());
+            return negated.has_value() ? symbolic_add(lhs, negated.value()) : std::nullopt;
+        }
+
+        enum CompareRelation
+        {
+            COMPARE_GREATER,
+            COMPARE_GREATER_EQUAL,
+            COMPARE_LESS_EQUAL,
+            COMPARE_LESS
+        };
+
+        struct BranchCompare
+        {
+            CompareRelation relation_;
+            bool signed_;
+            // Compare against the rs field instead of the rs register
+            bool immediate_;
+            // Only the low byte of rd is compared
+            bool byte_;
+        };
+
+        std::optional<BranchCompare> classify_branch_compare(Opcode opcode)
+        {
+            switch (opcode)
+            {
+                case Opcode::BGT: return BranchCompare{ COMPARE_GREATER, true, false, false };
+                case Opcode::BGTU: return BranchCompare{ COMPARE_GREATER, false, false, false };
+                case Opcode::BGTI: return BranchCompare{ COMPARE_GREATER, true, true, false };
+                case Opcode::BGTUI: return BranchCompare{ COMPARE_GREATER, false, true, false };
+                case Opcode::BGTUIB: return BranchCompare{ COMPARE_GREATER, false, true, true };
+                case Opcode::BGE: return BranchCompare{ COMPARE_GREATER_EQUAL, true, false, false };
+                case Opcode::BGEU: return BranchCompare{ COMPARE_GREATER_EQUAL, false, false, false };
+                case Opcode::BGEI: return BranchCompare{ COMPARE_GREATER_EQUAL, true, true, false };
+                case Opcode::BGEUI: return BranchCompare{ COMPARE_GREATER_EQUAL, false, true, false };
+                case Opcode::BGEUIB: return BranchCompare{ COMPARE_GREATER_EQUAL, false, true, true };
+                case Opcode::BLE: return BranchCompare{ COMPARE_LESS_EQUAL, true, false, false };
+                case Opcode::BLEU: return BranchCompare{ COMPARE_LESS_EQUAL, false, false, false };
+                case Opcode::BLEI: return BranchCompare{ COMPARE_LESS_EQUAL, true, true, false };
+                case Opcode::BLEUI: return BranchCompare{ COMPARE_LESS_EQUAL, false, true, false };
+                case Opcode::BLEUIB: return BranchCompare{ COMPARE_LESS_EQUAL, false, true, true };
+                case Opcode::BLT: return BranchCompare{ COMPARE_LESS, true, false, false };
+                case Opcode::BLTU: return BranchCompare{ COMPARE_LESS, false, false, false };
+                case Opcode::BLTI: return BranchCompare{ COMPARE_LESS, true, true, false };
+                case Opcode::BLTUI: return BranchCompare{ COMPARE_LESS, false, true, false };
+                case Opcode::BLTUIB: return BranchCompare{ COMPARE_LESS, false, true, true };
+
+                // Signed byte compares leave 0x80-0xFF unbounded, and equality bounds nothing
+                default:
+                    return std::nullopt;
+            }
+        }
+
+        bool falls_through(const DecodedInstruction &decoded)
+        {
+            const Opcode opcode = decoded.opcode();
+
+            if ((opcode == Opcode::JPl) || (opcode == Opcode::JPr) || (opcode == Opcode::RET))
+            {
+                return false;
+            }
+
+            return !((opcode == Opcode::CALLl) && (decoded.operand_kind_ == DECODED_OPERAND_TERMINATE_FUNCTION));
+        }
+
+        // Instructions that may change registers other than rd, slicing does not look past them
+        bool clobbers_registers(Opcode opcode)
+        {
+            switch (opcode)
+            {
+                case Opcode::CALLl:
+                case Opcode::CALLr:
+                case Opcode::STORE:
+                case Opcode::RESTORE:
+                case Opcode::SYSCALL0:
+                case Opcode::SYSCALL1:
+                case Opcode::SYSCALL2:
+                case Opcode::SYSCALL3:
+                case Opcode::SYSCALL4:
+                case Opcode::SYSCPY:
+                case Opcode::SYSSET:
+                case Opcode::SLEEP:
+                case Opcode::KILLTASK:
+                case Opcode::BREAKPOINT:
+                case Opcode::JPr:
+                case Opcode::RET:
+                    return true;
+
+                default:
+                    return false;
+            }
+        }
+
+        /**
+         * Evaluates a straight path of instructions symbolically. Every register starts as its own symbol, results
+         * that can't be expressed as a linear value or a load of one become new symbols, and conditional branches
+         * along the path narrow the upper bound of the symbol they compare.
+         */
+        class SliceEvaluator
+        {
+        public:
+            using RegisterFile = std::array<SymbolicValue, SLICE_REGISTER_COUNT>;
+
+        private:
+            struct SymbolBounds
+            {
+                std::uint32_t upper_bound_ = std::numeric_limits<std::uint32_t>::max();
+                std::uint32_t low_byte_upper_bound_ = 0xFF;
+            };
+
+            std::vector<SymbolBounds> symbols_;
+            RegisterFile registers_;
+            bool valid_ = true;
+
+            std::size_t new_symbol()
+            {
+                symbols_.emplace_back();
+                return symbols_.size() - 1;
+            }
+
+            SymbolicValue &reg(Register reg)
+            {
+                if ((reg & 3) != 0)
+                {
+                    valid_ = false;
+                }
+
+                return registers_[reg / 4];
+            }
+
+            void set(Register rd, std::optional<SymbolicValue> value)
+            {
+                if (rd == Register::ZR)
+                {
+                    return;
+                }
+
+                reg(rd) = value.has_value() ? value.value() : SymbolicValue::symbol(new_symbol());
+            }
+
+            void narrow(std::size_t symbol, std::uint32_t bound, bool byte)
+            {
+                SymbolBounds &bounds = symbols_[symbol];
+
+                if (byte)
+                {
+                    bounds.low_byte_upper_bound_ = std::min(bounds.low_byte_upper_bound_, bound);
+                }
+                else
+                {
+                    bounds.upper_bound_ = std::min(bounds.upper_bound_, bound);
+
+                    if (bound <= 0xFF)
+                    {
+                        bounds.low_byte_upper_bound_ = std::min(bounds.low_byte_upper_bound_, bound);
+                    }
+                }
+            }
+
+            void constrain(const DecodedInstruction &decoded, const BranchCompare &compare, bool taken)
+            {
+                const auto &encoding = decoded.instruction_.two_sources_encoding;
+                std::int64_t limit;
+
+                if (compare.immediate_)
+                {
+                    limit = compare.signed_ ? static_cast<std::int8_t>(encoding.rs) : static_cast<std::uint8_t>(encoding.rs);
+                }
+                else
+                {
+                    const SymbolicValue &rhs = reg(encoding.rs);
+
+                    if (!rhs.is_constant())
+                    {
+                        return;
+                    }
+
+                    limit = compare.signed_ ? static_cast<std::int32_t>(rhs.offset_) : rhs.offset_;
+                }
+
+                // The fall through path of a greater compare and the taken path of a less compare bound rd from above
+                switch (compare.relation_)
+                {
+                    case COMPARE_GREATER:
+                        limit = taken ? -1 : limit;
+                        break;
+
+                    case COMPARE_GREATER_EQUAL:
+                        limit = taken ? -1 : limit - 1;
+                        break;
+
+                    case COMPARE_LESS_EQUAL:
+                        limit = taken ? limit : -1;
+                        break;
+
+                    case COMPARE_LESS:
+                        limit = taken ? limit - 1 : -1;
+                        break;
+                }
+
+                // A signed compare does not bound negative values. Like any index out of range, they reach the switch
+                // default, which jumps to whatever address was loaded
+                if ((limit >= 0) && (encoding.rd != Register::ZR))
+                {
+                    narrow(reg(encoding.rd).symbol_, static_cast<std::uint32_t>(limit), compare.byte_);
+                }
+            }
+
+        public:
+            explicit SliceEvaluator()
+            {
+                for (auto &value: registers_)
+                {
+                    value = SymbolicValue::symbol(new_symbol());
+                }
+
+                registers_[Register::ZR] = SymbolicValue::constant(0);
+            }
+
+            [[nodiscard]] bool valid() const { return valid_; }
+            [[nodiscard]] const RegisterFile &registers() const { return registers_; }
+            [[nodiscard]] const SymbolicValue &get(Register reg) { return this->reg(reg); }
+
+            [[nodiscard]] std::optional<std::uint32_t> upper_bound(std::size_t symbol) const
+            {
+                if (symbols_[symbol].upper_bound_ == std::numeric_limits<std::uint32_t>::max())
+                {
+                    return std::nullopt;
+                }
+
+                return symbols_[symbol].upper_bound_;
+            }
+
+            /**
+             * Make the register compared by a branch a plain symbol, so that the bound it gets is the bound of a value
+             * some register holds at this instruction.
+             */
+            void prepare(const DecodedInstruction &decoded)
+            {
+                const Register rd = decoded.instruction_.two_sources_encoding.rd;
+
+                if (classify_branch_compare(decoded.opcode()).has_value() && (rd != Register::ZR))
+                {
+                    SymbolicValue &value = reg(rd);
+
+                    if ((value.kind_ != SYMBOLIC_LINEAR) || (value.scale_ != 1) || (value.offset_ != 0))
+                    {
+                        value = SymbolicValue::symbol(new_symbol());
+                    }
+                }
+            }
+
+            void execute(const DecodedInstruction &decoded, bool taken)
+            {
+                const auto &encoding = decoded.instruction_.two_sources_encoding;
+                const std::optional<SymbolicValue> operand = decoded.has_constant_operand() ?
+                        std::optional<SymbolicValue>(SymbolicValue::constant(decoded.operand_)) : std::nullopt;
+
+                if (auto compare = classify_branch_compare(decoded.opcode()))
+                {
+                    constrain(decoded, compare.value(), taken);
+                    return;
+                }
+
+                switch (decoded.opcode())
+                {
+                    case Opcode::MOV:
+                        set(encoding.rd, reg(encoding.rs));
+                        break;
+
+                    case Opcode::LDQ:
+                        set(encoding.rd, SymbolicValue::constant(Common::sign_extend(decoded.instruction_.word_encoding.imm)));
+                        break;
+
+                    case Opcode::LDI:
+                        set(encoding.rd, operand);
+                        break;
+
+                    case Opcode::ADD:
+                        set(encoding.rd, symbolic_add(reg(encoding.rs), reg(encoding.rt)));
+                        break;
+
+                    case Opcode::ADDQ:
+                        set(encoding.rd, symbolic_add(reg(encoding.rs), SymbolicValue::constant(Common::sign_extend(encoding.rt))));
+                        break;
+
+                    case Opcode::ADDi:
+                        set(encoding.rd, operand.has_value() ? symbolic_add(reg(encoding.rs), operand.value()) : std::nullopt);
+                        break;
+
+                    case Opcode::SUB:
+                        set(encoding.rd, symbolic_subtract(reg(encoding.rs), reg(encoding.rt)));
+                        break;
+
+                    case Opcode::SUBi:
+                        set(encoding.rd, operand.has_value() ? symbolic_subtract(reg(encoding.rs), operand.value()) : std::nullopt);
+                        break;
+
+                    case Opcode::SLLi:
+                        set(encoding.rd, symbolic_multiply(reg(encoding.rs), 1U << (encoding.rt & 0x1F)));
+                        break;
+
+                    case Opcode::MULQ:
+                        set(encoding.rd, symbolic_multiply(reg(encoding.rs), encoding.rt));
+                        break;
+
+                    case Opcode::MULi:
+                        set(encoding.rd, operand.has_value() ? symbolic_multiply(reg(encoding.rs), operand->offset_) : std::nullopt);
+                        break;
+
+                    case Opcode::ANDi:
+                    {
+                        const SymbolicValue source = reg(encoding.rs);
+
+                        if (operand.has_value() && source.is_constant())
+                        {
+                            set(encoding.rd, SymbolicValue::constant(source.offset_ & operand->offset_));
+                            break;
+                        }
+
+                        set(encoding.rd, std::nullopt);
+
+                        if (operand.has_value() && (encoding.rd != Register::ZR))
+                        {
+                            std::uint32_t bound = operand->offset_;
+
+                            // Masking within the low byte keeps what a byte compare learnt about the source
+                            if (source.is_symbol(source.symbol_))
+                            {
+                                const SymbolBounds &source_bounds = symbols_[source.symbol_];
+                                bound = std::min(bound, source_bounds.upper_bound_);
+
+                                if (bound <= 0xFF)
+                                {
+                                    bound = std::min(bound, source_bounds.low_byte_upper_bound_);
+                                }
+                            }
+
+                            narrow(reg(encoding.rd).symbol_, bound, false);
+                        }
+
+                        break;
+                    }
+
+                    case Opcode::LDWd:
+                    {
+                        auto address = operand.has_value() ? symbolic_add(reg(encoding.rs), operand.value()) : std::nullopt;
+
+                        if (address.has_value())
+                        {
+                            address->kind_ = SYMBOLIC_LOAD;
+                        }
+
+                        set(encoding.rd, address);
+                        break;
+                    }
+
+                    case Opcode::NOP:
+                    case Opcode::STBd:
+                    case Opcode::STHd:
+                    case Opcode::STWd:
+                    case Opcode::STBi:
+                    case Opcode::STHi:
+                    case Opcode::STWi:
+                    case Opcode::JPl:
+                    case Opcode::BEQ:
+                    case Opcode::BNE:
+                    case Opcode::BEQI:
+                    case Opcode::BNEI:
+                    case Opcode::BEQIB:
+                    case Opcode::BNEIB:
+                    case Opcode::BGEIB:
+                    case Opcode::BGTIB:
+                    case Opcode::BLEIB:
+                    case Opcode::BLTIB:
+                        break;
+
+                    default:
+                        // Anything else is assumed to only write rd, with a value that is not tracked
+                        set(encoding.rd, std::nullopt);
+                        break;
+                }
+            }
+        };
+
+        struct SliceStep
+        {
+            std::uint32_t addr_;
+            // Whether the path leaves this instruction through its branch rather than falling through
+            bool branch_taken_;
+        };
+
+        using PredecessorCounts = std::unordered_map<std::uint32_t, std::uint32_t>;
+
+        /**
+         * Count the ways into each instruction of a function from inside the function: falling through, direct
+         * branches and jump table cases. Calls into the function are not counted.
+         */
+        PredecessorCounts count_predecessors(const DecodedProgram &program, const std::vector<std::uint32_t> &instructions,
+                                             const std::vector<JumpTable> &jump_tables)
+        {
+            PredecessorCounts counts;
+
+            for (const auto addr: instructions)
+            {
+                const DecodedInstruction &decoded = program.at(addr);
+
+                if (falls_through(decoded))
+                {
+                    counts[addr + (decoded.has(OPCODE_PROPERTY_CONSUMES_DWORD) ? INSTRUCTION_SIZE * 2 : INSTRUCTION_SIZE)]++;
+                }
+
+                if (decoded.has(OPCODE_PROPERTY_DIRECT_BRANCH) && (decoded.opcode() != Opcode::CALLl))
+                {
+                    if (auto target = decoded.direct_branch_target(addr))
+                    {
+                        counts[target.value()]++;
+                    }
+                }
+            }
+
+            for (const auto &jump_table: jump_tables)
+            {
+                for (const auto label: jump_table.labels_)
+                {
+                    counts[label]++;
+                }
+            }
+
+            return counts;
+        }
+
+        /**
+         * Follow the path back from the instruction at end_index. Where the previous instruction can't fall through,
+         * the path came from the nearest branch before it that targets the current instruction.
+         *
+         * With predecessor counts given, the path also stops at any instruction that can be reached in more than one
+         * way, so it's the only way to reach the end. reaches_start then tells whether it goes back to the first
+         * instruction.
+         */
+        std::vector<SliceStep> build_slice_path(const DecodedProgram &program, const std::vector<std::uint32_t> &instructions,
+                                                std::size_t end_index, const PredecessorCounts *predecessor_counts = nullptr,
+                                                bool *reaches_start = nullptr)
+        {
+            std::vector<SliceStep> steps{ SliceStep{ instructions[end_index], false } };
+            std::size_t index = end_index;
+            bool stopped = false;
+
+            while ((steps.size() < MAX_SLICE_LENGTH) && (index > 0))
+            {
+                const std::uint32_t current_addr = instructions[index];
+                std::size_t predecessor = index - 1;
+                bool branch_taken = false;
+
+                if (predecessor_counts != nullptr)
+                {
+                    auto count = predecessor_counts->find(current_addr);
+
+                    if ((count == predecessor_counts->end()) || (count->second != 1))
+                    {
+                        stopped = true;
+                        break;
+                    }
+                }
+
+                if (!falls_through(program.at(instructions[predecessor])))
+                {
+                    branch_taken = true;
+
+                    while (true)
+                    {
+                        const DecodedInstruction &candidate = program.at(instructions[predecessor]);
+
+                        if (candidate.has(OPCODE_PROPERTY_DIRECT_BRANCH) && (candidate.opcode() != Opcode::CALLl) &&
+                            (candidate.direct_branch_target(instructions[predecessor]) == current_addr))
+                        {
+                            break;
+                        }
+
+                        if (predecessor == 0)
+                        {
+                            branch_taken = false;
+                            break;
+                        }
+
+                        predecessor--;
+                    }
+
+                    if (!branch_taken)
+                    {
+                        stopped = true;
+                        break;
+                    }
+                }
+
+                if (clobbers_registers(program.at(instructions[predecessor]).opcode()))
+                {
+                    stopped = true;
+                    break;
+                }
+
+                steps.push_back(SliceStep{ instructions[predecessor], branch_taken });
+                index = predecessor;
+            }
+
+            if (reaches_start != nullptr)
+            {
+                *reaches_start = !stopped && (index == 0);
+            }
+
+            std::reverse(steps.begin(), steps.end());
+            return steps;
+        }
+
+        /**
+         * Evaluate a path up to, but not including, its last instruction. The registers before each step are kept
+         * in states when given.
+         */
+        SliceEvaluator evaluate_slice(const DecodedProgram &program, const std::vector<SliceStep> &steps,
+                                      std::vector<SliceEvaluator::RegisterFile> *states = nullptr)
+        {
+            SliceEvaluator evaluator;
+
+            for (std::size_t i = 0; i + 1 < steps.size(); i++)
+            {
+                const DecodedInstruction &decoded = program.at(steps[i].addr_);
+
+                evaluator.prepare(decoded);
+
+                if (states != nullptr)
+                {
+                    states->push_back(evaluator.registers());
+                }
+
+                evaluator.execute(decoded, steps[i].branch_taken_);
+            }
+
+            if (states != nullptr)
+            {
+                states->push_back(evaluator.registers());
+            }
+
+            return evaluator;
+        }
+
+        /**
+         * CALLr, or a JPr that is neither a return nor a recognized jump table: a branch to whatever address the
+         * register holds, which is worth resolving.
+         */
+        bool is_register_branch(const DecodedProgram &program, const Function &function, std::uint32_t addr)
+        {
+            const DecodedInstruction &decoded = program.at(addr);
+
+            if (decoded.opcode() == Opcode::CALLr)
+            {
+                return true;
+            }
+
+            if ((decoded.opcode() != Opcode::JPr) || (decoded.instruction_.two_sources_encoding.rd == Register::RA))
+            {
+                return false;
+            }
+
+            return std::none_of(function.jump_tables_.begin(), function.jump_tables_.end(), [addr](const JumpTable &jump_table) {
+                return jump_table.jump_instruction_addr_ == addr;
+            });
         }
-    }
 
-    static bool is_indirect_branch(const Instruction &instruction)
-    {
-        switch (instruction.word_encoding.opcode)
+        std::vector<std::uint32_t> function_instructions(const DecodedProgram &program, const Function &function)
         {
-        case Opcode::JPr:
-        case Opcode::CALLr: // Like ARM BL
-        case Opcode::RET:
-            return true;
-        default:
-            return false;
+            std::vector<std::uint32_t> instructions;
+            const std::uint32_t function_end = static_cast<std::uint32_t>(function.addr_ + function.length_);
+
+            for (std::uint32_t addr = function.addr_; addr < function_end;)
+            {
+                instructions.push_back(addr);
+                addr += program.at(addr).has(OPCODE_PROPERTY_CONSUMES_DWORD) ? INSTRUCTION_SIZE * 2 : INSTRUCTION_SIZE;
+            }
+
+            return instructions;
         }
     }
 
-    static bool is_branch_offset_encoded_in_instruction(const Instruction &instruction)
+    bool ProgramAnalysis::mark_function_found(std::uint32_t offset)
     {
-        switch (instruction.word_encoding.opcode)
-        {
-        case Opcode::BEQI:
-        case Opcode::BEQIB:
-        case Opcode::BNEI:
-        case Opcode::BNEIB:
-        case Opcode::BLTI:
-        case Opcode::BLTIB:
-        case Opcode::BLTUI:
-        case Opcode::BLTUIB:
-        case Opcode::BLEI:
-        case Opcode::BLEIB:
-        case Opcode::BLEUI:
-        case Opcode::BLEUIB:
-        case Opcode::BGTI:
-        case Opcode::BGTIB:
-        case Opcode::BGTUI:
-        case Opcode::BGTUIB:
-        case Opcode::BGEI:
-        case Opcode::BGEIB:
-        case Opcode::BGEUI:
-        case Opcode::BGEUIB:
-            return true;
-
-        default:
+        const std::size_t word = offset / INSTRUCTION_SIZE;
+
+        if (offset >= text_size_)
+        {
+            // Outside of the text segment, nothing to sweep
             return false;
         }
+
+        const std::uint64_t bit = std::uint64_t{1} << (word % 64);
+        return (found_functions_[word / 64].fetch_or(bit, std::memory_order_relaxed) & bit) == 0;
     }
 
-    static bool does_non_branch_instruction_consume_dword(const Instruction &instruction)
+    bool ProgramAnalysis::is_function_found(std::uint32_t offset) const
     {
-        switch (instruction.word_encoding.opcode)
-        {
-        case Opcode::STWd:
-        case Opcode::STHd:
-        case Opcode::STBd:
-        case Opcode::LDI:
-        case Opcode::LDWd:
-        case Opcode::LDHUd:
-        case Opcode::LDHd:
-        case Opcode::LDBUd:
-        case Opcode::LDBd:
-        case Opcode::ADDi:
-        case Opcode::SUBi:
-        case Opcode::MULi:
-        case Opcode::DIVi:
-        case Opcode::DIVUi:
-        case Opcode::ANDi:
-        case Opcode::ORi:
-        case Opcode::XORi:
-            return true;
-
-        default:
+        const std::size_t word = offset / INSTRUCTION_SIZE;
+
+        if (offset >= text_size_)
+        {
             return false;
         }
+
+        return (found_functions_[word / 64].load(std::memory_order_relaxed) & (std::uint64_t{1} << (word % 64))) != 0;
     }
 
-    std::optional<std::uint32_t> calculate_direct_jump_target(const PoolItems &pool_items,
-                                                              const Instruction &instruction,
-                                                              const std::uint32_t addr,
-                                                              const std::uint32_t next_word,
-                                                              bool &next_word_consumed,
-                                                              bool &is_termination)
+    std::optional<JumpTable> ProgramAnalysis::slice_jump_table(const std::vector<std::uint32_t> &instructions, std::size_t jump_index,
+                                                               const std::vector<std::uint32_t> &labels,
+                                                               const std::unordered_map<std::uint32_t, std::uint32_t> *predecessor_counts) const
     {
-        next_word_consumed = false;
-        is_termination = false;
+        const std::uint32_t jump_addr = instructions[jump_index];
+        const std::vector<SliceStep> steps = build_slice_path(program_, instructions, jump_index, predecessor_counts);
+
+        std::vector<SliceEvaluator::RegisterFile> states;
+        states.reserve(steps.size());
 
-        if (!is_direct_branch(instruction))
+        SliceEvaluator evaluator = evaluate_slice(program_, steps, &states);
+
+        // The jump target must be loaded from a table of dwords, indexed by a bounded value
+        const SymbolicValue target = evaluator.get(program_.at(jump_addr).instruction_.two_sources_encoding.rd);
+
+        if (!evaluator.valid() || (target.kind_ != SYMBOLIC_LOAD) || (target.scale_ != 4))
         {
-            return 0;
+            return std::nullopt;
         }
 
-        // Calculate the branch target
-        if (is_branch_offset_encoded_in_instruction(instruction))
+        const std::optional<std::uint32_t> bound = evaluator.upper_bound(target.symbol_);
+
+        if (!bound.has_value() || (bound.value() >= MAX_JUMP_TABLE_CASES))
         {
-            return addr + static_cast<std::int8_t>(instruction.two_sources_encoding.rt) * 4;
+            return std::nullopt;
         }
-        else
+
+        const std::size_t total_cases = bound.value() + 1;
+        const std::uint32_t table_addr = target.offset_;
+
+        const std::uint64_t table_last_addr = table_addr + static_cast<std::uint64_t>(total_cases - 1) * INSTRUCTION_SIZE;
+
+        // Only the text is part of the analysis cache key, so a table elsewhere can't be relied on
+        if (((table_addr % INSTRUCTION_SIZE) != 0) || !is_text_address(table_addr) || !is_text_address(table_last_addr))
         {
-            next_word_consumed = true;
+            return std::nullopt;
+        }
 
-            if (std::optional<std::uint32_t> immediate = Common::get_immediate_pip_dword(next_word))
-            {
-                return addr + static_cast<std::int32_t>(immediate.value());
-            }
+        JumpTable jump_table;
+        jump_table.jump_instruction_addr_ = jump_addr;
+        jump_table.jump_table_base_addr_ = table_addr;
 
-            if (pool_items.is_pool_item_terminate_function(next_word))
+        // Capture the index as late as possible, but not before the block of the jump starts, so that the captured
+        // value dominates the switch
+        bool captured = false;
+
+        for (std::size_t i = states.size(); (i > 0) && !captured; i--)
+        {
+            for (std::size_t reg = 1; reg < SLICE_REGISTER_COUNT; reg++)
             {
-                is_termination = true;
-                return std::nullopt;
+                if (states[i - 1][reg].is_symbol(target.symbol_))
+                {
+                    jump_table.switch_value_resolved_addr_ = steps[i - 1].addr_;
+                    jump_table.switch_value_register_ = static_cast<Register>(reg * 4);
+                    captured = true;
+                    break;
+                }
             }
 
-            if (pool_items.is_pool_item_constant(next_word))
+            if (std::find(labels.begin(), labels.end(), steps[i - 1].addr_) != labels.end())
             {
-                return pool_items.get_pool_item_constant(next_word);
+                break;
             }
-
-            return std::nullopt;
         }
-    }
 
-    void ProgramAnalysis::add_to_function_analyse_queue(std::uint32_t addr)
-    {
-        if (addr < text_base_)
+        if (!captured)
         {
-            throw std::runtime_error("Address is out of text segment");
+            return std::nullopt;
         }
 
-        if (!found_functions_.contains(addr - text_base_))
+        jump_table.labels_.resize(total_cases);
+
+        for (std::size_t i = 0; i < total_cases; i++)
         {
-            analyse_queue_.push(addr - text_base_);
-            found_functions_.emplace(addr - text_base_);
+            const std::uint32_t case_addr = memory_base_[(table_addr >> 2) + i];
+
+            if ((case_addr < text_base_) || (case_addr - text_base_ >= text_size_) || ((case_addr % INSTRUCTION_SIZE) != 0))
+            {
+                return std::nullopt;
+            }
+
+            jump_table.labels_[i] = case_addr;
         }
+
+        return jump_table;
     }
 
-    Function ProgramAnalysis::sweep_function(std::uint32_t addr, bool &does_function_use_task_inst, bool &does_function_call_task)
+    Function ProgramAnalysis::sweep_function(std::uint32_t addr, bool &does_function_use_task_inst, bool &does_function_call_task) const
     {
         Function result_function;
         result_function.addr_ = addr;
 
-        std::set<std::uint32_t> suspecting_to_be_labels;
+        PendingLabels suspecting_to_be_labels;
         std::vector<std::uint32_t> unfinished_blocks_left;
 
+        // Address of every instruction gone through so far, in order, for jump table slicing
+        std::vector<std::uint32_t> swept_instructions;
+
         unfinished_blocks_left.push_back(addr);
-        result_function.labels_.insert(addr);
+        result_function.labels_.push_back(addr);
 
         std::uint32_t current_going_through_block = addr;
 
@@ -258,342 +1067,573 @@ namespace Pip2
             {
                 throw std::runtime_error("Unfinished block not found in list");
             }
-        };
+        };
+
+        while (true)
+        {
+            if (suspecting_to_be_labels.take(addr))
+            {
+                // Found a label, add it to the result function
+                result_function.labels_.push_back(addr);
+
+                if (!unfinished_blocks_left.empty())
+                {
+                    mark_block_finished();
+                }
+
+                current_going_through_block = addr;
+                unfinished_blocks_left.push_back(addr);
+            }
+            else
+            {
+                if (unfinished_blocks_left.empty())
+                {
+                    if (!suspecting_to_be_labels.empty())
+                    {
+                        // Try to keep going, it may be a loop
+                        current_going_through_block = addr;
+
+                        unfinished_blocks_left.push_back(addr);
+                        result_function.labels_.push_back(addr);
+                    }
+                    else
+                    {
+                        // No more block to be expected
+                        result_function.length_ = addr - result_function.addr_;
+                        break;
+                    }
+                }
+            }
+
+            const DecodedInstruction &decoded = program_.at(addr);
+            const Instruction instruction = decoded.instruction_;
+            const auto opcode = decoded.opcode();
+
+            swept_instructions.push_back(addr);
+
+            if (opcode == Opcode::SLEEP || opcode == Opcode::KILLTASK) {
+                does_function_use_task_inst = true;
+            }
+
+            // Direct branch, we can follow it!
+            if (decoded.has(OPCODE_PROPERTY_DIRECT_BRANCH))
+            {
+                auto jump_target = decoded.direct_branch_target(addr);
+
+                if (decoded.has(OPCODE_PROPERTY_CONSUMES_DWORD))
+                {
+                    addr += INSTRUCTION_SIZE;
+                }
+
+                if (decoded.operand_kind_ == DECODED_OPERAND_TERMINATE_FUNCTION && !decoded.has(OPCODE_PROPERTY_OFFSET_IN_INSTRUCTION))
+                {
+                    // Terminate function ends the function prematurely!
+                    mark_block_finished();
+                }
+                else
+                {
+                    // If jump target is undefined, there are two possibilities:
+                    // 1. It's a HLE call (call to Mophun's library), in that case it's fine
+                    // 2. Failed to calculate jump target, in that case we should throw an exception
+                    if (!jump_target.has_value())
+                    {
+                        if (opcode == Opcode::CALLl) {
+                            SpecialPoolFunction special_function;
+                            if (pool_items_.is_pool_item_special_function(decoded.operand_, special_function)) {
+                                does_function_call_task = true;
+                            }
+                        } else {
+                            throw std::runtime_error("Failed to calculate jump target");
+                        }
+                    }
+
+                    if (jump_target.has_value())
+                    {
+                        if (instruction.word_encoding.opcode == Opcode::CALLl)
+                        {
+                            // Take a risk and not cut off the function after call (hopefully they are all neutral)
+                            // When a jp ra is found, the function will do a normal return instead. The callee is
+                            // queued for analysis once this function is done
+                            result_function.callees_.push_back(jump_target.value());
+                        }
+                        else
+                        {
+                            // Probably loop, don't analyse it, just add a label
+                            // As loop is kind of broad in terms of the condition, we probably will just let LLVM do the job
+                            // of detect and optimize potential loop
+                            if (jump_target.value() < addr)
+                            {
+                                result_function.labels_.push_back(jump_target.value());
+                            }
+                            else
+                            {
+                                suspecting_to_be_labels.insert(jump_target.value());
+                            }
+
+                            mark_block_finished();
+
+                            // Non conditional block won't continue the current flow
+                            if (instruction.word_encoding.opcode != Opcode::JPl && instruction.word_encoding.opcode != Opcode::CALLl)
+                            {
+                                current_going_through_block = addr + INSTRUCTION_SIZE;
+
+                                unfinished_blocks_left.push_back(addr + INSTRUCTION_SIZE);
+                                result_function.labels_.push_back(addr + INSTRUCTION_SIZE);
+                            }
+                        }
+                    }
+                }
+            }
+            else if (decoded.has(OPCODE_PROPERTY_INDIRECT_BRANCH))
+            {
+                /**
+                 * Some assumption:
+                 *
+                 * 1. CALL instruction seems to mostly be used for vtable call, so we are not able to find out which
+                 *    function it's calling to.
+                 *
+                 * 2. JP/RET instruction with RA register is mostly just a statement to return to the caller. But
+                 *    if we were to be safe, we should still detect if it's jump table or not
+                 *
+                 * This code block will try its best to detect a jump table and store it right away, so that the emitted
+                 * switch code will has its jump target detected at compile time.
+                 */
+
+                bool block_ending_sign_appear = true;
+
+                // Take a risk and cut off when jump to RA
+                if (instruction.two_sources_encoding.opcode == Opcode::JPr && instruction.two_sources_encoding.rd != Register::RA)
+                {
+                    // Branches further down may still join the path, the table is checked again once they are known
+                    if (auto jump_table = slice_jump_table(swept_instructions, swept_instructions.size() - 1, result_function.labels_))
+                    {
+                        for (const auto case_addr: jump_table->labels_)
+                        {
+                            if (case_addr >= addr) {
+                                suspecting_to_be_labels.insert(case_addr);
+                            } else {
+                                result_function.labels_.push_back(case_addr);
+                            }
+                        }
+
+                        // Can detect jump table and probably inline all the case blocks
+                        result_function.jump_tables_.push_back(std::move(jump_table.value()));
+                        block_ending_sign_appear = false;
+                    }
+                }
+                else if (instruction.two_sources_encoding.opcode == Opcode::CALLr) {
+                    block_ending_sign_appear = false;
+                }
+
+                if (block_ending_sign_appear)
+                {
+                    mark_block_finished();
+                }
+            }
+            else if (decoded.has(OPCODE_PROPERTY_CONSUMES_DWORD))
+            {
+                addr += sizeof(std::uint32_t);
+            }
+
+            addr += INSTRUCTION_SIZE;
+        }
+
+        if (!suspecting_to_be_labels.empty())
+        {
+            throw std::runtime_error("Some labels are not resolved!");
+        }
+
+        if (!unfinished_blocks_left.empty())
+        {
+            throw std::runtime_error("Some blocks are not finished!");
+        }
+
+        // Only now every branch into the function is known
+        verify_jump_tables(result_function, swept_instructions);
+
+        std::sort(result_function.labels_.begin(), result_function.labels_.end());
+        result_function.labels_.erase(std::unique(result_function.labels_.begin(), result_function.labels_.end()),
+                                      result_function.labels_.end());
+
+        // The resolved targets are queued like CALLl callees
+        resolve_register_branches(result_function, swept_instructions);
+
+        return result_function;
+    }
+
+    void ProgramAnalysis::verify_jump_tables(Function &function, const std::vector<std::uint32_t> &instructions) const
+    {
+        // Case labels count as ways in too, whether or not their table is kept, so dropping one table can't make
+        // another one wrong
+        const PredecessorCounts predecessor_counts = count_predecessors(program_, instructions, function.jump_tables_);
+        std::vector<JumpTable> verified_tables;
+
+        for (const auto &jump_table: function.jump_tables_)
+        {
+            const std::uint32_t jump_addr = jump_table.jump_instruction_addr_;
+            const std::size_t jump_index = std::lower_bound(instructions.begin(), instructions.end(), jump_addr) - instructions.begin();
+
+            // The bound must hold on every way to the jump. Cases past the ones swept would be missing their labels
+            auto verified_table = slice_jump_table(instructions, jump_index, function.labels_, &predecessor_counts);
+
+            if (verified_table.has_value() && (verified_table->labels_ == jump_table.labels_))
+            {
+                verified_tables.push_back(std::move(verified_table.value()));
+                continue;
+            }
+
+            // Now a plain register jump. The sweep went on past it, so what follows must start a block of its own
+            const std::uint32_t next_addr = jump_addr + INSTRUCTION_SIZE;
+
+            if (next_addr < function.addr_ + function.length_)
+            {
+                function.labels_.push_back(next_addr);
+            }
+        }
+
+        function.jump_tables_ = std::move(verified_tables);
+    }
+
+    void ProgramAnalysis::resolve_register_branches(Function &function, const std::vector<std::uint32_t> &instructions) const
+    {
+        const PredecessorCounts predecessor_counts = count_predecessors(program_, instructions, function.jump_tables_);
+
+        for (std::size_t i = 0; i < instructions.size(); i++) {
+            const std::uint32_t addr = instructions[i];
+
+            if (!is_register_branch(program_, function, addr)) {
+                continue;
+            }
+
+            // Only a path that is the sole way to the branch proves the register holds the same value every time
+            const std::vector<SliceStep> steps = build_slice_path(program_, instructions, i, &predecessor_counts);
+            SliceEvaluator evaluator = evaluate_slice(program_, steps);
+
+            const SymbolicValue target = evaluator.get(program_.at(addr).instruction_.two_sources_encoding.rd);
+
+            if (evaluator.valid() && target.is_constant() && is_function_address(target.offset_)) {
+                function.resolved_branches_.push_back(ResolvedBranch{ addr, target.offset_ });
+                function.callees_.push_back(target.offset_);
+                continue;
+            }
+
+            if ((program_.at(addr).opcode() != Opcode::CALLr) || function_tables_.empty()) {
+                continue;
+            }
+
+            // The call is guarded, so any path will do for guessing where the target was loaded from
+            const std::vector<SliceStep> guess_steps = build_slice_path(program_, instructions, i);
+            SliceEvaluator guess_evaluator = evaluate_slice(program_, guess_steps);
+
+            const SymbolicValue loaded = guess_evaluator.get(program_.at(addr).instruction_.two_sources_encoding.rd);
+
+            if (guess_evaluator.valid() && (loaded.kind_ == SYMBOLIC_LOAD)) {
+                auto targets = find_table_call_targets(loaded.scale_, loaded.offset_);
+
+                if (!targets.empty()) {
+                    function.guarded_calls_.push_back(GuardedCall{ addr, std::move(targets) });
+                }
+            }
+        }
+    }
+
+    std::vector<std::uint32_t> ProgramAnalysis::find_table_call_targets(std::uint32_t scale, std::uint32_t offset) const
+    {
+        std::vector<std::uint32_t> targets;
+
+        for (const auto &function_table: function_tables_) {
+            const std::uint64_t table_end = function_table.base_addr_ + static_cast<std::uint64_t>(function_table.entries_.size()) * INSTRUCTION_SIZE;
+
+            if (scale == 0) {
+                // A fixed slot of a table
+                if ((offset >= function_table.base_addr_) && (offset < table_end) && ((offset - function_table.base_addr_) % INSTRUCTION_SIZE == 0)) {
+                    targets.push_back(function_table.entries_[(offset - function_table.base_addr_) / INSTRUCTION_SIZE]);
+                }
+            } else if (scale == INSTRUCTION_SIZE) {
+                // Any slot of a table indexed from its base
+                if (offset == function_table.base_addr_) {
+                    targets.insert(targets.end(), function_table.entries_.begin(), function_table.entries_.end());
+                }
+            } else if (scale == 1) {
+                // The same slot of whichever table an object points to
+                const std::size_t slot = offset / INSTRUCTION_SIZE;
+
+                if (((offset % INSTRUCTION_SIZE) == 0) && (slot < function_table.entries_.size())) {
+                    targets.push_back(function_table.entries_[slot]);
+                }
+            }
+        }
 
-        while (true)
+        std::sort(targets.begin(), targets.end());
+        targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+        targets.erase(std::remove_if(targets.begin(), targets.end(), [this](std::uint32_t target) {
+            return !is_function_address(target);
+        }), targets.end());
+
+        if (targets.size() > MAX_GUARDED_CALL_TARGETS) {
+            targets.clear();
+        }
+
+        return targets;
+    }
+
+    std::vector<std::pair<std::size_t, ResolvedBranch>> ProgramAnalysis::find_entry_constant_branches(const std::vector<Function> &functions,
+                                                                                                     const std::vector<std::uint32_t> &address_taken) const
+    {
+        struct CallSite
         {
-            auto existing_suspecting_label = suspecting_to_be_labels.find(addr);
-            if (existing_suspecting_label != suspecting_to_be_labels.end())
-            {
-                // Found a label, add it to the result function
-                result_function.labels_.insert(addr);
-                suspecting_to_be_labels.erase(existing_suspecting_label);
+            std::size_t caller_;
+            std::size_t instruction_index_;
+        };
 
-                if (!unfinished_blocks_left.empty())
-                {
-                    mark_block_finished();
-                }
+        std::vector<std::vector<std::uint32_t>> instructions(functions.size());
+        std::map<std::uint32_t, std::vector<CallSite>> call_sites;
 
-                current_going_through_block = addr;
-                unfinished_blocks_left.push_back(addr);
-            }
-            else
-            {
-                if (unfinished_blocks_left.empty())
-                {
-                    if (!suspecting_to_be_labels.empty())
-                    {
-                        // Try to keep going, it may be a loop
-                        current_going_through_block = addr;
+        for (std::size_t i = 0; i < functions.size(); i++) {
+            instructions[i] = function_instructions(program_, functions[i]);
 
-                        unfinished_blocks_left.push_back(addr);
-                        result_function.labels_.insert(addr);
-                    }
-                    else
-                    {
-                        // No more block to be expected
-                        result_function.length_ = addr - result_function.addr_;
-                        break;
+            for (std::size_t j = 0; j < instructions[i].size(); j++) {
+                const DecodedInstruction &decoded = program_.at(instructions[i][j]);
+
+                if (decoded.opcode() == Opcode::CALLl) {
+                    if (auto target = decoded.direct_branch_target(instructions[i][j])) {
+                        call_sites[target.value()].push_back(CallSite{ i, j });
                     }
                 }
             }
+        }
 
-            const auto opcode = memory_base_[addr >> 2];
-            const Instruction instruction{opcode};
+        // The value a register holds right before a call, when the caller always sets it the same way
+        auto value_at_call_site = [&](const CallSite &site, Register reg) -> std::optional<std::uint32_t> {
+            const PredecessorCounts predecessor_counts = count_predecessors(program_, instructions[site.caller_],
+                                                                            functions[site.caller_].jump_tables_);
 
-            if (opcode == Opcode::SLEEP || opcode == Opcode::KILLTASK) {
-                does_function_use_task_inst = true;
+            const std::vector<SliceStep> steps = build_slice_path(program_, instructions[site.caller_], site.instruction_index_,
+                                                                  &predecessor_counts);
+            SliceEvaluator evaluator = evaluate_slice(program_, steps);
+            const SymbolicValue value = evaluator.get(reg);
+
+            if (!evaluator.valid() || !value.is_constant()) {
+                return std::nullopt;
             }
 
-            // Direct branch, we can follow it!
-            if (is_direct_branch(instruction))
-            {
-                bool is_next_dword_consumed = false;
-                bool is_terminate_function = false;
+            return value.offset_;
+        };
 
-                auto jump_target = calculate_direct_jump_target(pool_items_,
-                                                                instruction,
-                                                                addr,
-                                                                memory_base_[(addr >> 2) + 1],
-                                                                is_next_dword_consumed,
-                                                                is_terminate_function);
+        std::vector<std::pair<std::size_t, ResolvedBranch>> branches;
 
+        for (std::size_t i = 0; i < functions.size(); i++) {
+            const Function &function = functions[i];
+            auto sites = call_sites.find(function.addr_);
 
-                if (is_next_dword_consumed)
-                {
-                    addr += INSTRUCTION_SIZE;
-                }
+            // Every way into the function must be a known CALLl, so it can't have its address taken or be looped back to
+            if (function.is_entry_point_ || (sites == call_sites.end()) ||
+                std::binary_search(address_taken.begin(), address_taken.end(), function.addr_)) {
+                continue;
+            }
 
-                if (is_terminate_function)
-                {
-                    // Terminate function ends the function prematurely!
-                    mark_block_finished();
+            const PredecessorCounts predecessor_counts = count_predecessors(program_, instructions[i], function.jump_tables_);
+
+            if (predecessor_counts.contains(function.addr_)) {
+                continue;
+            }
+
+            for (std::size_t j = 0; j < instructions[i].size(); j++) {
+                const std::uint32_t addr = instructions[i][j];
+
+                if (!is_register_branch(program_, function, addr) ||
+                    std::any_of(function.resolved_branches_.begin(), function.resolved_branches_.end(), [addr](const ResolvedBranch &branch) {
+                        return branch.instruction_addr_ == addr;
+                    })) {
+                    continue;
                 }
-                else
-                {
-                    // If jump target is undefined, there are two possibilities:
-                    // 1. It's a HLE call (call to Mophun's library), in that case it's fine
-                    // 2. Failed to calculate jump target, in that case we should throw an exception
-                    if (!jump_target.has_value())
-                    {
-                        if (instruction.word_encoding.opcode == Opcode::CALLl) {
-                            SpecialPoolFunction special_function;
-                            if (pool_items_.is_pool_item_special_function(memory_base_[addr >> 2], special_function)) {
-                                does_function_call_task = true;
-                            }
-                        } else {
-                            throw std::runtime_error("Failed to calculate jump target");
-                        }
-                    }
 
-                    if (jump_target.has_value())
-                    {
-                        if (instruction.word_encoding.opcode == Opcode::CALLl)
-                        {
-                            // Take a risk and not cut off the function after call (hopefully they are all neutral)
-                            // When a jp ra is found, the function will do a normal return instead
-                            add_to_function_analyse_queue(jump_target.value());
-                        }
-                        else
-                        {
-                            // Probably loop, don't analyse it, just add a label
-                            // As loop is kind of broad in terms of the condition, we probably will just let LLVM do the job
-                            // of detect and optimize potential loop
-                            if (jump_target.value() < addr)
-                            {
-                                result_function.labels_.insert(jump_target.value());
-                            }
-                            else
-                            {
-                                suspecting_to_be_labels.insert(jump_target.value());
-                            }
+                bool reaches_start = false;
+                const std::vector<SliceStep> steps = build_slice_path(program_, instructions[i], j, &predecessor_counts, &reaches_start);
+                SliceEvaluator evaluator = evaluate_slice(program_, steps);
 
-                            mark_block_finished();
+                const Register target_register = program_.at(addr).instruction_.two_sources_encoding.rd;
 
-                            // Non conditional block won't continue the current flow
-                            if (instruction.word_encoding.opcode != Opcode::JPl && instruction.word_encoding.opcode != Opcode::CALLl)
-                            {
-                                current_going_through_block = addr + INSTRUCTION_SIZE;
+                // The register must still hold what the caller passed. The call itself sets RA and PC
+                if (!reaches_start || !evaluator.valid() || (target_register == Register::RA) || (target_register == Register::PC) ||
+                    !evaluator.get(target_register).is_symbol(target_register / 4)) {
+                    continue;
+                }
 
-                                unfinished_blocks_left.push_back(addr + INSTRUCTION_SIZE);
-                                result_function.labels_.insert(addr + INSTRUCTION_SIZE);
-                            }
-                        }
+                std::optional<std::uint32_t> target = value_at_call_site(sites->second.front(), target_register);
+
+                for (std::size_t k = 1; (k < sites->second.size()) && target.has_value(); k++) {
+                    if (value_at_call_site(sites->second[k], target_register) != target) {
+                        target.reset();
                     }
                 }
+
+                if (target.has_value() && is_function_address(target.value())) {
+                    branches.emplace_back(i, ResolvedBranch{ addr, target.value() });
+                }
             }
-            else if (is_indirect_branch(instruction))
-            {
-                /**
-                 * Some assumption:
-                 *
-                 * 1. CALL instruction seems to mostly be used for vtable call, so we are not able to find out which
-                 *    function it's calling to.
-                 *
-                 * 2. JP/RET instruction with RA register is mostly just a statement to return to the caller. But
-                 *    if we were to be safe, we should still detect if it's jump table or not
-                 *
-                 * This code block will try its best to detect a jump table and store it right away, so that the emitted
-                 * switch code will has its jump target detected at compile time.
-                 */
+        }
 
-                bool block_ending_sign_appear = true;
+        return branches;
+    }
 
-                // Take a risk and cut off when jump to RA
-                if (instruction.two_sources_encoding.opcode == Opcode::JPr && instruction.two_sources_encoding.rd != Register::RA)
-                {
-                    // Confirm if it has a jump table pattern
-                    Instruction prev_instruction_1{memory_base_[(addr >> 2) - 4]};
-                    Instruction prev_instruction_2{memory_base_[(addr >> 2) - 3]};
-                    Instruction prev_instruction_3{memory_base_[(addr >> 2) - 2]};
+    bool ProgramAnalysis::is_text_address(std::uint64_t addr) const
+    {
+        return (addr >= text_base_) && (addr - text_base_ < text_size_);
+    }
 
-                    bool jump_table_pattern_1 = prev_instruction_2.word_encoding.opcode == Opcode::SLLi &&
-                            prev_instruction_3.word_encoding.opcode == Opcode::LDWd &&
-                            prev_instruction_2.two_sources_encoding.rt == 2;
+    bool ProgramAnalysis::is_function_address(std::uint32_t addr) const
+    {
+        return is_text_address(addr) && ((addr % INSTRUCTION_SIZE) == 0);
+    }
 
-                    bool jump_table_pattern_2 = prev_instruction_1.word_encoding.opcode == Opcode::SLLi &&
-                            prev_instruction_2.word_encoding.opcode == Opcode::ADD &&
-                            prev_instruction_3.word_encoding.opcode == Opcode::LDWd &&
-                            prev_instruction_1.two_sources_encoding.rt == 2;
+    void ProgramAnalysis::classify_functions(std::vector<Function> &functions) const
+    {
+        constexpr std::uint8_t host_call_clears = FUNCTION_ATTRIBUTE_LEAF | FUNCTION_ATTRIBUTE_NO_HOST_CALL |
+                                                  FUNCTION_ATTRIBUTE_NO_MEMORY_WRITE;
 
-                    std::uint32_t switch_start_addr;
-                    std::uint8_t index_source_register;
+        // HLE handlers are free to write guest memory, so no host call is a prerequisite of no memory write
+        constexpr std::uint8_t transitive_attributes = FUNCTION_ATTRIBUTE_NO_HOST_CALL | FUNCTION_ATTRIBUTE_NO_MEMORY_WRITE;
 
-                    JumpTable jump_table;
-                    jump_table.jump_instruction_addr_ = addr;
+        // The call graph, as indices into the address sorted functions
+        std::vector<std::vector<std::size_t>> callee_indices(functions.size());
+        std::vector<bool> has_loop(functions.size());
 
-                    if (jump_table_pattern_1)
-                    {
-                        index_source_register = prev_instruction_2.two_sources_encoding.rs;
-                        switch_start_addr = addr - INSTRUCTION_SIZE * 3;
-                    } else {
-                        index_source_register = prev_instruction_1.two_sources_encoding.rs;
-                        switch_start_addr = addr - INSTRUCTION_SIZE * 4;
-                    }
+        for (std::size_t i = 0; i < functions.size(); i++) {
+            Function &function = functions[i];
+            std::uint8_t attributes = FUNCTION_ATTRIBUTE_LEAF | transitive_attributes;
 
-                    if (jump_table_pattern_1 || jump_table_pattern_2) {
-                        jump_table.switch_value_resolved_addr_ = switch_start_addr;
-                        jump_table.switch_value_register_ = static_cast<Register>(index_source_register);
+            // Same walk as the translator, everything in the function's range gets translated
+            const std::uint32_t function_end = static_cast<std::uint32_t>(function.addr_ + function.length_);
 
-                        // There may be an AND instruction before SLL too, to cast down the integer, allow it
-                        Instruction potential_and_instruction{memory_base_[(switch_start_addr >> 2) - 2]};
-                        if ((potential_and_instruction.two_sources_encoding.opcode == Opcode::ANDi) &&
-                            (potential_and_instruction.two_sources_encoding.rd == index_source_register) &&
-                            (memory_base_[(switch_start_addr >> 2) - 1] == 0x800000FF))
-                        {
-                            switch_start_addr -= INSTRUCTION_SIZE + 4;
-                            index_source_register = potential_and_instruction.two_sources_encoding.rs;
-                        }
+            for (std::uint32_t addr = function.addr_; addr < function_end;) {
+                const DecodedInstruction &decoded = program_.at(addr);
 
-                        std::size_t total_cases = std::numeric_limits<std::size_t>::max();
+                switch (decoded.opcode()) {
+                    case Opcode::CALLl:
+                        attributes &= ~FUNCTION_ATTRIBUTE_LEAF;
 
-                        // Should be a BGT/BGTUI
-                        Instruction possible_branch_instruction{memory_base_[(switch_start_addr >> 2) - 1]};
-                        if ((possible_branch_instruction.two_sources_encoding.opcode == Opcode::BGTUI) ||
-                            (possible_branch_instruction.two_sources_encoding.opcode == Opcode::BGTI) ||
-                            (possible_branch_instruction.two_sources_encoding.opcode == Opcode::BGTIB) ||
-                            (possible_branch_instruction.two_sources_encoding.opcode == Opcode::BGTUIB))
-                        {
-                            if (possible_branch_instruction.two_sources_encoding.rd == index_source_register)
-                            {
-                                total_cases = possible_branch_instruction.two_sources_encoding.rs + 1;
-                            }
+                        if (!decoded.direct_branch_target(addr).has_value()) {
+                            attributes &= ~host_call_clears;
                         }
 
-                        if (total_cases == std::numeric_limits<std::size_t>::max())
-                        {
-                            // Probably a BLE instruction that is containing case count
-                            static constexpr std::size_t MAX_TRACE_BACK = 50;
-
-                            for (auto i = 0; i < MAX_TRACE_BACK; i++)
-                            {
-                                Instruction tracing_instruction{memory_base_[(switch_start_addr >> 2) - (i + 1)]};
+                        break;
 
-                                if ((tracing_instruction.two_sources_encoding.opcode == Opcode::BLEI) ||
-                                    (tracing_instruction.two_sources_encoding.opcode == Opcode::BLEIB) ||
-                                    (tracing_instruction.two_sources_encoding.opcode == Opcode::BLEUI) ||
-                                    (tracing_instruction.two_sources_encoding.opcode == Opcode::BLEUIB))
-                                {
-                                    if (tracing_instruction.two_sources_encoding.rd == index_source_register)
-                                    {
-                                        bool temp_word_consumed = false;
-                                        bool temp_is_terminate = false;
-
-                                        // Check jump target
-                                        std::optional<std::uint32_t> branch_jump_target = calculate_direct_jump_target(
-                                                pool_items_,
-                                                tracing_instruction,
-                                                switch_start_addr - INSTRUCTION_SIZE * (i + 1),
-                                                memory_base_[(switch_start_addr >> 2) - (i + 1) + 1],
-                                                temp_word_consumed,
-                                                temp_is_terminate);
-
-                                        if (branch_jump_target.has_value() &&
-                                            (branch_jump_target.value() == switch_start_addr))
-                                        {
-                                            total_cases = tracing_instruction.two_sources_encoding.rs + 1;
-                                            break;
-                                        }
-                                    }
-                                }
-                            }
+                    case Opcode::JPr:
+                    case Opcode::CALLr: {
+                        const bool is_resolved = std::any_of(function.resolved_branches_.begin(), function.resolved_branches_.end(),
+                                                             [addr](const ResolvedBranch &branch) {
+                                                                 return branch.instruction_addr_ == addr;
+                                                             });
+
+                        // Resolved targets are in the callees, like CALLl ones. A jump table's default calls the
+                        // loaded address as any register branch does
+                        if (is_resolved) {
+                            attributes &= ~FUNCTION_ATTRIBUTE_LEAF;
+                        } else if ((decoded.opcode() == Opcode::CALLr) || (decoded.instruction_.two_sources_encoding.rd != Register::RA)) {
+                            attributes &= ~host_call_clears;
                         }
 
-                        if (total_cases != std::numeric_limits<std::size_t>::max())
-                        {
-                            jump_table.labels_.resize(total_cases);
-
-                            std::uint32_t table_pool_addr;
+                        break;
+                    }
 
-                            if (jump_table_pattern_1) {
-                                std::uint32_t table_pool_index = memory_base_[(addr >> 2) - 1];
-                                table_pool_addr = pool_items_.get_pool_item_constant(table_pool_index);
-                            } else {
-                                // Trace back assignment
-                                std::uint32_t tracing_addr_back = switch_start_addr - INSTRUCTION_SIZE;
-
-                                Register base_register = prev_instruction_2.two_sources_encoding.rs == index_source_register ?
-                                        prev_instruction_2.two_sources_encoding.rt:
-                                        prev_instruction_2.two_sources_encoding.rs;
-
-                                while (tracing_addr_back >= result_function.addr_) {
-                                    Instruction tracing_base_assign_inst{memory_base_[(tracing_addr_back >> 2)]};
-
-                                    if (tracing_base_assign_inst.two_sources_encoding.opcode == Opcode::LDI &&
-                                        tracing_base_assign_inst.two_sources_encoding.rd == base_register) {
-                                        std::uint32_t table_pool_index = memory_base_[(tracing_addr_back >> 2) + 1];
-                                        table_pool_addr = pool_items_.get_pool_item_constant(table_pool_index);
-
-                                        std::uint32_t add_constant = memory_base_[(jump_table.jump_instruction_addr_ >> 2) - 1];
-                                        if (auto add_offset = Common::get_immediate_pip_dword(add_constant)) {
-                                            table_pool_addr += add_offset.value();
-                                            break;
-                                        }
-                                        else {
-                                            if (!pool_items_.is_pool_item_constant(add_constant)) {
-                                                throw std::runtime_error("Failed to resolve jump table base address");
-                                            }
-                                            else {
-                                                table_pool_addr += pool_items_.get_pool_item_constant(add_constant);
-                                                break;
-                                            }
-                                        }
-                                    }
-
-                                    tracing_addr_back -= 4;
-                                }
-                            }
+                    case Opcode::SYSCALL0:
+                    case Opcode::SYSCALL1:
+                    case Opcode::SYSCALL2:
+                    case Opcode::SYSCALL3:
+                    case Opcode::SYSCALL4:
+                    case Opcode::SLEEP:
+                    case Opcode::KILLTASK:
+                    case Opcode::BREAKPOINT:
+                        attributes &= ~host_call_clears;
+                        break;
 
-                            jump_table.jump_table_base_addr_ = table_pool_addr;
+                    case Opcode::STWd:
+                    case Opcode::STHd:
+                    case Opcode::STBd:
+                    case Opcode::STORE:
+                    case Opcode::SYSCPY:
+                    case Opcode::SYSSET:
+                        attributes &= ~FUNCTION_ATTRIBUTE_NO_MEMORY_WRITE;
+                        break;
 
-                            for (std::size_t i = 0; i < total_cases; i++)
-                            {
-                                std::uint32_t case_addr = memory_base_[(table_pool_addr >> 2) + i];
-                                jump_table.labels_[i] = case_addr;
+                    default:
+                        break;
+                }
 
-                                if (case_addr >= addr) {
-                                    suspecting_to_be_labels.insert(case_addr);
-                                } else {
-                                    result_function.labels_.insert(case_addr);
-                                }
+                if (decoded.has(OPCODE_PROPERTY_DIRECT_BRANCH) && (decoded.opcode() != Opcode::CALLl)) {
+                    auto target = decoded.direct_branch_target(addr);
+                    if (target.has_value() && (target.value() <= addr)) {
+                        has_loop[i] = true;
+                    }
+                }
 
-                                found_table_labels_.insert(case_addr);
-                            }
+                addr += decoded.has(OPCODE_PROPERTY_CONSUMES_DWORD) ? INSTRUCTION_SIZE * 2 : INSTRUCTION_SIZE;
+            }
 
-                            // Can detect jump table and probably inline all the case blocks
-                            result_function.jump_tables_.push_back(jump_table);
-                            block_ending_sign_appear = false;
-                        }
+            for (const auto &jump_table: function.jump_tables_) {
+                for (const auto label: jump_table.labels_) {
+                    if (label <= jump_table.jump_instruction_addr_) {
+                        has_loop[i] = true;
                     }
                 }
-                else if (instruction.two_sources_encoding.opcode == Opcode::CALLr) {
-                    block_ending_sign_appear = false;
-                }
+            }
 
-                if (block_ending_sign_appear)
-                {
-                    mark_block_finished();
+            for (const auto callee: function.callees_) {
+                auto callee_function = std::lower_bound(functions.begin(), functions.end(), callee, [](const Function &lhs, std::uint32_t addr) {
+                    return lhs.addr_ < addr;
+                });
+
+                if ((callee_function == functions.end()) || (callee_function->addr_ != callee)) {
+                    // Only reachable through the lookup table, which hands it to the HLE handler as not compiled
+                    attributes &= ~host_call_clears;
+                } else {
+                    callee_indices[i].push_back(static_cast<std::size_t>(callee_function - functions.begin()));
                 }
             }
-            else if (does_non_branch_instruction_consume_dword(instruction))
-            {
-                addr += sizeof(std::uint32_t);
-            }
 
-            addr += INSTRUCTION_SIZE;
+            function.attributes_ = attributes;
         }
 
-        if (!suspecting_to_be_labels.empty())
-        {
-            throw std::runtime_error("Some labels are not resolved!");
-        }
+        // Greatest fixed point, a function loses an attribute as soon as one of its callees lacks it. Recursion
+        // alone can't introduce a host call or a memory write
+        for (bool changed = true; changed;) {
+            changed = false;
 
-        if (!unfinished_blocks_left.empty())
-        {
-            throw std::runtime_error("Some blocks are not finished!");
+            for (std::size_t i = 0; i < functions.size(); i++) {
+                std::uint8_t attributes = functions[i].attributes_;
+
+                for (const auto callee: callee_indices[i]) {
+                    attributes &= functions[callee].attributes_ | ~transitive_attributes;
+                }
+
+                if (attributes != functions[i].attributes_) {
+                    functions[i].attributes_ = attributes;
+                    changed = true;
+                }
+            }
         }
 
-        return result_function;
+        // Least fixed point, so functions on a call cycle never qualify
+        for (bool changed = true; changed;) {
+            changed = false;
+
+            for (std::size_t i = 0; i < functions.size(); i++) {
+                if (has_loop[i] || (functions[i].attributes_ & FUNCTION_ATTRIBUTE_ALWAYS_RETURNS) ||
+                    !(functions[i].attributes_ & FUNCTION_ATTRIBUTE_NO_HOST_CALL)) {
+                    continue;
+                }
+
+                const bool callees_return = std::all_of(callee_indices[i].begin(), callee_indices[i].end(), [&](std::size_t callee) {
+                    return (functions[callee].attributes_ & FUNCTION_ATTRIBUTE_ALWAYS_RETURNS) != 0;
+                });
+
+                if (callees_return) {
+                    functions[i].attributes_ |= FUNCTION_ATTRIBUTE_ALWAYS_RETURNS;
+                    changed = true;
+                }
+            }
+        }
     }
 
     std::vector<Function> ProgramAnalysis::analyze(const std::uint32_t entry_point_addr, bool &does_program_use_task)
@@ -601,88 +1641,213 @@ namespace Pip2
         does_program_use_task = false;
 
         std::vector<Function> results;
-        found_functions_.clear();
-        found_table_labels_.clear();
-
-        while (!analyse_queue_.empty())
-            analyse_queue_.pop();
+        found_functions_ = std::vector<std::atomic<std::uint64_t>>((text_size_ / INSTRUCTION_SIZE + 63) / 64);
+        function_tables_.clear();
 
-        std::set<std::uint32_t> potential_functions_set;
-        std::set<std::uint32_t> potential_functions_set_deferred;
+        std::vector<std::uint32_t> potential_functions_set;
+        std::vector<std::uint32_t> potential_functions_set_deferred;
 
         for (std::size_t i = 1; i <= pool_items_.pool_item_count(); i++) {
             if (pool_items_.is_pool_item_constant(i)) {
                 std::uint32_t addr = pool_items_.get_pool_item_constant(i);
 
                 if (pool_items_.is_pool_item_function_table_list(i)) {
-                    const auto *table = memory_base_ + (addr >> 2);
-                    while (*table != 0) {
-                        potential_functions_set.insert(*table);
-                        table++;
+                    FunctionTable function_table{ addr, {} };
+
+                    // Tables are only read from the text, like jump tables
+                    for (std::uint64_t entry_addr = addr; is_text_address(entry_addr) && (memory_base_[entry_addr >> 2] != 0);
+                         entry_addr += INSTRUCTION_SIZE) {
+                        potential_functions_set.push_back(memory_base_[entry_addr >> 2]);
+                        function_table.entries_.push_back(memory_base_[entry_addr >> 2]);
                     }
+
+                    function_tables_.push_back(std::move(function_table));
                 }
                 else if (pool_items_.is_pool_item_in_text(i)) {
-                    potential_functions_set.insert(addr);
+                    potential_functions_set.push_back(addr);
                 }
                 else if (pool_items_.is_pool_item_function_in_table(i)) {
-                    potential_functions_set_deferred.insert(addr);
+                    potential_functions_set_deferred.push_back(addr);
                 }
             }
         }
 
-        potential_functions_set.insert(entry_point_addr + text_base_);
+        potential_functions_set.push_back(entry_point_addr + text_base_);
 
-        for (const auto value: potential_functions_set) {
-            found_functions_.insert(value - text_base_);
-            analyse_queue_.push(value - text_base_);
-        }
+        // Duplicates are filtered by the found bitmap. Sorting only keeps the initial work distribution stable
+        std::sort(potential_functions_set.begin(), potential_functions_set.end());
+        std::sort(potential_functions_set_deferred.begin(), potential_functions_set_deferred.end());
 
-        bool once_used_task_inst = false;
-        bool once_called_task = false;
+        std::atomic<bool> once_used_task_inst = false;
+        std::atomic<bool> once_called_task = false;
 
-        auto analyse_routine = [&]() {
-            while (!analyse_queue_.empty())
-            {
-                bool does_function_use_task_inst = false;
-                bool does_function_call_task = false;
+        const std::size_t worker_count = std::max(1u, std::thread::hardware_concurrency());
 
-                auto addr = text_base_ + analyse_queue_.front();
-                analyse_queue_.pop();
+        // Functions are swept in parallel, each one only reads the text segment and the pool items
+        auto analyse_routine = [&](const std::vector<std::uint32_t> &start_offsets) {
+            SweepScheduler scheduler(worker_count);
+            std::vector<std::vector<Function>> worker_results(worker_count);
+            std::vector<std::exception_ptr> worker_errors(worker_count);
 
-                if (addr < text_base_ || addr >= text_base_ + text_size_)
-                {
-                    continue;
+            for (std::size_t i = 0; i < start_offsets.size(); i++) {
+                scheduler.push(i % worker_count, start_offsets[i]);
+            }
+
+            auto sweep_worker = [&](std::size_t worker) {
+                try {
+                    while (auto offset = scheduler.pop(worker)) {
+                        bool does_function_use_task_inst = false;
+                        bool does_function_call_task = false;
+
+                        const auto addr = static_cast<std::uint32_t>(text_base_ + offset.value());
+
+                        Function sweeped = sweep_function(addr, does_function_use_task_inst, does_function_call_task);
+                        sweeped.is_entry_point_ = (addr == entry_point_addr + text_base_);
+
+                        for (const auto callee: sweeped.callees_) {
+                            if (callee < text_base_) {
+                                throw std::runtime_error("Address is out of text segment");
+                            }
+
+                            if (mark_function_found(callee - text_base_)) {
+                                scheduler.push(worker, callee - text_base_);
+                            }
+                        }
+
+                        if (does_function_call_task) {
+                            once_called_task = true;
+                        }
+
+                        if (does_function_use_task_inst) {
+                            once_used_task_inst = true;
+                        }
+
+                        worker_results[worker].push_back(std::move(sweeped));
+                        scheduler.finish();
+                    }
+                } catch (...) {
+                    worker_errors[worker] = std::current_exception();
+                    scheduler.stop();
                 }
+            };
 
-                Function sweeped = sweep_function(addr, does_function_use_task_inst, does_function_call_task);
-                sweeped.is_entry_point_ = (addr == entry_point_addr + text_base_);
+            std::vector<std::thread> worker_threads;
 
-                results.push_back(sweeped);
+            for (std::size_t i = 1; i < worker_count; i++) {
+                worker_threads.emplace_back(sweep_worker, i);
+            }
+
+            sweep_worker(0);
 
-                once_called_task = once_called_task || does_function_call_task;
-                once_used_task_inst = once_used_task_inst || does_function_use_task_inst;
+            for (auto &thread: worker_threads) {
+                thread.join();
+            }
 
-                if (once_called_task && once_used_task_inst) {
-                    does_program_use_task = true;
+            for (auto &error: worker_errors) {
+                if (error) {
+                    std::rethrow_exception(error);
                 }
             }
+
+            for (auto &functions: worker_results) {
+                std::move(functions.begin(), functions.end(), std::back_inserter(results));
+            }
         };
 
-        analyse_routine();
+        std::vector<std::uint32_t> start_offsets;
+
+        for (const auto value: potential_functions_set) {
+            if (mark_function_found(value - text_base_)) {
+                start_offsets.push_back(value - text_base_);
+            }
+        }
+
+        analyse_routine(start_offsets);
+
+        // Case labels of the jump tables found so far are not function starts, one bit per text word
+        std::vector<bool> found_table_labels(text_size_ / INSTRUCTION_SIZE);
+
+        for (const auto &function: results) {
+            for (const auto &jump_table: function.jump_tables_) {
+                for (const auto label: jump_table.labels_) {
+                    if ((label >= text_base_) && (label - text_base_ < text_size_)) {
+                        found_table_labels[(label - text_base_) / INSTRUCTION_SIZE] = true;
+                    }
+                }
+            }
+        }
 
         // Analyse the deferred function
+        start_offsets.clear();
+
         for (const auto value: potential_functions_set_deferred) {
-            if (found_functions_.contains(value - text_base_) || found_table_labels_.contains(value)) {
+            if (is_function_found(value - text_base_) ||
+                ((value >= text_base_) && (value - text_base_ < text_size_) && found_table_labels[(value - text_base_) / INSTRUCTION_SIZE])) {
                 continue;
             }
-            else {
-                found_functions_.insert(value - text_base_);
-                analyse_queue_.push(value - text_base_);
+
+            if (mark_function_found(value - text_base_)) {
+                start_offsets.push_back(value - text_base_);
+            }
+        }
+
+        analyse_routine(start_offsets);
+
+        // Workers finish in any order, keep the result stable so the emitted IR and cache keys are too
+        auto sort_results = [&results]() {
+            std::sort(results.begin(), results.end(), [](const Function &lhs, const Function &rhs) {
+                return lhs.addr_ < rhs.addr_;
+            });
+        };
+
+        sort_results();
+
+        // Register branches resolved from the callers' side may name functions that were not found yet. Sweeping
+        // those can add more callers, so the search starts over until it names nothing new
+        std::vector<std::uint32_t> entry_constant_targets;
+
+        while (true) {
+            // Any function the program can reach without a direct call
+            std::vector<std::uint32_t> address_taken = potential_functions_set;
+            address_taken.insert(address_taken.end(), potential_functions_set_deferred.begin(), potential_functions_set_deferred.end());
+            address_taken.insert(address_taken.end(), entry_constant_targets.begin(), entry_constant_targets.end());
+
+            for (const auto &function: results) {
+                for (const auto &branch: function.resolved_branches_) {
+                    address_taken.push_back(branch.target_addr_);
+                }
+            }
+
+            std::sort(address_taken.begin(), address_taken.end());
+
+            const auto entry_constant_branches = find_entry_constant_branches(results, address_taken);
+            start_offsets.clear();
+
+            for (const auto &[index, branch]: entry_constant_branches) {
+                entry_constant_targets.push_back(branch.target_addr_);
+
+                if (mark_function_found(branch.target_addr_ - text_base_)) {
+                    start_offsets.push_back(branch.target_addr_ - text_base_);
+                }
+            }
+
+            if (start_offsets.empty()) {
+                for (const auto &[index, branch]: entry_constant_branches) {
+                    results[index].resolved_branches_.push_back(branch);
+                    results[index].callees_.push_back(branch.target_addr_);
+                }
+
+                break;
             }
+
+            analyse_routine(start_offsets);
+            sort_results();
         }
 
-        analyse_routine();
+        does_program_use_task = once_called_task && once_used_task_inst;
+
+        classify_functions(results);
 
         return results;
     }
-}
\ No newline at end of file
+}
@@ -1,36 +1,60 @@
 #pragma once
 
+#include "DecodedProgram.h"
 #include "PoolItems.h"
 #include "Function.h"
 
+#include <atomic>
 #include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <utility>
 #include <vector>
-#include <queue>
-#include <map>
-#include <set>
 
 namespace Pip2
 {
     class ProgramAnalysis
     {
     private:
+        struct FunctionTable
+        {
+            std::uint32_t base_addr_;
+            std::vector<std::uint32_t> entries_;
+        };
+
         const std::uint32_t *memory_base_;
         std::size_t text_base_;
         std::size_t text_size_;
 
-        std::queue<std::uint32_t> analyse_queue_;
-        std::set<std::uint32_t> found_functions_;
-        std::set<std::uint32_t> found_table_labels_;
+        // One bit per text word, set once a function starting there has been queued. Shared by the sweeping threads
+        std::vector<std::atomic<std::uint64_t>> found_functions_;
 
         const PoolItems &pool_items_;
-
-        Function sweep_function(std::uint32_t addr, bool &does_function_use_task_inst, bool &does_function_call_task);
-        void add_to_function_analyse_queue(std::uint32_t addr);
+        const DecodedProgram &program_;
+
+        // Zero terminated function tables named by the pool, read before sweeping starts
+        std::vector<FunctionTable> function_tables_;
+
+        std::optional<JumpTable> slice_jump_table(const std::vector<std::uint32_t> &instructions, std::size_t jump_index,
+                                                  const std::vector<std::uint32_t> &labels,
+                                                  const std::unordered_map<std::uint32_t, std::uint32_t> *predecessor_counts = nullptr) const;
+        void verify_jump_tables(Function &function, const std::vector<std::uint32_t> &instructions) const;
+        Function sweep_function(std::uint32_t addr, bool &does_function_use_task_inst, bool &does_function_call_task) const;
+        bool mark_function_found(std::uint32_t offset);
+        bool is_function_found(std::uint32_t offset) const;
+        bool is_text_address(std::uint64_t addr) const;
+        bool is_function_address(std::uint32_t addr) const;
+        std::vector<std::uint32_t> find_table_call_targets(std::uint32_t scale, std::uint32_t offset) const;
+        void resolve_register_branches(Function &function, const std::vector<std::uint32_t> &instructions) const;
+        std::vector<std::pair<std::size_t, ResolvedBranch>> find_entry_constant_branches(const std::vector<Function> &functions,
+                                                                                         const std::vector<std::uint32_t> &address_taken) const;
+        void classify_functions(std::vector<Function> &functions) const;
 
     public:
         explicit ProgramAnalysis(const std::uint32_t *memory_base, std::size_t text_base, std::size_t text_size,
-                                 const PoolItems &pool_items)
+                                 const PoolItems &pool_items, const DecodedProgram &program)
             : memory_base_(memory_base), text_base_(text_base), text_size_(text_size), pool_items_(pool_items)
+            , program_(program)
         {
         }
 
@@ -0,0 +1,445 @@
+#include "RegisterLiveness.h"
+#include "Constants.h"
+
+#include <algorithm>
+#include <format>
+#include <map>
+#include <stdexcept>
+
+namespace Pip2
+{
+    namespace
+    {
+        void add_register(RegisterLiveness::RegisterSet &set, Register reg)
+        {
+            if ((reg != Register::ZR) && ((reg & 3) == 0) && ((reg >> 2) < Register::TotalCount))
+            {
+                set.set(reg >> 2);
+            }
+        }
+
+        void add_register_range(RegisterLiveness::RegisterSet &set, std::uint32_t first, std::uint32_t size)
+        {
+            for (std::uint32_t offset = 0; offset < size; offset += 4)
+            {
+                add_register(set, static_cast<Register>(first + offset));
+            }
+        }
+    }
+
+    RegisterLiveness::InstructionEffect RegisterLiveness::get_instruction_effect(const DecodedInstruction &decoded)
+    {
+        const auto &encoding = decoded.instruction_.two_sources_encoding;
+        InstructionEffect effect;
+
+        switch (decoded.opcode())
+        {
+            case Opcode::ADD:
+            case Opcode::AND:
+            case Opcode::MUL:
+            case Opcode::DIV:
+            case Opcode::DIVU:
+            case Opcode::OR:
+            case Opcode::XOR:
+            case Opcode::SUB:
+            case Opcode::SLL:
+            case Opcode::SRA:
+            case Opcode::SRL:
+                add_register(effect.uses_, encoding.rs);
+                add_register(effect.uses_, encoding.rt);
+                add_register(effect.kills_, encoding.rd);
+                break;
+
+            case Opcode::ADDB:
+            case Opcode::SUBB:
+            case Opcode::ANDB:
+            case Opcode::ORB:
+            case Opcode::ADDH:
+            case Opcode::SUBH:
+            case Opcode::ANDH:
+            case Opcode::ORH:
+                add_register(effect.uses_, encoding.rs);
+                add_register(effect.uses_, encoding.rt);
+                add_register(effect.uses_, encoding.rd);
+                break;
+
+            case Opcode::MOV:
+            case Opcode::NOT:
+            case Opcode::NEG:
+            case Opcode::EXSB:
+            case Opcode::EXSH:
+            case Opcode::SLLi:
+            case Opcode::SRAi:
+            case Opcode::SRLi:
+            case Opcode::ADDQ:
+            case Opcode::MULQ:
+            case Opcode::ADDi:
+            case Opcode::ANDi:
+            case Opcode::MULi:
+            case Opcode::DIVi:
+            case Opcode::DIVUi:
+            case Opcode::ORi:
+            case Opcode::XORi:
+            case Opcode::SUBi:
+            case Opcode::LDBd:
+            case Opcode::LDHd:
+            case Opcode::LDWd:
+            case Opcode::LDBUd:
+            case Opcode::LDHUd:
+                add_register(effect.uses_, encoding.rs);
+                add_register(effect.kills_, encoding.rd);
+                break;
+
+            case Opcode::MOVB:
+            case Opcode::MOVH:
+            case Opcode::SLLB:
+            case Opcode::SRLB:
+            case Opcode::SRAB:
+            case Opcode::SLLH:
+            case Opcode::SRLH:
+            case Opcode::SRAH:
+            case Opcode::ADDBi:
+            case Opcode::ANDBi:
+            case Opcode::ORBi:
+            case Opcode::ADDHi:
+            case Opcode::ANDHi:
+                add_register(effect.uses_, encoding.rs);
+                add_register(effect.uses_, encoding.rd);
+                break;
+
+            case Opcode::LDI:
+            case Opcode::LDQ:
+                add_register(effect.kills_, encoding.rd);
+                break;
+
+            case Opcode::STBd:
+            case Opcode::STHd:
+            case Opcode::STWd:
+            case Opcode::BEQ:
+            case Opcode::BNE:
+            case Opcode::BGE:
+            case Opcode::BGEU:
+            case Opcode::BGT:
+            case Opcode::BGTU:
+            case Opcode::BLE:
+            case Opcode::BLEU:
+            case Opcode::BLT:
+            case Opcode::BLTU:
+                add_register(effect.uses_, encoding.rd);
+                add_register(effect.uses_, encoding.rs);
+                break;
+
+            case Opcode::BEQI:
+            case Opcode::BNEI:
+            case Opcode::BGEI:
+            case Opcode::BGEUI:
+            case Opcode::BGTI:
+            case Opcode::BGTUI:
+            case Opcode::BLEI:
+            case Opcode::BLEUI:
+            case Opcode::BLTI:
+            case Opcode::BLTUI:
+            case Opcode::BEQIB:
+            case Opcode::BNEIB:
+            case Opcode::BGEIB:
+            case Opcode::BGEUIB:
+            case Opcode::BGTIB:
+            case Opcode::BGTUIB:
+            case Opcode::BLEIB:
+            case Opcode::BLEUIB:
+            case Opcode::BLTIB:
+            case Opcode::BLTUIB:
+                add_register(effect.uses_, encoding.rd);
+                break;
+
+            case Opcode::SYSCPY:
+            case Opcode::SYSSET:
+                add_register(effect.uses_, encoding.rd);
+                add_register(effect.uses_, encoding.rs);
+                add_register(effect.uses_, encoding.rt);
+                break;
+
+            case Opcode::STORE:
+            {
+                const auto &range = decoded.instruction_.range_reg_encoding;
+                add_register(effect.uses_, Register::SP);
+                add_register(effect.kills_, Register::SP);
+
+                if (range.rs == Register::ZR)
+                {
+                    add_register(effect.kills_, Register::RA);
+                }
+                else
+                {
+                    add_register_range(effect.uses_, range.rs, range.count);
+                }
+
+                break;
+            }
+
+            case Opcode::RESTORE:
+            {
+                const auto &range = decoded.instruction_.range_reg_encoding;
+                add_register(effect.uses_, Register::SP);
+                add_register(effect.kills_, Register::SP);
+
+                if (range.rs == Register::ZR)
+                {
+                    add_register(effect.kills_, Register::RA);
+                }
+                else
+                {
+                    add_register_range(effect.kills_, range.rs - range.count + 4, range.count);
+                }
+
+                break;
+            }
+
+            case Opcode::NOP:
+            case Opcode::BREAKPOINT:
+            case Opcode::JPl:
+                break;
+
+            default:
+                // Calls, returns, indirect jumps and task switches
+                effect.observes_ = true;
+                break;
+        }
+
+        return effect;
+    }
+
+    RegisterLiveness::RegisterLiveness(const DecodedProgram &program, const Function &function)
+        : function_addr_(function.addr_)
+        , live_after_(function.length_ / INSTRUCTION_SIZE)
+        , dead_writes_(function.length_ / INSTRUCTION_SIZE)
+    {
+        struct Step
+        {
+            std::uint32_t addr_;
+            InstructionEffect effect_;
+        };
+
+        struct Block
+        {
+            std::size_t first_step_;
+            std::size_t end_step_;
+            std::vector<std::size_t> successors_ = {};
+            bool exits_ = false;
+
+            RegisterSet live_in_ = {};
+            RegisterSet live_out_ = {};
+        };
+
+        const RegisterSet all_registers = RegisterSet().set();
+        const std::uint32_t function_end = function.addr_ + static_cast<std::uint32_t>(function.length_);
+
+        std::vector<Step> steps;
+        std::vector<Block> blocks;
+        std::map<std::uint32_t, std::size_t> block_indices;
+
+        // Split the function into blocks the same way the translator walks it
+        for (std::uint32_t addr = function.addr_; addr < function_end;)
+        {
+            if ((addr == function.addr_) || std::binary_search(function.labels_.begin(), function.labels_.end(), addr))
+            {
+                if (!blocks.empty())
+                {
+                    blocks.back().end_step_ = steps.size();
+                }
+
+                block_indices.emplace(addr, blocks.size());
+                blocks.push_back(Block{ steps.size(), steps.size() });
+            }
+
+            const DecodedInstruction &decoded = program.at(addr);
+            steps.push_back(Step{ addr, get_instruction_effect(decoded) });
+
+            addr += decoded.has(OPCODE_PROPERTY_CONSUMES_DWORD) ? INSTRUCTION_SIZE * 2 : INSTRUCTION_SIZE;
+        }
+
+        if (blocks.empty())
+        {
+            return;
+        }
+
+        blocks.back().end_step_ = steps.size();
+
+        // A jump table switch reads its index at the address it's captured. The jump itself keeps observing the
+        // context, since an index out of range calls whatever address was loaded
+        for (const auto &jump_table: function.jump_tables_)
+        {
+            for (auto &step: steps)
+            {
+                if (step.addr_ == jump_table.switch_value_resolved_addr_)
+                {
+                    add_register(step.effect_.uses_, jump_table.switch_value_register_);
+                }
+            }
+        }
+
+        for (std::size_t i = 0; i < blocks.size(); i++)
+        {
+            Block &block = blocks[i];
+
+            if (block.first_step_ == block.end_step_)
+            {
+                block.exits_ = true;
+                continue;
+            }
+
+            const std::uint32_t last_addr = steps[block.end_step_ - 1].addr_;
+            const DecodedInstruction &last = program.at(last_addr);
+
+            auto add_successor = [&](std::uint32_t target)
+            {
+                auto successor = block_indices.find(target);
+
+                if (successor == block_indices.end())
+                {
+                    block.exits_ = true;
+                }
+                else
+                {
+                    block.successors_.push_back(successor->second);
+                }
+            };
+
+            auto add_fall_through = [&]()
+            {
+                if (i + 1 < blocks.size())
+                {
+                    block.successors_.push_back(i + 1);
+                }
+                else
+                {
+                    block.exits_ = true;
+                }
+            };
+
+            if (last.opcode() == Opcode::JPr)
+            {
+                auto jump_table = std::find_if(function.jump_tables_.begin(), function.jump_tables_.end(), [last_addr](const JumpTable &table) {
+                    return table.jump_instruction_addr_ == last_addr;
+                });
+
+                if (jump_table == function.jump_tables_.end())
+                {
+                    block.exits_ = true;
+                }
+                else
+                {
+                    // The switch default leaves the function
+                    block.exits_ = true;
+
+                    for (const auto label: jump_table->labels_)
+                    {
+                        add_successor(static_cast<std::uint32_t>(label));
+                    }
+                }
+            }
+            else if ((last.opcode() == Opcode::RET) || ((last.opcode() == Opcode::CALLl) && last.is_block_cutoff()))
+            {
+                block.exits_ = true;
+            }
+            else if (last.has(OPCODE_PROPERTY_DIRECT_BRANCH) && (last.opcode() != Opcode::CALLl))
+            {
+                if (auto target = last.direct_branch_target(last_addr))
+                {
+                    add_successor(target.value());
+                }
+                else
+                {
+                    block.exits_ = true;
+                }
+
+                if (last.opcode() != Opcode::JPl)
+                {
+                    add_fall_through();
+                }
+            }
+            else
+            {
+                add_fall_through();
+            }
+        }
+
+        auto transfer = [&all_registers](const InstructionEffect &effect, const RegisterSet &live) {
+            return effect.observes_ ? all_registers : ((live & ~effect.kills_) | effect.uses_);
+        };
+
+        // Iterate to a fixed point, going backward so that most blocks see their successors updated already
+        bool changed = true;
+
+        while (changed)
+        {
+            changed = false;
+
+            for (std::size_t i = blocks.size(); i > 0; i--)
+            {
+                Block &block = blocks[i - 1];
+                RegisterSet live = block.exits_ ? all_registers : RegisterSet();
+
+                for (const auto successor: block.successors_)
+                {
+                    live |= blocks[successor].live_in_;
+                }
+
+                block.live_out_ = live;
+
+                for (std::size_t step = block.end_step_; step > block.first_step_; step--)
+                {
+                    live = transfer(steps[step - 1].effect_, live);
+                }
+
+                if (live != block.live_in_)
+                {
+                    block.live_in_ = live;
+                    changed = true;
+                }
+            }
+        }
+
+        for (const auto &block: blocks)
+        {
+            RegisterSet live = block.live_out_;
+
+            for (std::size_t step = block.end_step_; step > block.first_step_; step--)
+            {
+                const Step &current = steps[step - 1];
+                const std::size_t index = (current.addr_ - function_addr_) / INSTRUCTION_SIZE;
+
+                live_after_[index] = live;
+                dead_writes_[index] = current.effect_.observes_ ? RegisterSet() : ~live;
+
+                live = transfer(current.effect_, live);
+            }
+        }
+
+        live_in_ = blocks.front().live_in_;
+    }
+
+    const RegisterLiveness::RegisterSet &RegisterLiveness::live_after(std::uint32_t addr) const
+    {
+        const std::size_t index = (addr - function_addr_) / INSTRUCTION_SIZE;
+
+        if ((addr < function_addr_) || (index >= live_after_.size()))
+        {
+            throw std::runtime_error(std::format("Address {:08X} is outside of function {:08X}", addr, function_addr_));
+        }
+
+        return live_after_[index];
+    }
+
+    const RegisterLiveness::RegisterSet &RegisterLiveness::dead_writes(std::uint32_t addr) const
+    {
+        const std::size_t index = (addr - function_addr_) / INSTRUCTION_SIZE;
+
+        if ((addr < function_addr_) || (index >= dead_writes_.size()))
+        {
+            throw std::runtime_error(std::format("Address {:08X} is outside of function {:08X}", addr, function_addr_));
+        }
+
+        return dead_writes_[index];
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "DecodedProgram.h"
+#include "Function.h"
+#include "Register.h"
+
+#include <bitset>
+#include <cstdint>
+#include <vector>
+
+namespace Pip2
+{
+    /**
+     * @brief Backward liveness of the guest registers over the blocks of one function.
+     *
+     * Anything that can observe the context (calls, HLE and special functions, returns, indirect jumps) is treated as
+     * reading every register, so a register is only dead while it's certain to be overwritten before leaving the
+     * function's own code.
+     */
+    class RegisterLiveness
+    {
+    public:
+        using RegisterSet = std::bitset<Register::TotalCount>;
+
+        struct InstructionEffect
+        {
+            RegisterSet uses_;
+            RegisterSet kills_;
+
+            // Reads the whole context, e.g. a call or a return
+            bool observes_ = false;
+        };
+
+    private:
+        std::uint32_t function_addr_;
+
+        // Per instruction word of the function, operand words included
+        std::vector<RegisterSet> live_after_;
+        std::vector<RegisterSet> dead_writes_;
+        RegisterSet live_in_;
+
+    public:
+        explicit RegisterLiveness(const DecodedProgram &program, const Function &function);
+
+        /**
+         * @brief Registers read and fully overwritten by an instruction, following what its translator does.
+         *
+         * Writes of a byte or a half keep the rest of the register, so they count as a read instead of a kill.
+         */
+        static InstructionEffect get_instruction_effect(const DecodedInstruction &decoded);
+
+        /**
+         * @brief Registers whose value on entry to the function may be read.
+         */
+        [[nodiscard]] const RegisterSet &live_in() const { return live_in_; }
+
+        /**
+         * @brief Registers whose value after the instruction at the given address may be read.
+         */
+        [[nodiscard]] const RegisterSet &live_after(std::uint32_t addr) const;
+
+        /**
+         * @brief Registers the instruction at the given address may skip writing back, since nothing reads them
+         * before they are overwritten.
+         *
+         * Always empty for instructions that observe the context themselves, as they read their own writes.
+         */
+        [[nodiscard]] const RegisterSet &dead_writes(std::uint32_t addr) const;
+    };
+}
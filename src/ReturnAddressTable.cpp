@@ -0,0 +1,213 @@
+#include "ReturnAddressTable.h"
+
+#include <llvm/ExecutionEngine/JITLink/JITLink.h>
+#include <llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h>
+#include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
+#include <llvm/Object/ELFObjectFile.h>
+#include <llvm/Object/StackMapParser.h>
+#include <llvm/Support/Endian.h>
+
+#include <algorithm>
+
+namespace Pip2 {
+    // Version 3 stack map layout: a 16 byte header, then one 24 byte record per function starting with its address
+    static constexpr std::size_t STACK_MAP_HEADER_SIZE = 16;
+    static constexpr std::size_t STACK_MAP_FUNCTION_SIZE = 24;
+
+    static bool is_stack_map_section(llvm::StringRef name) {
+        // ELF and COFF use the first name, Mach-O the second, prefixed by its segment in JITLink
+        return (name == ".llvm_stackmaps") || name.endswith("__llvm_stackmaps");
+    }
+
+    static void add_loaded_object(ReturnAddressTable &table, const llvm::object::ObjectFile &object,
+                                  const llvm::RuntimeDyld::LoadedObjectInfo &loaded_info) {
+        auto stack_map_section = std::find_if(object.section_begin(), object.section_end(), [](const llvm::object::SectionRef &section) {
+            auto name = section.getName();
+            if (!name) {
+                llvm::consumeError(name.takeError());
+                return false;
+            }
+
+            return is_stack_map_section(*name);
+        });
+
+        if (stack_map_section == object.section_end()) {
+            return;
+        }
+
+        auto contents = stack_map_section->getContents();
+        if (!contents) {
+            llvm::consumeError(contents.takeError());
+            return;
+        }
+
+        // Relocations are only applied once the object is finalized, by then its code may already run. So resolve
+        // the function addresses of the section the same way the linker is about to
+        std::map<std::uint64_t, std::uint64_t> function_addresses;
+
+        for (const auto &section: object.sections()) {
+            auto relocated_section = section.getRelocatedSection();
+            if (!relocated_section) {
+                llvm::consumeError(relocated_section.takeError());
+                continue;
+            }
+
+            if (*relocated_section != stack_map_section) {
+                continue;
+            }
+
+            for (const auto &relocation: section.relocations()) {
+                const std::uint64_t offset = relocation.getOffset();
+                auto symbol = relocation.getSymbol();
+
+                if ((symbol == object.symbol_end()) || (offset + sizeof(std::uint64_t) > contents->size())) {
+                    continue;
+                }
+
+                auto symbol_address = symbol->getAddress();
+                auto symbol_section = symbol->getSection();
+
+                if (!symbol_address || !symbol_section) {
+                    llvm::consumeError(symbol_address.takeError());
+                    llvm::consumeError(symbol_section.takeError());
+                    continue;
+                }
+
+                if (*symbol_section == object.section_end()) {
+                    continue;
+                }
+
+                // ELF keeps the addend in the relocation, the other formats in the relocated field
+                std::int64_t addend = 0;
+
+                if (object.isELF()) {
+                    auto elf_addend = llvm::object::ELFRelocationRef(relocation).getAddend();
+                    if (!elf_addend) {
+                        llvm::consumeError(elf_addend.takeError());
+                        continue;
+                    }
+
+                    addend = *elf_addend;
+                } else {
+                    addend = static_cast<std::int64_t>(llvm::support::endian::read64le(contents->data() + offset));
+                }
+
+                const std::uint64_t section_load_address = loaded_info.getSectionLoadAddress(**symbol_section);
+                function_addresses[offset] = section_load_address + (*symbol_address - (*symbol_section)->getAddress()) + addend;
+            }
+        }
+
+        table.add_stack_map(llvm::arrayRefFromStringRef(*contents), &function_addresses);
+    }
+
+    /**
+     * @brief Reads the stack maps of the objects linked by JITLink, once their function addresses are fixed up.
+     */
+    class StackMapPlugin: public llvm::orc::ObjectLinkingLayer::Plugin {
+    private:
+        ReturnAddressTable &table_;
+
+        static llvm::jitlink::Section *find_stack_map_section(llvm::jitlink::LinkGraph &graph) {
+            for (auto &section: graph.sections()) {
+                if (is_stack_map_section(section.getName())) {
+                    return &section;
+                }
+            }
+
+            return nullptr;
+        }
+
+    public:
+        explicit StackMapPlugin(ReturnAddressTable &table)
+            : table_(table) {
+        }
+
+        void modifyPassConfig(llvm::orc::MaterializationResponsibility &responsibility, llvm::jitlink::LinkGraph &graph,
+                              llvm::jitlink::PassConfiguration &config) override {
+            // Nothing refers to the stack maps, keep them from being dead stripped
+            config.PrePrunePasses.push_back([](llvm::jitlink::LinkGraph &graph) {
+                if (auto section = find_stack_map_section(graph)) {
+                    for (auto block: section->blocks()) {
+                        graph.addAnonymousSymbol(*block, 0, block->getSize(), false, true);
+                    }
+                }
+
+                return llvm::Error::success();
+            });
+
+            // Runs before the symbols are reported as emitted, so nothing can call into the object yet
+            config.PostFixupPasses.push_back([this](llvm::jitlink::LinkGraph &graph) {
+                if (auto section = find_stack_map_section(graph)) {
+                    for (auto block: section->blocks()) {
+                        table_.add_stack_map(llvm::arrayRefFromStringRef(llvm::StringRef(block->getContent().data(), block->getSize())));
+                    }
+                }
+
+                return llvm::Error::success();
+            });
+        }
+
+        llvm::Error notifyFailed(llvm::orc::MaterializationResponsibility &responsibility) override {
+            return llvm::Error::success();
+        }
+
+        llvm::Error notifyRemovingResources(llvm::orc::JITDylib &dylib, llvm::orc::ResourceKey key) override {
+            return llvm::Error::success();
+        }
+
+        void notifyTransferringResources(llvm::orc::JITDylib &dylib, llvm::orc::ResourceKey destination_key,
+                                         llvm::orc::ResourceKey source_key) override {
+        }
+    };
+
+    void ReturnAddressTable::attach(llvm::orc::LLJIT &jit) {
+        auto &object_layer = jit.getObjLinkingLayer();
+
+        if (auto rtdyld_layer = llvm::dyn_cast<llvm::orc::RTDyldObjectLinkingLayer>(&object_layer)) {
+            rtdyld_layer->setNotifyLoaded([this](llvm::orc::MaterializationResponsibility &responsibility,
+                                                 const llvm::object::ObjectFile &object,
+                                                 const llvm::RuntimeDyld::LoadedObjectInfo &loaded_info) {
+                add_loaded_object(*this, object, loaded_info);
+            });
+        } else if (auto jitlink_layer = llvm::dyn_cast<llvm::orc::ObjectLinkingLayer>(&object_layer)) {
+            jitlink_layer->addPlugin(std::make_unique<StackMapPlugin>(*this));
+        }
+    }
+
+    void ReturnAddressTable::add_stack_map(llvm::ArrayRef<std::uint8_t> section, const std::map<std::uint64_t, std::uint64_t> *function_addresses) {
+        if ((section.size() < STACK_MAP_HEADER_SIZE) || (section[0] != 3)) {
+            return;
+        }
+
+        llvm::StackMapParser<llvm::support::little> parser(section);
+        auto record = parser.records_begin();
+        std::size_t function_offset = STACK_MAP_HEADER_SIZE;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        for (const auto &function: parser.functions()) {
+            std::optional<std::uint64_t> function_address = function.getFunctionAddress();
+
+            if (function_addresses) {
+                auto resolved = function_addresses->find(function_offset);
+                function_address = (resolved == function_addresses->end()) ? std::nullopt : std::optional<std::uint64_t>(resolved->second);
+            }
+
+            for (std::uint64_t i = 0; i < function.getRecordCount(); i++, ++record) {
+                if (function_address.has_value()) {
+                    guest_pcs_[static_cast<std::uintptr_t>(function_address.value() + record->getInstructionOffset())] =
+                            static_cast<std::uint32_t>(record->getID());
+                }
+            }
+
+            function_offset += STACK_MAP_FUNCTION_SIZE;
+        }
+    }
+
+    std::optional<std::uint32_t> ReturnAddressTable::guest_pc(std::uintptr_t return_address) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto entry = guest_pcs_.find(return_address);
+        return (entry == guest_pcs_.end()) ? std::nullopt : std::optional<std::uint32_t>(entry->second);
+    }
+}
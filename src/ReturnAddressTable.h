@@ -0,0 +1,45 @@
+#pragma once
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+
+namespace Pip2 {
+    /**
+     * @brief Side table from the return addresses of HLE calls in translated code to the guest PC after the call.
+     *
+     * Translated code doesn't store PC before calling the HLE handler. The call is a statepoint instead, whose ID is
+     * the guest PC, and the table is filled from the stack map section of every object the JIT links, cached objects
+     * included. An HLE call inlined into several functions gets one entry for each copy.
+     */
+    class ReturnAddressTable {
+    private:
+        mutable std::mutex mutex_;
+        std::map<std::uintptr_t, std::uint32_t> guest_pcs_;
+
+    public:
+        /**
+         * @brief Fill the table from the objects the JIT links from now on.
+         */
+        void attach(llvm::orc::LLJIT &jit);
+
+        /**
+         * @brief Add the records of a stack map section.
+         *
+         * Function addresses are read from the section, unless function_addresses has them by offset in the section,
+         * for a section that isn't relocated yet.
+         */
+        void add_stack_map(llvm::ArrayRef<std::uint8_t> section, const std::map<std::uint64_t, std::uint64_t> *function_addresses = nullptr);
+
+        /**
+         * @brief Get the guest PC of the translated code a host call returns to.
+         *
+         * Returns nothing for return addresses outside of HLE calls.
+         */
+        [[nodiscard]] std::optional<std::uint32_t> guest_pc(std::uintptr_t return_address) const;
+    };
+}
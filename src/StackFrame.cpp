@@ -0,0 +1,415 @@
+#include "StackFrame.h"
+#include "Common.h"
+#include "Constants.h"
+#include "RegisterLiveness.h"
+
+#include <algorithm>
+#include <format>
+#include <map>
+#include <stdexcept>
+
+namespace Pip2
+{
+    namespace
+    {
+        struct StackEffect
+        {
+            // How much the instruction moves the SP
+            std::int32_t sp_delta_ = 0;
+
+            // Bytes accessed relative to the SP before the instruction, if any
+            std::int32_t access_offset_ = 0;
+            std::uint32_t access_size_ = 0;
+            bool write_ = false;
+
+            // Only whole words are accessed, through the value of a register
+            bool word_access_ = false;
+        };
+
+        bool is_register_in_range(Register reg, std::uint32_t first, std::uint32_t size)
+        {
+            return (reg >= first) && (reg < first + size);
+        }
+
+        void set_access(StackEffect &effect, std::int32_t offset, std::uint32_t size, bool write, bool whole_words)
+        {
+            effect.access_offset_ = offset;
+            effect.access_size_ = size;
+            effect.write_ = write;
+            effect.word_access_ = whole_words && ((size % 4) == 0) && ((offset & 3) == 0);
+        }
+
+        /**
+         * How an instruction moves the SP and which stack bytes it accesses. Returns std::nullopt when the SP is
+         * moved by an unknown amount, or its value is copied somewhere the frame could be reached from.
+         */
+        std::optional<StackEffect> get_stack_effect(const DecodedInstruction &decoded)
+        {
+            const auto &encoding = decoded.instruction_.two_sources_encoding;
+            const auto &range = decoded.instruction_.range_reg_encoding;
+            StackEffect effect;
+
+            switch (decoded.opcode())
+            {
+                case Opcode::LDBd:
+                case Opcode::LDBUd:
+                case Opcode::LDHd:
+                case Opcode::LDHUd:
+                case Opcode::LDWd:
+                case Opcode::STBd:
+                case Opcode::STHd:
+                case Opcode::STWd:
+                {
+                    if (encoding.rs != Register::SP)
+                    {
+                        break;
+                    }
+
+                    const bool is_load = (decoded.opcode() == Opcode::LDBd) || (decoded.opcode() == Opcode::LDBUd) ||
+                        (decoded.opcode() == Opcode::LDHd) || (decoded.opcode() == Opcode::LDHUd) || (decoded.opcode() == Opcode::LDWd);
+
+                    // Loading the SP itself, or storing its value
+                    if ((encoding.rd == Register::SP) || !decoded.has_constant_operand())
+                    {
+                        return std::nullopt;
+                    }
+
+                    std::uint32_t size = 4;
+
+                    if ((decoded.opcode() == Opcode::LDBd) || (decoded.opcode() == Opcode::LDBUd) || (decoded.opcode() == Opcode::STBd))
+                    {
+                        size = 1;
+                    }
+                    else if ((decoded.opcode() == Opcode::LDHd) || (decoded.opcode() == Opcode::LDHUd) || (decoded.opcode() == Opcode::STHd))
+                    {
+                        size = 2;
+                    }
+
+                    set_access(effect, static_cast<std::int32_t>(decoded.operand_), size, !is_load, true);
+                    return effect;
+                }
+
+                case Opcode::STORE:
+                    if (range.rs == Register::ZR)
+                    {
+                        set_access(effect, -4, 4, false, true);
+                        effect.sp_delta_ = -4;
+                    }
+                    else
+                    {
+                        if (is_register_in_range(Register::SP, range.rs, range.count))
+                        {
+                            return std::nullopt;
+                        }
+
+                        set_access(effect, -static_cast<std::int32_t>(range.count), range.count, true, true);
+                        effect.sp_delta_ = -static_cast<std::int32_t>(range.count);
+                    }
+
+                    return effect;
+
+                case Opcode::RESTORE:
+                case Opcode::RET:
+                    if (range.rs == Register::ZR)
+                    {
+                        set_access(effect, 0, 4, false, true);
+                        effect.sp_delta_ = 4;
+                    }
+                    else
+                    {
+                        if (is_register_in_range(Register::SP, range.rs - range.count + 4, range.count))
+                        {
+                            return std::nullopt;
+                        }
+
+                        set_access(effect, 0, range.count, false, true);
+                        effect.sp_delta_ = static_cast<std::int32_t>(range.count);
+                    }
+
+                    return effect;
+
+                case Opcode::ADDi:
+                case Opcode::SUBi:
+                case Opcode::ADDQ:
+                {
+                    if ((encoding.rd != Register::SP) || (encoding.rs != Register::SP))
+                    {
+                        break;
+                    }
+
+                    if (decoded.opcode() == Opcode::ADDQ)
+                    {
+                        effect.sp_delta_ = static_cast<std::int32_t>(Common::sign_extend(static_cast<std::uint8_t>(encoding.rt)));
+                    }
+                    else if (decoded.has_constant_operand())
+                    {
+                        const auto amount = static_cast<std::int32_t>(decoded.operand_);
+                        effect.sp_delta_ = (decoded.opcode() == Opcode::ADDi) ? amount : -amount;
+                    }
+                    else
+                    {
+                        return std::nullopt;
+                    }
+
+                    return effect;
+                }
+
+                default:
+                    break;
+            }
+
+            // Anything else must leave the SP alone
+            const auto register_effect = RegisterLiveness::get_instruction_effect(decoded);
+
+            if (register_effect.uses_.test(Register::SP >> 2) || register_effect.kills_.test(Register::SP >> 2))
+            {
+                return std::nullopt;
+            }
+
+            return effect;
+        }
+    }
+
+    StackFrame::StackFrame(const DecodedProgram &program, const Function &function)
+        : function_addr_(function.addr_)
+        , promoted_sp_offsets_(function.length_ / INSTRUCTION_SIZE)
+    {
+        struct Step
+        {
+            std::uint32_t addr_;
+            StackEffect effect_;
+            std::vector<std::size_t> successors_ = {};
+
+            std::optional<std::int32_t> sp_offset_ = std::nullopt;
+        };
+
+        const std::uint32_t function_end = function.addr_ + static_cast<std::uint32_t>(function.length_);
+
+        std::vector<Step> steps;
+        std::map<std::uint32_t, std::size_t> step_indices;
+
+        for (std::uint32_t addr = function.addr_; addr < function_end;)
+        {
+            const DecodedInstruction &decoded = program.at(addr);
+            auto effect = get_stack_effect(decoded);
+
+            if (!effect)
+            {
+                return;
+            }
+
+            step_indices.emplace(addr, steps.size());
+            steps.push_back(Step{ addr, effect.value() });
+
+            addr += decoded.has(OPCODE_PROPERTY_CONSUMES_DWORD) ? INSTRUCTION_SIZE * 2 : INSTRUCTION_SIZE;
+        }
+
+        // Same control flow as the translator's blocks, leaving the function ends the path
+        for (std::size_t i = 0; i < steps.size(); i++)
+        {
+            Step &step = steps[i];
+            const DecodedInstruction &decoded = program.at(step.addr_);
+
+            auto add_successor = [&](std::uint32_t target)
+            {
+                auto successor = step_indices.find(target);
+
+                if (successor != step_indices.end())
+                {
+                    step.successors_.push_back(successor->second);
+                }
+            };
+
+            if (decoded.opcode() == Opcode::JPr)
+            {
+                auto jump_table = std::find_if(function.jump_tables_.begin(), function.jump_tables_.end(), [&step](const JumpTable &table) {
+                    return table.jump_instruction_addr_ == step.addr_;
+                });
+
+                if (jump_table != function.jump_tables_.end())
+                {
+                    for (const auto label: jump_table->labels_)
+                    {
+                        add_successor(static_cast<std::uint32_t>(label));
+                    }
+                }
+            }
+            else if (decoded.has(OPCODE_PROPERTY_DIRECT_BRANCH) && (decoded.opcode() != Opcode::CALLl))
+            {
+                if (auto target = decoded.direct_branch_target(step.addr_))
+                {
+                    add_successor(target.value());
+                }
+
+                if ((decoded.opcode() != Opcode::JPl) && (i + 1 < steps.size()))
+                {
+                    step.successors_.push_back(i + 1);
+                }
+            }
+            else if (!decoded.is_block_cutoff() && (i + 1 < steps.size()))
+            {
+                step.successors_.push_back(i + 1);
+            }
+        }
+
+        if (steps.empty())
+        {
+            return;
+        }
+
+        // Every path must reach an instruction with the SP at the same offset
+        std::vector<std::size_t> pending = { 0 };
+        steps.front().sp_offset_ = 0;
+
+        while (!pending.empty())
+        {
+            const Step &step = steps[pending.back()];
+            pending.pop_back();
+
+            const std::int32_t next_offset = step.sp_offset_.value() + step.effect_.sp_delta_;
+
+            for (const auto successor: step.successors_)
+            {
+                if (!steps[successor].sp_offset_)
+                {
+                    steps[successor].sp_offset_ = next_offset;
+                    pending.push_back(successor);
+                }
+                else if (steps[successor].sp_offset_.value() != next_offset)
+                {
+                    return;
+                }
+            }
+        }
+
+        // Code reached some other way could move the SP or access the frame with offsets we don't know about
+        for (const auto &step: steps)
+        {
+            if (!step.sp_offset_ && ((step.effect_.sp_delta_ != 0) || (step.effect_.access_size_ != 0)))
+            {
+                return;
+            }
+        }
+
+        // Word slots below the SP on entry, and whether some access prevents keeping them out of guest memory
+        std::map<std::int32_t, bool> slot_blocked;
+        std::vector<bool> promotable(steps.size());
+
+        auto for_each_slot = [](const Step &step, auto &&callback)
+        {
+            const std::int32_t start = step.sp_offset_.value() + step.effect_.access_offset_;
+            const std::int32_t end = start + static_cast<std::int32_t>(step.effect_.access_size_);
+
+            for (std::int32_t slot = start & ~3; (slot < end) && (slot < 0); slot += 4)
+            {
+                callback(slot);
+            }
+        };
+
+        for (std::size_t i = 0; i < steps.size(); i++)
+        {
+            const Step &step = steps[i];
+
+            if (!step.sp_offset_ || (step.effect_.access_size_ == 0))
+            {
+                continue;
+            }
+
+            const std::int32_t start = step.sp_offset_.value() + step.effect_.access_offset_;
+            promotable[i] = step.effect_.word_access_ && ((start & 3) == 0) &&
+                (start + static_cast<std::int32_t>(step.effect_.access_size_) <= 0);
+
+            for_each_slot(step, [&](std::int32_t slot) {
+                slot_blocked[slot] = slot_blocked[slot] || !promotable[i];
+            });
+        }
+
+        // An access that can't be promoted keeps all the slots it touches in guest memory, which can in turn
+        // prevent other accesses from being promoted
+        bool changed = true;
+
+        while (changed)
+        {
+            changed = false;
+
+            for (std::size_t i = 0; i < steps.size(); i++)
+            {
+                if (!promotable[i])
+                {
+                    continue;
+                }
+
+                bool blocked = false;
+                for_each_slot(steps[i], [&](std::int32_t slot) {
+                    blocked = blocked || slot_blocked[slot];
+                });
+
+                if (blocked)
+                {
+                    promotable[i] = false;
+                    for_each_slot(steps[i], [&](std::int32_t slot) {
+                        slot_blocked[slot] = true;
+                    });
+
+                    changed = true;
+                }
+            }
+        }
+
+        std::vector<std::int32_t> slots;
+
+        for (const auto &[slot, blocked]: slot_blocked)
+        {
+            if (!blocked)
+            {
+                slots.push_back(slot);
+            }
+        }
+
+        if (slots.empty() || (slots.size() > MAX_PROMOTED_SLOTS))
+        {
+            return;
+        }
+
+        slots_ = std::move(slots);
+
+        std::vector<bool> written(slots_.size());
+
+        for (std::size_t i = 0; i < steps.size(); i++)
+        {
+            if (!promotable[i])
+            {
+                continue;
+            }
+
+            promoted_sp_offsets_[(steps[i].addr_ - function_addr_) / INSTRUCTION_SIZE] = steps[i].sp_offset_;
+
+            if (steps[i].effect_.write_)
+            {
+                for_each_slot(steps[i], [&](std::int32_t slot) {
+                    written[std::lower_bound(slots_.begin(), slots_.end(), slot) - slots_.begin()] = true;
+                });
+            }
+        }
+
+        for (std::size_t i = 0; i < slots_.size(); i++)
+        {
+            if (written[i])
+            {
+                written_slots_.push_back(slots_[i]);
+            }
+        }
+    }
+
+    std::optional<std::int32_t> StackFrame::promoted_sp_offset(std::uint32_t addr) const
+    {
+        const std::size_t index = (addr - function_addr_) / INSTRUCTION_SIZE;
+
+        if ((addr < function_addr_) || (index >= promoted_sp_offsets_.size()))
+        {
+            throw std::runtime_error(std::format("Address {:08X} is outside of function {:08X}", addr, function_addr_));
+        }
+
+        return promoted_sp_offsets_[index];
+    }
+}
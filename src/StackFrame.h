@@ -0,0 +1,59 @@
+#pragma once
+
+#include "DecodedProgram.h"
+#include "Function.h"
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace Pip2
+{
+    /**
+     * @brief Stack slots of one function that can live in host locals instead of guest memory.
+     *
+     * The SP is followed as an offset from its value on entry. A function qualifies when the SP is only moved by
+     * constant amounts and its value never ends up anywhere else than in an SP relative access, so nothing can point
+     * into the frame. Callees are assumed to give the SP back unchanged.
+     *
+     * Promoted slots are words below the SP on entry, only ever accessed by whole aligned words (LDWd, STWd, STORE,
+     * RESTORE). Guest memory still has to be written back and reloaded wherever the context is observed, since callees
+     * read arguments from the caller's frame.
+     */
+    class StackFrame
+    {
+    public:
+        // Every promoted slot is written back and reloaded around each call, keep that bounded
+        static constexpr std::size_t MAX_PROMOTED_SLOTS = 32;
+
+    private:
+        std::uint32_t function_addr_;
+
+        // Offsets of the promoted slots from the SP on entry, sorted
+        std::vector<std::int32_t> slots_;
+        std::vector<std::int32_t> written_slots_;
+
+        // Per instruction word of the function, operand words included
+        std::vector<std::optional<std::int32_t>> promoted_sp_offsets_;
+
+    public:
+        explicit StackFrame(const DecodedProgram &program, const Function &function);
+
+        /**
+         * @brief Offsets of the promoted slots from the SP on entry.
+         */
+        [[nodiscard]] const std::vector<std::int32_t> &slots() const { return slots_; }
+
+        /**
+         * @brief Promoted slots some instruction writes to, and so that have to be written back to guest memory.
+         */
+        [[nodiscard]] const std::vector<std::int32_t> &written_slots() const { return written_slots_; }
+
+        /**
+         * @brief Offset of the SP from its value on entry, before the instruction at the given address runs.
+         *
+         * Only set for instructions whose stack access reaches promoted slots alone.
+         */
+        [[nodiscard]] std::optional<std::int32_t> promoted_sp_offset(std::uint32_t addr) const;
+    };
+}
@@ -70,6 +70,10 @@ namespace Pip2 {
             case RequestCode::RunHleHandler:
                 hle_handler_(request_userdata_, request_arg_);
                 break;
+            case RequestCode::RunHostFunction:
+                request_function_();
+                request_function_ = nullptr;
+                break;
             case RequestCode::Exit:
                 break;
         }
@@ -210,4 +214,17 @@ namespace Pip2 {
 
         co_switch(main_handle_);
     }
+
+    void TaskHandler::call_host_function_task_safe(const std::function<void()> &func) {
+        // Task stacks are small, so heavy host work (like compiling) runs on the main stack
+        if (current_task_id_ < 0) {
+            func();
+            return;
+        }
+
+        request_code_ = RequestCode::RunHostFunction;
+        request_function_ = func;
+
+        co_switch(main_handle_);
+    }
 }
@@ -37,6 +37,7 @@ namespace Pip2 {
     private:
         enum RequestCode {
             RunHleHandler,
+            RunHostFunction,
             Exit
         };
 
@@ -60,6 +61,7 @@ namespace Pip2 {
         RequestCode request_code_;
         void *request_userdata_;
         int request_arg_;
+        std::function<void()> request_function_;
 
     private:
         int push_task(std::unique_ptr<TaskData> &task_data);
@@ -98,6 +100,7 @@ namespace Pip2 {
 
         void execute_entry_point_current_task();
         void call_hle_handler_task_safe(void *userdata, int code);
+        void call_host_function_task_safe(const std::function<void()> &func);
 
         VMContext &current_task_context();
     };
@@ -3,90 +3,252 @@
 #include "Common.h"
 #include "Constants.h"
 #include "SpecialFunction.h"
+#include "VMContext.h"
 
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/TargetParser/Host.h>
+#include <llvm/TargetParser/Triple.h>
+
+#include <algorithm>
 #include <format>
 #include <iostream>
+#include <set>
 
 namespace Pip2 {
-    static bool is_branch_cutoff(Instruction instruction, const PoolItems &pool_items, std::uint32_t next_word)
-    {
-        switch (instruction.word_encoding.opcode)
+    std::uint32_t Translator::fetch_immediate() {
+        const DecodedInstruction &decoded = program_.at(current_addr_);
+        current_addr_ += 4;
+
+        if (decoded.has_constant_operand()) {
+            return decoded.operand_;
+        }
+
+        throw std::runtime_error("Invalid immediate");
+    }
+
+    llvm::Value *Translator::get_register_pointer(const Register reg) {
+        if ((reg & 3) != 0)
         {
-        case Opcode::BEQ:
-        case Opcode::BEQI:
-        case Opcode::BEQIB:
-        case Opcode::BNE:
-        case Opcode::BNEI:
-        case Opcode::BNEIB:
-        case Opcode::BLT:
-        case Opcode::BLTI:
-        case Opcode::BLTIB:
-        case Opcode::BLTU:
-        case Opcode::BLTUI:
-        case Opcode::BLTUIB:
-        case Opcode::BLE:
-        case Opcode::BLEI:
-        case Opcode::BLEIB:
-        case Opcode::BLEU:
-        case Opcode::BLEUI:
-        case Opcode::BLEUIB:
-        case Opcode::BGT:
-        case Opcode::BGTI:
-        case Opcode::BGTIB:
-        case Opcode::BGTU:
-        case Opcode::BGTUI:
-        case Opcode::BGTUIB:
-        case Opcode::BGE:
-        case Opcode::BGEI:
-        case Opcode::BGEIB:
-        case Opcode::BGEU:
-        case Opcode::BGEUI:
-        case Opcode::BGEUIB:
-        case Opcode::JPl:
-        case Opcode::RET:
-        case Opcode::JPr:
-            return true;
-
-        case Opcode::CALLl: {
-            if (Common::get_immediate_pip_dword(next_word)) {
-                return false;
+            throw std::runtime_error("Invalid register");
+        }
+
+        return builder_.CreateGEP(context_type_,
+                                  current_register_cache_ ? current_register_cache_ : current_context_,
+                                  { builder_.getInt32(0), builder_.getInt32(reg >> 2) });
+    }
+
+    void Translator::mark_registers_accessed(Register first, std::uint32_t size, bool write) {
+        for (std::uint32_t offset = 0; offset < size; offset += 4) {
+            const std::uint32_t index = (first + offset) >> 2;
+
+            if (index >= Register::TotalCount) {
+                throw std::runtime_error("Register range out of bounds");
             }
 
-            return (pool_items.is_pool_item_terminate_function(next_word));
+            current_used_registers_.set(index);
+
+            if (write) {
+                current_written_registers_.set(index);
+            }
         }
+    }
 
-        case Opcode::CALLr:
-            return false;
+    llvm::CallInst *Translator::create_sync_call(llvm::FunctionCallee callee, llvm::ArrayRef<llvm::Value *> args,
+                                                 const RegisterLiveness::RegisterSet &passed_registers,
+                                                 const RegisterLiveness::RegisterSet &returned_registers) {
+        auto call = builder_.CreateCall(callee, args);
 
-        default:
-            return false;
+        if (current_register_cache_ || !current_stack_slots_.empty()) {
+            current_sync_calls_.push_back(SyncCall{ call, ~passed_registers, current_live_registers_ & ~returned_registers });
         }
+
+        return call;
     }
 
-    std::uint32_t Translator::fetch_immediate() {
-        std::uint32_t dword = *reinterpret_cast<std::uint32_t*>(config_.memory_base() + current_addr_ + INSTRUCTION_SIZE);
-        current_addr_ += 4;
+    llvm::CallInst *Translator::create_sync_statepoint_call(std::uint64_t id, llvm::FunctionCallee callee, llvm::ArrayRef<llvm::Value *> args) {
+        // No deoptimization state nor GC pointers, the statepoint is only there for its stack map record. Functions
+        // holding one still need a GC strategy that lowers statepoints
+        current_function_->setGC(STATEPOINT_GC_NAME);
+        auto call = builder_.CreateGCStatepointCall(id, 0, callee, args, {}, {});
+
+        if (current_register_cache_ || !current_stack_slots_.empty()) {
+            current_sync_calls_.push_back(SyncCall{ call, RegisterLiveness::RegisterSet().set(), current_live_registers_ });
+        }
+
+        return call;
+    }
 
-        if (std::optional<std::uint32_t> constant_dword = Common::get_immediate_pip_dword(dword)) {
-            return constant_dword.value();
+    llvm::ReturnInst *Translator::create_sync_return() {
+        RegisterLiveness::RegisterSet returned_registers;
+        llvm::ReturnInst *ret = nullptr;
+
+        if (current_host_call_) {
+            llvm::Value *result = llvm::PoisonValue::get(host_call_return_type_);
+
+            for (std::uint32_t i = 0; i < HOST_CALL_RETURN_REGISTERS.size(); i++) {
+                result = builder_.CreateInsertValue(result, load_register(i32_type_, HOST_CALL_RETURN_REGISTERS[i]), { i });
+                returned_registers.set(HOST_CALL_RETURN_REGISTERS[i] >> 2);
+            }
+
+            ret = builder_.CreateRet(result);
+        } else {
+            ret = builder_.CreateRetVoid();
         }
 
-        if (config_.pool_items().is_pool_item_constant(dword)) {
-            return config_.pool_items().get_pool_item_constant(dword);
+        if (current_register_cache_ || !current_stack_slots_.empty()) {
+            current_sync_returns_.emplace_back(ret, ~returned_registers);
         }
 
-        throw std::runtime_error("Invalid immediate");
+        return ret;
     }
 
-    llvm::Value *Translator::get_register_pointer(const Register reg) {
-        if ((reg & 3) != 0)
-        {
-            throw std::runtime_error("Invalid register");
+    llvm::CallInst *Translator::create_sync_tail_call(llvm::FunctionCallee callee, llvm::ArrayRef<llvm::Value *> args) {
+        // Guest code chaining jumps must not grow the host stack, so nothing may sit between the call and the
+        // return: everything is written back before the call, and there is nothing to reload after it
+        auto call = builder_.CreateCall(callee, args);
+        call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+        builder_.CreateRetVoid();
+
+        if (current_register_cache_ || !current_stack_slots_.empty()) {
+            current_sync_tail_calls_.push_back(call);
         }
 
-        return builder_.CreateGEP(context_type_,
-                                  current_context_,
-                                  { builder_.getInt32(0), builder_.getInt32(reg >> 2) });
+        return call;
+    }
+
+    void Translator::flush_register_cache(llvm::Instruction *before, const RegisterLiveness::RegisterSet &registers) {
+        builder_.SetInsertPoint(before);
+
+        for (std::size_t i = 0; i < Register::TotalCount; i++) {
+            if (!current_written_registers_.test(i) || !registers.test(i)) {
+                continue;
+            }
+
+            auto index = builder_.getInt32(static_cast<std::uint32_t>(i));
+            auto value = builder_.CreateLoad(i32_type_, builder_.CreateGEP(context_type_, current_register_cache_, { builder_.getInt32(0), index }));
+            auto store = builder_.CreateStore(value, builder_.CreateGEP(context_type_, current_context_, { builder_.getInt32(0), index }));
+
+            value->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_register_);
+            store->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_register_);
+        }
+    }
+
+    void Translator::reload_register_cache(llvm::Instruction *before, const RegisterLiveness::RegisterSet &live_registers) {
+        builder_.SetInsertPoint(before);
+
+        for (std::size_t i = 0; i < Register::TotalCount; i++) {
+            if (!current_used_registers_.test(i) || !live_registers.test(i)) {
+                continue;
+            }
+
+            auto index = builder_.getInt32(static_cast<std::uint32_t>(i));
+            auto value = builder_.CreateLoad(i32_type_, builder_.CreateGEP(context_type_, current_context_, { builder_.getInt32(0), index }));
+            auto store = builder_.CreateStore(value, builder_.CreateGEP(context_type_, current_register_cache_, { builder_.getInt32(0), index }));
+
+            value->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_register_);
+            store->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_register_);
+        }
+    }
+
+    void Translator::finalize_register_cache(llvm::BasicBlock *entry_block) {
+        // Registers the function touches are loaded once on entry. Written ones are stored back before anything
+        // that can observe the context (calls, HLE calls, special functions, returns), and everything is reloaded
+        // after a call since the callee is free to change any register. Registers that are overwritten before
+        // being read again are not loaded at all. Registers passed in host registers skip the context both ways.
+        RegisterLiveness::RegisterSet entry_registers = current_liveness_->live_in();
+
+        if (current_host_call_) {
+            builder_.SetInsertPoint(entry_block->getTerminator());
+
+            for (std::uint32_t i = 0; i < HOST_CALL_ARGUMENT_REGISTERS.size(); i++) {
+                auto store = builder_.CreateStore(current_function_->getArg(function_type_->getNumParams() + i),
+                                                  get_register_pointer(HOST_CALL_ARGUMENT_REGISTERS[i]));
+                store->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_register_);
+
+                entry_registers.reset(HOST_CALL_ARGUMENT_REGISTERS[i] >> 2);
+            }
+        }
+
+        reload_register_cache(entry_block->getTerminator(), entry_registers);
+
+        for (const auto &sync_call: current_sync_calls_) {
+            flush_register_cache(sync_call.call_, sync_call.flushed_registers_);
+            reload_register_cache(sync_call.call_->getNextNode(), sync_call.reloaded_registers_);
+        }
+
+        for (const auto &[ret, flushed_registers]: current_sync_returns_) {
+            flush_register_cache(ret, flushed_registers);
+        }
+
+        for (auto call: current_sync_tail_calls_) {
+            flush_register_cache(call, RegisterLiveness::RegisterSet().set());
+        }
+    }
+
+    llvm::Value *Translator::get_stack_slot(std::uint32_t instruction_addr, std::int32_t offset) {
+        if (current_stack_slots_.empty()) {
+            return nullptr;
+        }
+
+        auto sp_offset = current_stack_frame_->promoted_sp_offset(instruction_addr);
+
+        if (!sp_offset.has_value()) {
+            return nullptr;
+        }
+
+        auto slot = current_stack_slots_.find(sp_offset.value() + offset);
+
+        if (slot == current_stack_slots_.end()) {
+            throw std::runtime_error(std::format("Stack access at {:08X} is outside of the promoted slots", instruction_addr));
+        }
+
+        return slot->second;
+    }
+
+    void Translator::flush_stack_slots(llvm::Instruction *before) {
+        builder_.SetInsertPoint(before);
+
+        for (const auto offset: current_stack_frame_->written_slots()) {
+            auto value = builder_.CreateLoad(i32_type_, current_stack_slots_[offset]);
+            create_memory_store(value, builder_.CreateAdd(current_entry_sp_, builder_.getInt32(offset)));
+        }
+    }
+
+    void Translator::reload_stack_slots(llvm::Instruction *before) {
+        builder_.SetInsertPoint(before);
+
+        for (const auto &[offset, slot]: current_stack_slots_) {
+            auto value = create_memory_load(i32_type_, builder_.CreateAdd(current_entry_sp_, builder_.getInt32(offset)));
+            builder_.CreateStore(value, slot);
+        }
+    }
+
+    void Translator::finalize_stack_slots(llvm::BasicBlock *entry_block) {
+        // Slots hold what guest memory has on entry and after every call, as callees read and write the caller's
+        // frame for their arguments. What the function wrote is put back before anything can observe it.
+        reload_stack_slots(entry_block->getTerminator());
+
+        for (const auto &sync_call: current_sync_calls_) {
+            flush_stack_slots(sync_call.call_);
+            reload_stack_slots(sync_call.call_->getNextNode());
+        }
+
+        for (const auto &[ret, flushed_registers]: current_sync_returns_) {
+            flush_stack_slots(ret);
+        }
+
+        for (auto call: current_sync_tail_calls_) {
+            flush_stack_slots(call);
+        }
+    }
+
+    llvm::Value *Translator::load_register(llvm::Type *type, Register src) {
+        mark_registers_accessed(src, 4, false);
+
+        auto value = builder_.CreateLoad(type, get_register_pointer(src));
+        value->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_register_);
+
+        return value;
     }
 
     template <>
@@ -95,7 +257,7 @@ namespace Pip2 {
             return builder_.getInt32(0);
         }
 
-        return builder_.CreateLoad(i32_type_, get_register_pointer(src));
+        return load_register(i32_type_, src);
     }
 
     template <>
@@ -104,7 +266,7 @@ namespace Pip2 {
             return builder_.getInt32(0);
         }
 
-        return builder_.CreateLoad(i32_type_, get_register_pointer(src));
+        return load_register(i32_type_, src);
     }
 
     template <>
@@ -113,7 +275,7 @@ namespace Pip2 {
             return builder_.getInt16(0);
         }
 
-        return builder_.CreateLoad(i16_type_, get_register_pointer(src));
+        return load_register(i16_type_, src);
     }
 
     template <>
@@ -122,7 +284,7 @@ namespace Pip2 {
             return builder_.getInt16(0);
         }
 
-        return builder_.CreateLoad(i16_type_, get_register_pointer(src));
+        return load_register(i16_type_, src);
     }
 
     template <>
@@ -131,7 +293,7 @@ namespace Pip2 {
             return builder_.getInt8(0);
         }
 
-        return builder_.CreateLoad(i8_type_, get_register_pointer(src));
+        return load_register(i8_type_, src);
     }
 
     template <>
@@ -140,7 +302,7 @@ namespace Pip2 {
             return builder_.getInt8(0);
         }
 
-        return builder_.CreateLoad(i8_type_, get_register_pointer(src));
+        return load_register(i8_type_, src);
     }
 
     void Translator::set_register(Pip2::Register dest, llvm::Value *value) {
@@ -148,7 +310,15 @@ namespace Pip2 {
             throw std::runtime_error("Can't set to ZR register!");
         }
 
-        builder_.CreateStore(value, get_register_pointer(dest));
+        // Nothing reads this value before it's overwritten
+        if (((dest >> 2) < Register::TotalCount) && current_dead_writes_.test(dest >> 2)) {
+            return;
+        }
+
+        mark_registers_accessed(dest, 4, true);
+
+        auto store = builder_.CreateStore(value, get_register_pointer(dest));
+        store->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_register_);
     }
 
     void Translator::translate_function(llvm::Function *function, const Function &function_info) {
@@ -171,6 +341,44 @@ namespace Pip2 {
         }
 
         builder_.SetInsertPoint(entry_block);
+
+        current_register_cache_ = options_.cache_registers_ ? builder_.CreateAlloca(context_type_, nullptr, "register_cache") : nullptr;
+        current_used_registers_.reset();
+        current_written_registers_.reset();
+        current_host_call_ = (function->getFunctionType() == host_call_function_type_);
+
+        if (current_host_call_) {
+            // Arguments never made it to the context, and return values must hold something even when untouched
+            for (const auto reg: HOST_CALL_ARGUMENT_REGISTERS) {
+                mark_registers_accessed(reg, 4, true);
+            }
+
+            for (const auto reg: HOST_CALL_RETURN_REGISTERS) {
+                mark_registers_accessed(reg, 4, false);
+            }
+        }
+
+        current_stack_frame_.emplace(program_, function_info);
+
+        if (!current_stack_frame_->slots().empty()) {
+            // The SP on entry, before the register cache is loaded
+            if (current_host_call_) {
+                current_entry_sp_ = function->getArg(function_type_->getNumParams());
+            } else {
+                auto entry_sp = builder_.CreateLoad(i32_type_, builder_.CreateGEP(context_type_, current_context_, { builder_.getInt32(0), builder_.getInt32(Register::SP >> 2) }));
+                entry_sp->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_register_);
+                current_entry_sp_ = entry_sp;
+            }
+
+            for (const auto offset: current_stack_frame_->slots()) {
+                current_stack_slots_.emplace(offset, builder_.CreateAlloca(i32_type_, nullptr, std::format("stack_slot_{}", -offset)));
+            }
+        }
+
+        if (options_.tiered_compile_) {
+            generate_call_counter(function, function_info.addr_);
+        }
+
         builder_.CreateBr(blocks_[function_info.addr_]);
 
         for (const auto &jump_table: function_info.jump_tables_) {
@@ -178,15 +386,15 @@ namespace Pip2 {
                                                                  JumpTableTranslateState(jump_table.switch_value_resolved_addr_, jump_table.switch_value_register_));
         }
 
-        Instruction previous_inst = { 0 };
-        std::uint32_t previous_next_dword = 0;
+        const DecodedInstruction *previous_decoded = nullptr;
 
         current_function_ = function;
+        current_liveness_.emplace(program_, function_info);
 
         for (current_addr_ = function_info.addr_; current_addr_ < function_info.addr_ + function_info.length_; current_addr_ += INSTRUCTION_SIZE) {
             if (blocks_.find(current_addr_) != blocks_.end()) {
                 // If not branching, it's continuous block
-                if (current_addr_ != function_info.addr_ && !is_branch_cutoff(previous_inst, config_.pool_items(), previous_next_dword))
+                if (current_addr_ != function_info.addr_ && !previous_decoded->is_block_cutoff())
                 {
                     builder_.CreateBr(blocks_[current_addr_]);
                 }
@@ -202,11 +410,11 @@ namespace Pip2 {
                 }
             }
 
-            Instruction instruction { *reinterpret_cast<std::uint32_t*>(config_.memory_base() + current_addr_) };
+            const DecodedInstruction &decoded = program_.at(current_addr_);
+            const Instruction instruction = decoded.instruction_;
 
-            if (current_addr_ + INSTRUCTION_SIZE < function_info.addr_ + function_info.length_) {
-                previous_next_dword = *reinterpret_cast<std::uint32_t*>(config_.memory_base() + current_addr_ + INSTRUCTION_SIZE);
-            }
+            current_live_registers_ = current_liveness_->live_after(current_addr_);
+            current_dead_writes_ = current_liveness_->dead_writes(current_addr_);
 
             InstructionTranslator translator = instruction_translators_[instruction.word_encoding.opcode];
 
@@ -216,8 +424,49 @@ namespace Pip2 {
 
             (this->*translator)(instruction);
 
-            previous_inst = instruction;
+            previous_decoded = &decoded;
         }
+
+        current_dead_writes_.reset();
+
+        if (current_register_cache_) {
+            finalize_register_cache(entry_block);
+            current_register_cache_ = nullptr;
+        }
+
+        if (!current_stack_slots_.empty()) {
+            finalize_stack_slots(entry_block);
+            current_stack_slots_.clear();
+        }
+
+        current_sync_calls_.clear();
+        current_sync_returns_.clear();
+        current_sync_tail_calls_.clear();
+        current_host_call_ = false;
+        current_stack_frame_.reset();
+        current_liveness_.reset();
+    }
+
+    void Translator::generate_call_counter(llvm::Function *function, std::uint32_t addr) {
+        auto module = function->getParent();
+        auto counter = new llvm::GlobalVariable(*module, i32_type_, false, llvm::GlobalValue::InternalLinkage,
+                                                builder_.getInt32(0), std::format("call_count_{:08X}", addr));
+
+        auto call_count = builder_.CreateAdd(builder_.CreateLoad(i32_type_, counter), builder_.getInt32(1));
+        builder_.CreateStore(call_count, counter);
+
+        // Only request once, the engine swaps the lookup table slot when the optimized version is ready
+        auto tier_up_block = llvm::BasicBlock::Create(context_, "tier_up", function);
+        auto body_block = llvm::BasicBlock::Create(context_, "body", function);
+
+        builder_.CreateCondBr(builder_.CreateICmpEQ(call_count, builder_.getInt32(TIER_UP_CALL_THRESHOLD)), tier_up_block, body_block);
+        builder_.SetInsertPoint(tier_up_block);
+
+        auto tier_up_request = module->getOrInsertFunction(TIER_UP_REQUEST_FUNCTION_NAME, std_call_type_[1]);
+        builder_.CreateCall(tier_up_request, { builder_.getInt32(addr) });
+        builder_.CreateBr(body_block);
+
+        builder_.SetInsertPoint(body_block);
     }
 
     void Translator::generate_hle_handler_trampoline(llvm::Module *module) {
@@ -238,6 +487,65 @@ namespace Pip2 {
         builder_.CreateRetVoid();
     }
 
+    void Translator::generate_host_call_wrapper(llvm::Function *function, llvm::Function *host_call_function) {
+        auto block = llvm::BasicBlock::Create(context_, "entry", function);
+        builder_.SetInsertPoint(block);
+
+        std::vector<llvm::Value *> args;
+
+        for (auto &arg: function->args()) {
+            args.push_back(&arg);
+        }
+
+        auto context = function->getArg(0);
+
+        for (const auto reg: HOST_CALL_ARGUMENT_REGISTERS) {
+            auto value = builder_.CreateLoad(i32_type_, builder_.CreateGEP(context_type_, context, { builder_.getInt32(0), builder_.getInt32(reg >> 2) }));
+            value->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_register_);
+
+            args.push_back(value);
+        }
+
+        auto call = builder_.CreateCall(host_call_function, args);
+        call->setCallingConv(llvm::CallingConv::Fast);
+
+        for (std::uint32_t i = 0; i < HOST_CALL_RETURN_REGISTERS.size(); i++) {
+            auto store = builder_.CreateStore(builder_.CreateExtractValue(call, { i }),
+                                              builder_.CreateGEP(context_type_, context, { builder_.getInt32(0), builder_.getInt32(HOST_CALL_RETURN_REGISTERS[i] >> 2) }));
+            store->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_register_);
+        }
+
+        builder_.CreateRetVoid();
+    }
+
+    bool Translator::use_host_calling_convention() const {
+        // Passing registers in host registers only pays off when they live in locals, and callers through the lookup
+        // table must always find a function taking the usual arguments
+        return options_.host_calling_convention_ && options_.cache_registers_ && !options_.lazy_compile_ && !options_.tiered_compile_;
+    }
+
+    bool Translator::has_tail_calls(const Function &function_info) const {
+        const std::uint32_t function_end = function_info.addr_ + static_cast<std::uint32_t>(function_info.length_);
+
+        for (std::uint32_t addr = function_info.addr_; addr < function_end;) {
+            const DecodedInstruction &decoded = program_.at(addr);
+
+            if ((decoded.opcode() == Opcode::JPr) && (decoded.instruction_.two_sources_encoding.rd != Register::RA)) {
+                const bool is_jump_table = std::any_of(function_info.jump_tables_.begin(), function_info.jump_tables_.end(), [addr](const JumpTable &table) {
+                    return table.jump_instruction_addr_ == addr;
+                });
+
+                if (!is_jump_table) {
+                    return true;
+                }
+            }
+
+            addr += decoded.has(OPCODE_PROPERTY_CONSUMES_DWORD) ? INSTRUCTION_SIZE * 2 : INSTRUCTION_SIZE;
+        }
+
+        return false;
+    }
+
     void Translator::generate_entry_point_function(const std::uint32_t entry_point_addr) {
         auto entry_point_sub = functions_[entry_point_addr];
         auto entry_point_func = llvm::Function::Create(function_type_, llvm::GlobalValue::ExternalLinkage,
@@ -250,7 +558,9 @@ namespace Pip2 {
 
         for (const auto &[addr, function_llvm]: functions_) {
             auto function_pointer = builder_.CreateGEP(get_pointer_integer_type(), lookup_table, { builder_.getInt32(addr >> 2) });
-            builder_.CreateStore(function_llvm, function_pointer);
+            auto store = builder_.CreateStore(function_llvm, function_pointer);
+
+            store->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_function_lookup_);
         }
 
         builder_.CreateCall(entry_point_sub, {
@@ -264,32 +574,187 @@ namespace Pip2 {
         builder_.CreateRetVoid();
     }
 
-    std::unique_ptr<llvm::Module> Translator::translate(const std::string &module_name, const std::vector<Function> &functions, bool use_task) {
+    std::unique_ptr<llvm::Module> Translator::translate(const std::string &module_name, const std::vector<Function> &functions, bool use_task,
+                                                        const std::vector<std::vector<Function>> &partitions,
+                                                        const std::set<std::uint32_t> &exported_functions) {
         use_task_ = use_task;
         functions_.clear();
+        host_call_functions_.clear();
+        special_functions_.clear();
 
         auto module = std::make_unique<llvm::Module>(module_name, context_);
 
+        // Functions of other modules are put into the lookup table by name, and with lazy or tiered compilation the
+        // engine fills it by name too. Only the entry point's own module can hide functions from the linker
+        const bool fills_lookup_table = !options_.lazy_compile_ && !options_.tiered_compile_ &&
+                std::any_of(functions.begin(), functions.end(), [](const Function &function) { return function.is_entry_point_; });
+
+        auto is_exported = [&](const Function &function) {
+            return (function.addr_ == functions.front().addr_) || exported_functions.contains(function.addr_);
+        };
+
+        auto declare_function = [&](const Function &function, llvm::GlobalValue::LinkageTypes linkage) {
+            auto function_llvm = llvm::Function::Create(function_type_, linkage, std::format("sub_{:08X}", function.addr_), module.get());
+
+            add_function_argument_attributes(function_llvm);
+            add_function_attributes(function_llvm, function);
+            functions_.emplace(function.addr_, function_llvm);
+        };
+
+        for (const Function &function: functions) {
+            declare_function(function, (fills_lookup_table && !is_exported(function)) ?
+                    llvm::GlobalValue::InternalLinkage : llvm::GlobalValue::ExternalLinkage);
+
+            // The body goes into the host calling convention variant, the usual one just forwards to it. Callers in
+            // other modules, the lookup table and the engine only ever see the usual one. Functions with tail calls
+            // keep the usual signature for their body, musttail needs it on both sides
+            if (use_host_calling_convention() && !has_tail_calls(function)) {
+                auto host_call_function = llvm::Function::Create(host_call_function_type_, llvm::GlobalValue::InternalLinkage,
+                                                                 std::format("sub_{:08X}_host", function.addr_), module.get());
+
+                host_call_function->setCallingConv(llvm::CallingConv::Fast);
+                add_function_argument_attributes(host_call_function);
+                add_function_attributes(host_call_function, function);
+                host_call_functions_.emplace(function.addr_, host_call_function);
+            }
+        }
+
+        for (const auto &partition: partitions) {
+            if (&partition == &functions) {
+                continue;
+            }
+
+            for (const Function &function: partition) {
+                declare_function(function, llvm::GlobalValue::ExternalLinkage);
+            }
+        }
+
         for (const Function &function: functions) {
-            functions_.emplace(function.addr_, llvm::Function::Create(function_type_, llvm::GlobalValue::ExternalLinkage,
-                               std::format("sub_{:08X}", function.addr_), module.get()));
+            auto host_call_function = host_call_functions_.find(function.addr_);
+
+            if (host_call_function == host_call_functions_.end()) {
+                translate_function(functions_[function.addr_], function);
+            } else {
+                translate_function(host_call_function->second, function);
+                generate_host_call_wrapper(functions_[function.addr_], host_call_function->second);
+            }
         }
 
+        // With lazy compilation, every function gets its own module and the engine fills the lookup table itself
+        if (!options_.lazy_compile_) {
+            // Generate entry point function, which also setup the lookup table. Only one partition has it
+            for (const Function &function: functions) {
+                if (function.is_entry_point_) {
+                    generate_entry_point_function(function.addr_);
+                    generate_hle_handler_trampoline(module.get());
+                    break;
+                }
+            }
+        }
+
+        return module;
+    }
+
+    std::vector<std::vector<Function>> Translator::partition_functions(const std::vector<Function> &functions) {
+        std::size_t total_length = 0;
+        std::map<std::uint32_t, const Function *> functions_by_addr;
+
         for (const Function &function: functions) {
-            translate_function(functions_[function.addr_], function);
+            total_length += function.length_;
+            functions_by_addr.emplace(function.addr_, &function);
+        }
+
+        const std::size_t partition_count = std::clamp<std::size_t>(total_length / PARTITION_CODE_SIZE, 1, MAX_PARTITION_COUNT);
+        if (partition_count == 1) {
+            return { functions };
         }
 
-        // Generate entry point function, which also setup the lookup table
+        // Depth first order along the call graph, starting from the entry point
+        std::vector<const Function *> ordered_functions;
+        std::set<std::uint32_t> visited;
+        std::vector<std::uint32_t> visit_stack;
+
+        auto visit = [&](std::uint32_t root) {
+            visit_stack.push_back(root);
+
+            while (!visit_stack.empty()) {
+                const std::uint32_t addr = visit_stack.back();
+                visit_stack.pop_back();
+
+                auto function = functions_by_addr.find(addr);
+                if (function == functions_by_addr.end() || !visited.insert(addr).second) {
+                    continue;
+                }
+
+                ordered_functions.push_back(function->second);
+                visit_stack.insert(visit_stack.end(), function->second->callees_.rbegin(), function->second->callees_.rend());
+            }
+        };
+
         for (const Function &function: functions) {
             if (function.is_entry_point_) {
-                generate_entry_point_function(function.addr_);
-                break;
+                visit(function.addr_);
             }
         }
 
-        generate_hle_handler_trampoline(module.get());
+        for (const Function &function: functions) {
+            visit(function.addr_);
+        }
 
-        return module;
+        // Cut the order into partitions of roughly the same code size
+        const std::size_t partition_length = (total_length + partition_count - 1) / partition_count;
+
+        std::vector<std::vector<Function>> partitions(1);
+        std::size_t current_length = 0;
+
+        for (const Function *function: ordered_functions) {
+            if (current_length >= partition_length && partitions.size() < partition_count) {
+                partitions.emplace_back();
+                current_length = 0;
+            }
+
+            partitions.back().push_back(*function);
+            current_length += function->length_;
+        }
+
+        return partitions;
+    }
+
+    std::set<std::uint32_t> Translator::exported_functions(const std::vector<std::vector<Function>> &partitions) {
+        std::map<std::uint32_t, std::size_t> partition_of_function;
+
+        for (std::size_t i = 0; i < partitions.size(); i++) {
+            for (const Function &function: partitions[i]) {
+                partition_of_function.emplace(function.addr_, i);
+            }
+        }
+
+        std::set<std::uint32_t> exported_functions;
+
+        auto add_if_external = [&](std::size_t caller_partition, std::uint32_t callee) {
+            auto callee_partition = partition_of_function.find(callee);
+
+            if ((callee_partition != partition_of_function.end()) && (callee_partition->second != caller_partition)) {
+                exported_functions.insert(callee);
+            }
+        };
+
+        for (std::size_t i = 0; i < partitions.size(); i++) {
+            for (const Function &function: partitions[i]) {
+                for (std::uint32_t callee: function.callees_) {
+                    add_if_external(i, callee);
+                }
+
+                // Guarded calls name their targets directly too
+                for (const GuardedCall &guarded_call: function.guarded_calls_) {
+                    for (std::uint32_t target: guarded_call.targets_) {
+                        add_if_external(i, target);
+                    }
+                }
+            }
+        }
+
+        return exported_functions;
     }
 
     llvm::Type *Translator::get_pointer_integer_type()
@@ -317,6 +782,12 @@ namespace Pip2 {
                 i8_type_->getPointerTo()                          // void* hle_handler_userdata
             },false);
 
+        std::vector<llvm::Type*> host_call_argument_types(function_type_->param_begin(), function_type_->param_end());
+        host_call_argument_types.insert(host_call_argument_types.end(), HOST_CALL_ARGUMENT_REGISTERS.size(), i32_type_);
+
+        host_call_return_type_ = llvm::StructType::get(context_, std::vector<llvm::Type*>(HOST_CALL_RETURN_REGISTERS.size(), i32_type_));
+        host_call_function_type_ = llvm::FunctionType::get(host_call_return_type_, host_call_argument_types, false);
+
         hle_handler_function_type_ = llvm::FunctionType::get(void_type_, {
                 i8_type_->getPointerTo(),
                 i32_type_
@@ -337,6 +808,86 @@ namespace Pip2 {
         wrapper_function_type_ = llvm::FunctionType::get(void_type_, {
             context_type_->getPointerTo()
         }, false);
+
+        call_site_cache_type_ = llvm::StructType::create(context_, {
+                i32_type_,                                          // std::uint32_t target
+                i32_type_,                                          // std::uint32_t padding
+                get_pointer_integer_type(),                         // VMFunctionPointer function
+                i64_type_,                                          // std::uint64_t hits
+                i64_type_                                           // std::uint64_t misses
+            }, "CallSiteCache");
+    }
+
+    void Translator::initialize_alias_metadata() {
+        // Registers, guest memory, the function lookup table and call site caches never overlap, so give each its own TBAA type.
+        // Calls without metadata (HLE handlers, special functions) still conservatively clobber all of them.
+        llvm::MDBuilder md_builder(context_);
+
+        auto root = md_builder.createTBAARoot("Pip2 TBAA");
+        auto register_type = md_builder.createTBAAScalarTypeNode("register", root);
+        auto memory_type = md_builder.createTBAAScalarTypeNode("guest memory", root);
+        auto function_lookup_type = md_builder.createTBAAScalarTypeNode("function lookup", root);
+        auto call_site_cache_type = md_builder.createTBAAScalarTypeNode("call site cache", root);
+
+        tbaa_register_ = md_builder.createTBAAStructTagNode(register_type, register_type, 0);
+        tbaa_memory_ = md_builder.createTBAAStructTagNode(memory_type, memory_type, 0);
+        tbaa_function_lookup_ = md_builder.createTBAAStructTagNode(function_lookup_type, function_lookup_type, 0);
+        tbaa_call_site_cache_ = md_builder.createTBAAStructTagNode(call_site_cache_type, call_site_cache_type, 0);
+    }
+
+    void Translator::add_function_argument_attributes(llvm::Function *function) {
+        // The context and guest memory are also reached by HLE handlers and the task scheduler through host pointers,
+        // so they can't be noalias. The translated code never leaks any of these pointers though.
+        auto context_arg = function->getArg(0);
+        context_arg->addAttr(llvm::Attribute::NoCapture);
+        context_arg->addAttr(llvm::Attribute::NonNull);
+        context_arg->addAttr(llvm::Attribute::NoUndef);
+        context_arg->addAttr(llvm::Attribute::getWithAlignment(context_, llvm::Align(alignof(VMContext))));
+        context_arg->addAttr(llvm::Attribute::getWithDereferenceableBytes(context_, sizeof(VMContext)));
+
+        auto memory_arg = function->getArg(1);
+        memory_arg->addAttr(llvm::Attribute::NoCapture);
+        memory_arg->addAttr(llvm::Attribute::NonNull);
+        memory_arg->addAttr(llvm::Attribute::NoUndef);
+
+        // Only the entry point fills the lookup table, translated functions just read from it
+        auto function_lookup_arg = function->getArg(2);
+        function_lookup_arg->addAttr(llvm::Attribute::NoCapture);
+        function_lookup_arg->addAttr(llvm::Attribute::NonNull);
+        function_lookup_arg->addAttr(llvm::Attribute::NoUndef);
+        function_lookup_arg->addAttr(llvm::Attribute::ReadOnly);
+
+        function->getArg(3)->addAttr(llvm::Attribute::NoUndef);
+    }
+
+    void Translator::add_function_attributes(llvm::Function *function, const Function &function_info) {
+        // Calls through the lookup table may land on the lazy resolver or on an instrumented baseline function, which
+        // do far more than the guest code they stand for
+        if (options_.lazy_compile_ || options_.tiered_compile_) {
+            return;
+        }
+
+        if (function_info.attributes_ & FUNCTION_ATTRIBUTE_NO_HOST_CALL) {
+            // Only guest code runs, which never unwinds, synchronizes or touches anything but the context, guest
+            // memory and the lookup table
+            function->setDoesNotThrow();
+            function->setNoSync();
+            function->setDoesNotFreeMemory();
+            function->setOnlyAccessesArgMemory();
+        }
+
+        if (function_info.attributes_ & FUNCTION_ATTRIBUTE_NO_MEMORY_WRITE) {
+            function->getArg(1)->addAttr(llvm::Attribute::ReadOnly);
+        }
+
+        if (function_info.attributes_ & FUNCTION_ATTRIBUTE_ALWAYS_RETURNS) {
+            function->setWillReturn();
+            function->setDoesNotRecurse();
+        }
+
+        if (function_info.attributes_ & FUNCTION_ATTRIBUTE_LEAF) {
+            function->addFnAttr(llvm::Attribute::NoCallback);
+        }
     }
 
     void Translator::call_special_function(SpecialPoolFunction function)
@@ -353,7 +904,7 @@ namespace Pip2 {
                     std_call_type_[special_function_info->second.arg_count_];
 
             auto external_function = module->getOrInsertFunction(special_function_info->second.name_, function_type);
-            auto function_wrapper = llvm::Function::Create(wrapper_function_type_, llvm::GlobalValue::ExternalLinkage,
+            auto function_wrapper = llvm::Function::Create(wrapper_function_type_, llvm::GlobalValue::InternalLinkage,
                                                            special_function_info->second.name_ + "_wrapper", module);
 
             auto function_wrapper_block = llvm::BasicBlock::Create(context_, "entry", function_wrapper);
@@ -371,6 +922,8 @@ namespace Pip2 {
                         context_arg,
                         { builder_.getInt32(0), builder_.getInt32((Register::P0 >> 2) + i) }));
 
+                arg_value->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_register_);
+
                 function_args.push_back(arg_value);
             }
 
@@ -378,10 +931,12 @@ namespace Pip2 {
 
             if (special_function_info->second.has_return_value_)
             {
-                builder_.CreateStore(ret_value, builder_.CreateGEP(
+                auto ret_store = builder_.CreateStore(ret_value, builder_.CreateGEP(
                         context_type_,
                         context_arg,
                         { builder_.getInt32(0), builder_.getInt32(Register::R0 >> 2) }));
+
+                ret_store->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_register_);
             }
 
             builder_.CreateRetVoid();
@@ -390,23 +945,32 @@ namespace Pip2 {
             special_functions_.emplace(function, function_wrapper);
         }
 
-        builder_.CreateCall(special_functions_[function], {
+        create_sync_call(special_functions_[function], {
             current_context_
         });
     }
 
-    Translator::Translator(llvm::LLVMContext &context, const VMConfig &config, const VMOptions &options)
-        : context_(context)
-        , config_(config)
+    Translator::Translator(llvm::LLVMContext &context, const VMConfig &config, const VMOptions &options,
+                           const DecodedProgram &program)
+        : config_(config)
         , options_(options)
+        , program_(program)
+        , context_(context)
         , builder_(context)
-        , current_context_(nullptr)
         , void_type_(nullptr)
         , i8_type_(nullptr)
         , i16_type_(nullptr)
         , i32_type_(nullptr)
+        , current_context_(nullptr)
+        , current_register_cache_(nullptr)
+        , current_host_call_(false)
+        , current_entry_sp_(nullptr)
         , current_addr_(0)
         , use_task_(false) {
+        const llvm::Triple host_triple(llvm::sys::getProcessTriple());
+        use_stack_maps_ = host_triple.isAArch64() || (host_triple.getArch() == llvm::Triple::x86_64);
+
         initialize_types();
+        initialize_alias_metadata();
     }
 }
@@ -3,13 +3,19 @@
 #include <llvm/IR/Module.h>
 #include <llvm/IR/IRBuilder.h>
 
+#include <bitset>
 #include <vector>
 #include <string>
 #include <map>
+#include <set>
+#include <optional>
 
 #include "VMConfig.h"
+#include "DecodedProgram.h"
 #include "Function.h"
+#include "RegisterLiveness.h"
 #include "Register.h"
+#include "StackFrame.h"
 #include "Instruction.h"
 #include "VMOptions.h"
 
@@ -29,10 +35,19 @@ namespace Pip2
             }
         };
 
+        struct SyncCall {
+            llvm::CallInst *call_;
+
+            // Registers written back to the context before the call, and reloaded from it once the call returns
+            RegisterLiveness::RegisterSet flushed_registers_;
+            RegisterLiveness::RegisterSet reloaded_registers_;
+        };
+
         typedef void (Translator::*InstructionTranslator)(Instruction);
 
         const VMConfig &config_;
         const VMOptions &options_;
+        const DecodedProgram &program_;
 
         llvm::LLVMContext &context_;
         llvm::IRBuilder<> builder_;
@@ -46,6 +61,11 @@ namespace Pip2
         llvm::FunctionType *function_type_;
         llvm::FunctionType *hle_handler_function_type_;
 
+        // Functions taking the registers in HOST_CALL_ARGUMENT_REGISTERS after the usual arguments, and returning the
+        // ones in HOST_CALL_RETURN_REGISTERS
+        llvm::StructType *host_call_return_type_;
+        llvm::FunctionType *host_call_function_type_;
+
         llvm::Value *current_context_;
         llvm::Value *current_memory_base_;
         llvm::Value *current_function_lookup_array_;
@@ -54,34 +74,97 @@ namespace Pip2
         llvm::FunctionCallee current_hle_handler_callee_;
         llvm::Function *current_function_;
 
+        // Local copy of the guest registers, used when register caching is enabled
+        llvm::Value *current_register_cache_;
+        std::bitset<Register::TotalCount> current_used_registers_;
+        std::bitset<Register::TotalCount> current_written_registers_;
+        // Calls and returns that sync the register cache and the stack slots
+        std::vector<SyncCall> current_sync_calls_;
+        std::vector<std::pair<llvm::ReturnInst *, RegisterLiveness::RegisterSet>> current_sync_returns_;
+        std::vector<llvm::CallInst *> current_sync_tail_calls_;
+        bool current_host_call_;
+
+        // Promoted stack slots of the translating function, by offset from the SP on entry
+        std::optional<StackFrame> current_stack_frame_;
+        std::map<std::int32_t, llvm::Value *> current_stack_slots_;
+        llvm::Value *current_entry_sp_;
+
         std::array<llvm::FunctionType*, 5> std_call_type_;
         std::array<llvm::FunctionType*, 5> std_call_type_with_return_;
 
+        llvm::MDNode *tbaa_register_;
+        llvm::MDNode *tbaa_memory_;
+        llvm::MDNode *tbaa_function_lookup_;
+        llvm::MDNode *tbaa_call_site_cache_;
+
+        llvm::StructType *call_site_cache_type_;
+
         std::map<SpecialPoolFunction, llvm::Function *> special_functions_;
         llvm::FunctionType *wrapper_function_type_;
 
         std::uint32_t current_addr_;
         const Function *current_function_analysis_;
 
+        // Liveness of the translating function, and its sets for the translating instruction
+        std::optional<RegisterLiveness> current_liveness_;
+        RegisterLiveness::RegisterSet current_live_registers_;
+        RegisterLiveness::RegisterSet current_dead_writes_;
+
         // Blocks of the current translating function
         std::map<std::uint32_t, llvm::BasicBlock *> blocks_;
         std::map<std::uint32_t, llvm::Function *> functions_;
+        // Variants of this module's functions using the host calling convention
+        std::map<std::uint32_t, llvm::Function *> host_call_functions_;
         std::map<std::uint32_t, JumpTableTranslateState> current_function_jump_table_translate_state_;
 
         bool use_task_;
 
+        // HLE calls are statepoints, so the engine gets the guest PC from their return address instead of the
+        // context. Only some targets can emit stack maps, the others still store PC before the call
+        bool use_stack_maps_;
+
     private:
         void initialize_types();
+        void initialize_alias_metadata();
+        void add_function_argument_attributes(llvm::Function *function);
+        void add_function_attributes(llvm::Function *function, const Function &function_info);
 
         void translate_function(llvm::Function *function, const Function &function_info);
+        void generate_call_counter(llvm::Function *function, std::uint32_t addr);
         void generate_entry_point_function(std::uint32_t entry_point_addr);
         void generate_hle_handler_trampoline(llvm::Module *module);
+        void generate_host_call_wrapper(llvm::Function *function, llvm::Function *host_call_function);
+        bool use_host_calling_convention() const;
+        bool has_tail_calls(const Function &function_info) const;
 
         llvm::Value *get_register_pointer(Register reg);
         llvm::Value *get_memory_pointer(llvm::Value *address);
+        llvm::Value *load_register(llvm::Type *type, Register src);
+
+        llvm::Value *create_memory_load(llvm::Type *type, llvm::Value *address, llvm::MaybeAlign alignment = {});
+        void create_memory_store(llvm::Value *value, llvm::Value *address, llvm::MaybeAlign alignment = {});
+        llvm::Value *load_function_pointer_from_lookup(llvm::Value *target);
+        llvm::FunctionCallee load_function_from_lookup(llvm::Value *target);
+        llvm::FunctionCallee load_function_from_call_site_cache(llvm::Value *target);
+
+        void mark_registers_accessed(Register first, std::uint32_t size, bool write);
+        llvm::CallInst *create_sync_call(llvm::FunctionCallee callee, llvm::ArrayRef<llvm::Value *> args,
+                                         const RegisterLiveness::RegisterSet &passed_registers = {},
+                                         const RegisterLiveness::RegisterSet &returned_registers = {});
+        llvm::CallInst *create_sync_statepoint_call(std::uint64_t id, llvm::FunctionCallee callee, llvm::ArrayRef<llvm::Value *> args);
+        llvm::ReturnInst *create_sync_return();
+        llvm::CallInst *create_sync_tail_call(llvm::FunctionCallee callee, llvm::ArrayRef<llvm::Value *> args);
+        void flush_register_cache(llvm::Instruction *before, const RegisterLiveness::RegisterSet &registers);
+        void reload_register_cache(llvm::Instruction *before, const RegisterLiveness::RegisterSet &live_registers);
+        void finalize_register_cache(llvm::BasicBlock *entry_block);
+
+        llvm::Value *get_stack_slot(std::uint32_t instruction_addr, std::int32_t offset);
+        void flush_stack_slots(llvm::Instruction *before);
+        void reload_stack_slots(llvm::Instruction *before);
+        void finalize_stack_slots(llvm::BasicBlock *entry_block);
 
         void set_register(Register dest, llvm::Value *value);
-        void update_pc_to_next_instruction();
+        void call_hle_handler(std::uint32_t code);
 
         template <typename T>
         llvm::Value *get_register(Register src);
@@ -90,6 +173,9 @@ namespace Pip2
         llvm::Type *get_pointer_integer_type();
 
         void call_special_function(SpecialPoolFunction function);
+        llvm::FunctionCallee get_guest_function_callee(std::uint32_t address);
+        std::optional<std::uint32_t> get_resolved_branch_target() const;
+        void call_guest_function(std::uint32_t address);
 
     private:
         void create_compare_two_registers_branch(Instruction instruction, llvm::CmpInst::Predicate predicate,
@@ -245,9 +331,53 @@ namespace Pip2
         };
 
     public:
-        explicit Translator(llvm::LLVMContext &context, const VMConfig &config, const VMOptions &options);
-
+        // Called by baseline code of tiered compilation once a function has been called often enough
+        static constexpr const char *TIER_UP_REQUEST_FUNCTION_NAME = "pip2_request_tier_up";
+        static constexpr std::uint32_t TIER_UP_CALL_THRESHOLD = 1000;
+
+        // Called on the first miss of a CALLr site's inline cache, so the engine can report its counters
+        static constexpr const char *CALL_SITE_CACHE_REGISTER_FUNCTION_NAME = "pip2_register_call_site_cache";
+
+        // GC strategy of functions making HLE calls. There are no GC pointers, it is only there to lower statepoints
+        static constexpr const char *STATEPOINT_GC_NAME = "statepoint-example";
+
+        // Registers passed to and returned from functions in host registers, with the host calling convention
+        static constexpr std::array<Register, 5> HOST_CALL_ARGUMENT_REGISTERS = { Register::SP, Register::P0, Register::P1, Register::P2, Register::P3 };
+        static constexpr std::array<Register, 3> HOST_CALL_RETURN_REGISTERS = { Register::R0, Register::R1, Register::SP };
+
+        // Amount of guest code per partition, and the maximum partitions a program is split into
+        static constexpr std::size_t PARTITION_CODE_SIZE = 0x4000;
+        static constexpr std::size_t MAX_PARTITION_COUNT = 16;
+
+        explicit Translator(llvm::LLVMContext &context, const VMConfig &config, const VMOptions &options,
+                            const DecodedProgram &program);
+
+        /**
+         * @brief Translate the given functions into a module.
+         *
+         * When the module fills the lookup table itself, functions that are neither the first one nor called from
+         * another module get internal linkage. The engine looks up the first function to compile the module.
+         *
+         * @param partitions All partitions of the program when functions is one of them. Functions of the others can
+         *                   be called directly, and are put into the lookup table by the entry point. Shared by the
+         *                   threads translating each partition.
+         * @param exported_functions Functions called from another partition than their own, see exported_functions().
+         */
         std::unique_ptr<llvm::Module> translate(const std::string &module_name, const std::vector<Function> &functions,
-                                                bool use_task = false);
+                                                bool use_task = false, const std::vector<std::vector<Function>> &partitions = {},
+                                                const std::set<std::uint32_t> &exported_functions = {});
+
+        /**
+         * @brief Split functions into partitions that can be translated, optimized and compiled in parallel.
+         *
+         * Functions are ordered along the call graph, so callers and callees mostly stay in the same partition.
+         * The first partition always contains the entry point.
+         */
+        static std::vector<std::vector<Function>> partition_functions(const std::vector<Function> &functions);
+
+        /**
+         * @brief Find the functions called from another partition than their own, which must stay visible to the linker.
+         */
+        static std::set<std::uint32_t> exported_functions(const std::vector<std::vector<Function>> &partitions);
     };
 }
\ No newline at end of file
@@ -150,56 +150,205 @@ namespace Pip2 {
         builder_.CreateBr(blocks_[address]);
     }
 
-    void Translator::update_pc_to_next_instruction()
+    llvm::Value *Translator::load_function_pointer_from_lookup(llvm::Value *target)
     {
-        set_register(Register::PC, builder_.getInt32(current_addr_ + INSTRUCTION_SIZE));
+        // The slot may still hold the lazy resolver or the not compiled stub, which find out the callee from PC.
+        // Nothing else reads PC, direct calls, jumps and returns leave it alone
+        set_register(Register::PC, target);
+
+        auto func_ptr_ptr = builder_.CreateGEP(get_pointer_integer_type(), current_function_lookup_array_, {
+                builder_.CreateLShr(target, builder_.getInt32(2))
+        });
+
+        auto func_ptr = builder_.CreateLoad(get_pointer_integer_type(), func_ptr_ptr);
+        func_ptr->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_function_lookup_);
+
+        return func_ptr;
     }
 
-    void Translator::CALLl(Instruction instruction) {
-        auto next_word = *reinterpret_cast<std::uint32_t*>(config_.memory_base() + current_addr_ + 4);
-        current_addr_ += 4;
+    llvm::FunctionCallee Translator::load_function_from_lookup(llvm::Value *target)
+    {
+        return llvm::FunctionCallee(function_type_, builder_.CreateIntToPtr(load_function_pointer_from_lookup(target), function_type_->getPointerTo()));
+    }
+
+    llvm::FunctionCallee Translator::load_function_from_call_site_cache(llvm::Value *target)
+    {
+        // Lazy and tiered compilation swap lookup table slots while running, a cached function could go stale
+        if (options_.lazy_compile_ || options_.tiered_compile_) {
+            return load_function_from_lookup(target);
+        }
+
+        auto module = current_function_->getParent();
+        auto cache = new llvm::GlobalVariable(*module, call_site_cache_type_, false, llvm::GlobalValue::InternalLinkage,
+                                              llvm::ConstantStruct::get(call_site_cache_type_, {
+                                                      builder_.getInt32(0xFFFFFFFF),
+                                                      builder_.getInt32(0),
+                                                      llvm::ConstantInt::get(get_pointer_integer_type(), 0),
+                                                      builder_.getInt64(0),
+                                                      builder_.getInt64(0)
+                                              }),
+                                              std::format("call_site_cache_{:08X}", current_addr_));
+
+        auto cache_field = [&](std::uint32_t index) {
+            return builder_.CreateStructGEP(call_site_cache_type_, cache, index);
+        };
+
+        auto load_cache_field = [&](llvm::Type *type, std::uint32_t index) {
+            auto value = builder_.CreateLoad(type, cache_field(index));
+            value->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_call_site_cache_);
+
+            return value;
+        };
+
+        auto store_cache_field = [&](llvm::Value *value, std::uint32_t index) {
+            auto store = builder_.CreateStore(value, cache_field(index));
+            store->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_call_site_cache_);
+        };
+
+        auto hit_block = llvm::BasicBlock::Create(context_, std::format("call_site_cache_hit_{:08X}", current_addr_), current_function_);
+        auto miss_block = llvm::BasicBlock::Create(context_, std::format("call_site_cache_miss_{:08X}", current_addr_), current_function_);
+        auto refill_block = llvm::BasicBlock::Create(context_, std::format("call_site_cache_refill_{:08X}", current_addr_), current_function_);
+        auto call_block = llvm::BasicBlock::Create(context_, std::format("call_site_cache_call_{:08X}", current_addr_), current_function_);
+
+        builder_.CreateCondBr(builder_.CreateICmpEQ(load_cache_field(i32_type_, 0), target), hit_block, miss_block);
+
+        // Without counters, a hit costs the compare and the load of the cached function
+        builder_.SetInsertPoint(hit_block);
+        if (options_.call_site_counters_) {
+            store_cache_field(builder_.CreateAdd(load_cache_field(i64_type_, 3), builder_.getInt64(1)), 3);
+        }
+        auto cached_func_ptr = load_cache_field(get_pointer_integer_type(), 2);
+        builder_.CreateBr(call_block);
+
+        builder_.SetInsertPoint(miss_block);
+        if (options_.call_site_counters_) {
+            // The first miss tells the engine about the cache, so its counters can be looked at
+            auto register_block = llvm::BasicBlock::Create(context_, std::format("call_site_cache_register_{:08X}", current_addr_),
+                                                           current_function_, refill_block);
+
+            auto misses = load_cache_field(i64_type_, 4);
+            store_cache_field(builder_.CreateAdd(misses, builder_.getInt64(1)), 4);
+            builder_.CreateCondBr(builder_.CreateICmpEQ(misses, builder_.getInt64(0)), register_block, refill_block);
+
+            builder_.SetInsertPoint(register_block);
+            auto register_function = module->getOrInsertFunction(CALL_SITE_CACHE_REGISTER_FUNCTION_NAME,
+                                                              llvm::FunctionType::get(void_type_, { i32_type_, cache->getType() }, false));
+            builder_.CreateCall(register_function, { builder_.getInt32(current_addr_), cache });
+        }
+        builder_.CreateBr(refill_block);
+
+        builder_.SetInsertPoint(refill_block);
+        auto looked_up_func_ptr = load_function_pointer_from_lookup(target);
+        store_cache_field(target, 0);
+        store_cache_field(looked_up_func_ptr, 2);
+        builder_.CreateBr(call_block);
+
+        builder_.SetInsertPoint(call_block);
+        auto func_ptr = builder_.CreatePHI(get_pointer_integer_type(), 2);
+        func_ptr->addIncoming(cached_func_ptr, hit_block);
+        func_ptr->addIncoming(looked_up_func_ptr, refill_block);
+
+        return llvm::FunctionCallee(function_type_, builder_.CreateIntToPtr(func_ptr, function_type_->getPointerTo()));
+    }
+
+    void Translator::call_hle_handler(std::uint32_t code)
+    {
+        const std::uint32_t next_pc = current_addr_ + INSTRUCTION_SIZE;
+        llvm::Value *args[] = { current_hle_handler_userdata_, builder_.getInt32(code) };
+
+        if (!use_stack_maps_) {
+            set_register(Register::PC, builder_.getInt32(next_pc));
+            create_sync_call(current_hle_handler_callee_, args);
+            return;
+        }
+
+        // The engine finds the PC from the return address of the call, which the stack map records under this ID
+        create_sync_statepoint_call(next_pc, current_hle_handler_callee_, args);
+    }
+
+    llvm::FunctionCallee Translator::get_guest_function_callee(std::uint32_t address) {
+        auto function = functions_.find(address);
+
+        // With lazy compilation the callee lives in another module, and the lookup table slot starts out pointing
+        // to the resolver, so always go through the table. Tiered compilation swaps hot functions in the table.
+        return (options_.lazy_compile_ || options_.tiered_compile_ || function == functions_.end()) ?
+                load_function_from_lookup(builder_.getInt32(address)) :
+                llvm::FunctionCallee(function->second);
+    }
+
+    std::optional<std::uint32_t> Translator::get_resolved_branch_target() const {
+        const auto &branches = current_function_analysis_->resolved_branches_;
+
+        auto branch = std::find_if(branches.begin(), branches.end(), [this](const ResolvedBranch &branch) {
+            return branch.instruction_addr_ == current_addr_;
+        });
+
+        return (branch == branches.end()) ? std::nullopt : std::optional<std::uint32_t>(branch->target_addr_);
+    }
 
-        if (std::optional<std::uint32_t> imm_offset = Common::get_immediate_pip_dword(next_word)) {
-            auto address = current_addr_ + static_cast<std::int32_t>(imm_offset.value()) - 4;
+    void Translator::call_guest_function(std::uint32_t address) {
+        set_register(Register::RA, builder_.getInt32(current_addr_ + INSTRUCTION_SIZE));
 
-            set_register(Register::RA, builder_.getInt32(current_addr_ + INSTRUCTION_SIZE));
-            set_register(Register::PC, builder_.getInt32(address));
+        auto host_call_function = host_call_functions_.find(address);
 
-            builder_.CreateCall(functions_[address], {
+        if (host_call_function != host_call_functions_.end()) {
+            std::vector<llvm::Value *> args = {
                 current_context_,
                 current_memory_base_,
                 current_function_lookup_array_,
                 current_hle_handler_pointer_,
                 current_hle_handler_userdata_
-            });
+            };
+
+            RegisterLiveness::RegisterSet passed_registers;
+            RegisterLiveness::RegisterSet returned_registers;
+
+            for (const auto reg: HOST_CALL_ARGUMENT_REGISTERS) {
+                args.push_back(get_register<std::uint32_t>(reg));
+                passed_registers.set(reg >> 2);
+            }
+
+            for (const auto reg: HOST_CALL_RETURN_REGISTERS) {
+                returned_registers.set(reg >> 2);
+            }
+
+            auto call = create_sync_call(host_call_function->second, args, passed_registers, returned_registers);
+            call->setCallingConv(llvm::CallingConv::Fast);
+
+            for (std::uint32_t i = 0; i < HOST_CALL_RETURN_REGISTERS.size(); i++) {
+                set_register(HOST_CALL_RETURN_REGISTERS[i], builder_.CreateExtractValue(call, { i }));
+            }
+
+            return;
+        }
+
+        create_sync_call(get_guest_function_callee(address), {
+            current_context_,
+            current_memory_base_,
+            current_function_lookup_array_,
+            current_hle_handler_pointer_,
+            current_hle_handler_userdata_
+        });
+    }
+
+    void Translator::CALLl(Instruction instruction) {
+        const DecodedInstruction &decoded = program_.at(current_addr_);
+        current_addr_ += 4;
+
+        if (auto target = decoded.direct_branch_target(current_addr_ - 4)) {
+            call_guest_function(target.value());
         } else {
-            if (config_.pool_items().is_pool_item_constant(next_word)) {
-                auto function_addr = config_.pool_items().get_pool_item_constant(next_word);
-
-                set_register(Register::RA, builder_.getInt32(current_addr_ + INSTRUCTION_SIZE));
-                set_register(Register::PC, builder_.getInt32(function_addr));
-
-                builder_.CreateCall(functions_[function_addr], {
-                        current_context_,
-                        current_memory_base_,
-                        current_function_lookup_array_,
-                        current_hle_handler_pointer_,
-                        current_hle_handler_userdata_
-                });
+            SpecialPoolFunction special_pool_function;
+
+            if (config_.pool_items().is_pool_item_special_function(decoded.operand_, special_pool_function)) {
+                call_special_function(special_pool_function);
             } else {
-                update_pc_to_next_instruction();
-                SpecialPoolFunction special_pool_function;
-
-                if (config_.pool_items().is_pool_item_special_function(next_word, special_pool_function)) {
-                    call_special_function(special_pool_function);
-                } else {
-                    builder_.CreateCall(current_hle_handler_callee_, { current_hle_handler_userdata_, builder_.getInt32(next_word) });
-                }
-
-                if (config_.pool_items().is_pool_item_terminate_function(next_word))
-                {
-                    builder_.CreateRetVoid();
-                }
+                call_hle_handler(decoded.operand_);
+            }
+
+            if (decoded.operand_kind_ == DECODED_OPERAND_TERMINATE_FUNCTION)
+            {
+                create_sync_return();
             }
         }
     }
@@ -208,8 +357,7 @@ namespace Pip2 {
     {
         if (instruction.two_sources_encoding.rd == Register::RA)
         {
-            set_register(Register::PC, get_register<std::uint32_t>(instruction.two_sources_encoding.rd));
-            builder_.CreateRetVoid();
+            create_sync_return();
             return;
         }
 
@@ -222,26 +370,19 @@ namespace Pip2 {
 
         if (jump_table == current_function_analysis_->jump_tables_.end())
         {
-            auto target = get_register<std::uint32_t>(instruction.two_sources_encoding.rd);
-
-            auto func_ptr_ptr = builder_.CreateGEP(get_pointer_integer_type(), current_function_lookup_array_, {
-                    builder_.CreateLShr(target, builder_.getInt32(2))
-            });
-
-            auto func_ptr = builder_.CreateLoad(get_pointer_integer_type(), func_ptr_ptr);
-            auto func_callee = llvm::FunctionCallee(function_type_, builder_.CreateIntToPtr(func_ptr, function_type_->getPointerTo()));
-
-            set_register(Register::PC, target);
+            auto resolved_target = get_resolved_branch_target();
+            auto target = resolved_target.has_value() ? builder_.getInt32(resolved_target.value()) :
+                    get_register<std::uint32_t>(instruction.two_sources_encoding.rd);
+            auto func_callee = resolved_target.has_value() ? get_guest_function_callee(resolved_target.value()) :
+                    load_function_from_lookup(target);
 
-            builder_.CreateCall(func_callee, {
+            create_sync_tail_call(func_callee, {
                     current_context_,
                     current_memory_base_,
                     current_function_lookup_array_,
                     current_hle_handler_pointer_,
                     current_hle_handler_userdata_
             });
-
-            builder_.CreateRetVoid();
         }
         else
         {
@@ -252,44 +393,85 @@ namespace Pip2 {
             }
 
             auto switch_value = jump_table_translate_state->second.case_value_;
+            auto target = get_register<std::uint32_t>(instruction.two_sources_encoding.rd);
 
-            // Grab a default to satisfy LLVM
-            auto default_case = blocks_[jump_table->labels_[0]];
+            // An index the bound doesn't cover goes wherever the loaded address points, through the lookup table.
+            // A call rather than a tail call, so the function keeps its host calling convention variant
+            auto default_case = llvm::BasicBlock::Create(context_, std::format("jump_table_default_{:08X}", current_addr_), current_function_);
             auto switch_cases = builder_.CreateSwitch(switch_value, default_case, jump_table->labels_.size());
             for (std::size_t i = 0; i < jump_table->labels_.size(); ++i)
             {
                 switch_cases->addCase(builder_.getInt32(i), blocks_[jump_table->labels_[i]]);
             }
+
+            builder_.SetInsertPoint(default_case);
+            create_sync_call(load_function_from_lookup(target), {
+                    current_context_,
+                    current_memory_base_,
+                    current_function_lookup_array_,
+                    current_hle_handler_pointer_,
+                    current_hle_handler_userdata_
+            });
+            create_sync_return();
         }
     }
 
     void Translator::CALLr(Instruction instruction)
     {
-        auto target = get_register<std::uint32_t>(instruction.two_sources_encoding.rd);
-        auto func_ptr_ptr = builder_.CreateGEP(get_pointer_integer_type(), current_function_lookup_array_, {
-                builder_.CreateLShr(target,builder_.getInt32(2))
-        });
+        // The register is known to always hold this function's address, call it like CALLl does
+        if (auto resolved_target = get_resolved_branch_target()) {
+            call_guest_function(resolved_target.value());
+            return;
+        }
 
-        auto func_ptr = builder_.CreateLoad(get_pointer_integer_type(), func_ptr_ptr);
-        auto func_callee = llvm::FunctionCallee(function_type_, builder_.CreateIntToPtr(func_ptr, function_type_->getPointerTo()));
+        auto target = get_register<std::uint32_t>(instruction.two_sources_encoding.rd);
 
         set_register(Register::RA, builder_.getInt32(current_addr_ + INSTRUCTION_SIZE));
-        set_register(Register::PC, target);
 
-        builder_.CreateCall(func_callee, {
+        llvm::Value *call_args[] = {
                 current_context_,
                 current_memory_base_,
                 current_function_lookup_array_,
                 current_hle_handler_pointer_,
                 current_hle_handler_userdata_
+        };
+
+        const auto &guarded_calls = current_function_analysis_->guarded_calls_;
+        auto guarded_call = std::find_if(guarded_calls.begin(), guarded_calls.end(), [this](const GuardedCall &call) {
+            return call.instruction_addr_ == current_addr_;
         });
+
+        if (guarded_call == guarded_calls.end()) {
+            create_sync_call(load_function_from_call_site_cache(target), call_args);
+            return;
+        }
+
+        // Compare against the table entries the target may have been loaded from, so those are called directly
+        // and can be inlined. Anything else still goes through the lookup table
+        auto done_block = llvm::BasicBlock::Create(context_, std::format("guarded_call_done_{:08X}", current_addr_), current_function_);
+
+        for (const auto guarded_target: guarded_call->targets_) {
+            auto direct_block = llvm::BasicBlock::Create(context_, std::format("guarded_call_{:08X}", guarded_target), current_function_, done_block);
+            auto next_block = llvm::BasicBlock::Create(context_, "", current_function_, done_block);
+
+            builder_.CreateCondBr(builder_.CreateICmpEQ(target, builder_.getInt32(guarded_target)), direct_block, next_block);
+
+            builder_.SetInsertPoint(direct_block);
+            call_guest_function(guarded_target);
+            builder_.CreateBr(done_block);
+
+            builder_.SetInsertPoint(next_block);
+        }
+
+        create_sync_call(load_function_from_call_site_cache(target), call_args);
+        builder_.CreateBr(done_block);
+
+        builder_.SetInsertPoint(done_block);
     }
 
     void Translator::RET(Instruction instruction)
     {
         RESTORE(instruction);
-
-        set_register(Register::PC, get_register<std::uint32_t>(Register::RA));
-        builder_.CreateRetVoid();
+        create_sync_return();
     }
 }
\ No newline at end of file
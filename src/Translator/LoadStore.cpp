@@ -8,6 +8,20 @@ namespace Pip2
         return builder_.CreateGEP(i8_type_, current_memory_base_, { address });
     }
 
+    llvm::Value *Translator::create_memory_load(llvm::Type *type, llvm::Value *address, llvm::MaybeAlign alignment)
+    {
+        auto value = builder_.CreateAlignedLoad(type, get_memory_pointer(address), alignment);
+        value->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_memory_);
+
+        return value;
+    }
+
+    void Translator::create_memory_store(llvm::Value *value, llvm::Value *address, llvm::MaybeAlign alignment)
+    {
+        auto store = builder_.CreateAlignedStore(value, get_memory_pointer(address), alignment);
+        store->setMetadata(llvm::LLVMContext::MD_tbaa, tbaa_memory_);
+    }
+
     void Translator::LDI(Instruction instruction)
     {
         auto value = llvm::ConstantInt::get(i32_type_, fetch_immediate());
@@ -22,81 +36,108 @@ namespace Pip2
 
     void Translator::LDWd(Instruction instruction)
     {
-        auto address = builder_.CreateAdd(get_register<std::uint32_t>(instruction.two_sources_encoding.rs), llvm::ConstantInt::get(i32_type_, fetch_immediate()));
-        auto value = builder_.CreateLoad(i32_type_, get_memory_pointer(address));
+        const std::uint32_t instruction_addr = current_addr_;
+        const std::uint32_t offset = fetch_immediate();
+
+        if (auto slot = get_stack_slot(instruction_addr, static_cast<std::int32_t>(offset)))
+        {
+            set_register(instruction.two_sources_encoding.rd, builder_.CreateLoad(i32_type_, slot));
+            return;
+        }
+
+        auto address = builder_.CreateAdd(get_register<std::uint32_t>(instruction.two_sources_encoding.rs), llvm::ConstantInt::get(i32_type_, offset));
+        auto value = create_memory_load(i32_type_, address);
         set_register(instruction.two_sources_encoding.rd, value);
     }
 
     void Translator::LDHUd(Instruction instruction)
     {
         auto address = builder_.CreateAdd(get_register<std::uint32_t>(instruction.two_sources_encoding.rs), llvm::ConstantInt::get(i32_type_, fetch_immediate()));
-        auto value = builder_.CreateLoad(i16_type_, get_memory_pointer(address));
+        auto value = create_memory_load(i16_type_, address);
         set_register(instruction.two_sources_encoding.rd, builder_.CreateZExt(value, i32_type_));
     }
 
     void Translator::LDBUd(Instruction instruction)
     {
         auto address = builder_.CreateAdd(get_register<std::uint32_t>(instruction.two_sources_encoding.rs), llvm::ConstantInt::get(i32_type_, fetch_immediate()));
-        auto value = builder_.CreateLoad(i8_type_, get_memory_pointer(address));
+        auto value = create_memory_load(i8_type_, address);
         set_register(instruction.two_sources_encoding.rd, builder_.CreateZExt(value, i32_type_));
     }
 
     void Translator::LDHd(Instruction instruction)
     {
         auto address = builder_.CreateAdd(get_register<std::uint32_t>(instruction.two_sources_encoding.rs), llvm::ConstantInt::get(i32_type_, fetch_immediate()));
-        auto value = builder_.CreateLoad(i16_type_, get_memory_pointer(address));
+        auto value = create_memory_load(i16_type_, address);
         set_register(instruction.two_sources_encoding.rd, builder_.CreateSExt(value, i32_type_));
     }
 
     void Translator::LDBd(Instruction instruction)
     {
         auto address = builder_.CreateAdd(get_register<std::uint32_t>(instruction.two_sources_encoding.rs), llvm::ConstantInt::get(i32_type_, fetch_immediate()));
-        auto value = builder_.CreateLoad(i8_type_, get_memory_pointer(address));
+        auto value = create_memory_load(i8_type_, address);
         set_register(instruction.two_sources_encoding.rd, builder_.CreateSExt(value, i32_type_));
     }
 
     void Translator::STWd(Instruction instruction)
     {
-        auto address = builder_.CreateAdd(get_register<std::uint32_t>(instruction.two_sources_encoding.rs), llvm::ConstantInt::get(i32_type_, fetch_immediate()));
-        builder_.CreateStore(get_register<std::uint32_t>(instruction.two_sources_encoding.rd), get_memory_pointer(address));
+        const std::uint32_t instruction_addr = current_addr_;
+        const std::uint32_t offset = fetch_immediate();
+
+        if (auto slot = get_stack_slot(instruction_addr, static_cast<std::int32_t>(offset)))
+        {
+            builder_.CreateStore(get_register<std::uint32_t>(instruction.two_sources_encoding.rd), slot);
+            return;
+        }
+
+        auto address = builder_.CreateAdd(get_register<std::uint32_t>(instruction.two_sources_encoding.rs), llvm::ConstantInt::get(i32_type_, offset));
+        create_memory_store(get_register<std::uint32_t>(instruction.two_sources_encoding.rd), address);
     }
 
     void Translator::STHd(Instruction instruction)
     {
         auto address = builder_.CreateAdd(get_register<std::uint32_t>(instruction.two_sources_encoding.rs), llvm::ConstantInt::get(i32_type_, fetch_immediate()));
-        builder_.CreateStore(get_register<std::uint16_t>(instruction.two_sources_encoding.rd), get_memory_pointer(address));
+        create_memory_store(get_register<std::uint16_t>(instruction.two_sources_encoding.rd), address);
     }
 
     void Translator::STBd(Instruction instruction)
     {
         auto address = builder_.CreateAdd(get_register<std::uint32_t>(instruction.two_sources_encoding.rs), llvm::ConstantInt::get(i32_type_, fetch_immediate()));
-        builder_.CreateStore(get_register<std::uint8_t>(instruction.two_sources_encoding.rd), get_memory_pointer(address));
+        create_memory_store(get_register<std::uint8_t>(instruction.two_sources_encoding.rd), address);
     }
 
     void Translator::STORE(Instruction instruction)
     {
         auto stack_value = get_register<std::uint32_t>(Register::SP);
+        const auto count = static_cast<std::int32_t>(instruction.range_reg_encoding.count);
 
         if (instruction.range_reg_encoding.rs == Register::ZR)
         {
-            auto stack = get_memory_pointer(builder_.CreateSub(stack_value, builder_.getInt32(4)));
-
-            set_register(Register::RA, builder_.CreateLoad(i32_type_, stack));
+            auto slot = get_stack_slot(current_addr_, -4);
+            set_register(Register::RA, slot ? builder_.CreateLoad(i32_type_, slot) :
+                    create_memory_load(i32_type_, builder_.CreateSub(stack_value, builder_.getInt32(4))));
             set_register(Register::SP, builder_.CreateSub(stack_value, builder_.getInt32(4)));
         }
+        else if (get_stack_slot(current_addr_, -count))
+        {
+            for (std::int32_t offset = 0; offset < count; offset += 4)
+            {
+                auto value = get_register<std::uint32_t>(static_cast<Register>(instruction.range_reg_encoding.rs + offset));
+                builder_.CreateStore(value, get_stack_slot(current_addr_, offset - count));
+            }
+
+            set_register(Register::SP, builder_.CreateSub(stack_value, builder_.getInt32(count)));
+        }
         else
         {
-            auto stack_store_base = builder_.CreateSub(stack_value, builder_.getInt32(instruction.range_reg_encoding.count));
-            auto stack = get_memory_pointer(stack_store_base);
-            auto reg_addr = get_register_pointer(instruction.range_reg_encoding.rs);
-
-            builder_.CreateMemCpy(
-                    stack,
-                    llvm::MaybeAlign(1),
-                    reg_addr,
-                    llvm::MaybeAlign(4),
-                    builder_.getInt32(instruction.range_reg_encoding.count)
-            );
+            // One word per register, so they can stay in host registers rather than going through the register file.
+            // Nothing proves the SP is word aligned, so the accesses keep the alignment of the memcpy they replace
+            auto stack_store_base = builder_.CreateSub(stack_value, builder_.getInt32(count));
+
+            for (std::int32_t offset = 0; offset < count; offset += 4)
+            {
+                auto value = get_register<std::uint32_t>(static_cast<Register>(instruction.range_reg_encoding.rs + offset));
+                create_memory_store(value, builder_.CreateAdd(stack_store_base, builder_.getInt32(offset)), llvm::MaybeAlign(1));
+            }
 
             set_register(Register::SP, stack_store_base);
         }
@@ -105,27 +146,36 @@ namespace Pip2
     void Translator::RESTORE(Instruction instruction)
     {
         auto stack_value = get_register<std::uint32_t>(Register::SP);
-        auto stack = get_memory_pointer(stack_value);
+        const auto count = static_cast<std::int32_t>(instruction.range_reg_encoding.count);
 
         if (instruction.range_reg_encoding.rs == Register::ZR)
         {
-            set_register(Register::RA, builder_.CreateLoad(i32_type_, stack));
+            auto slot = get_stack_slot(current_addr_, 0);
+            set_register(Register::RA, slot ? builder_.CreateLoad(i32_type_, slot) : create_memory_load(i32_type_, stack_value));
             set_register(Register::SP, builder_.CreateAdd(stack_value, builder_.getInt32(4)));
         }
+        else if (get_stack_slot(current_addr_, 0))
+        {
+            auto first_reg = static_cast<Register>(instruction.range_reg_encoding.rs - instruction.range_reg_encoding.count + 4);
+
+            for (std::int32_t offset = 0; offset < count; offset += 4)
+            {
+                set_register(static_cast<Register>(first_reg + offset), builder_.CreateLoad(i32_type_, get_stack_slot(current_addr_, offset)));
+            }
+
+            set_register(Register::SP, builder_.CreateAdd(stack_value, builder_.getInt32(count)));
+        }
         else
         {
-            auto reg_addr = get_register_pointer(static_cast<Register>(instruction.range_reg_encoding.rs -
-                    instruction.range_reg_encoding.count + 4));
-
-            builder_.CreateMemCpy(
-                    reg_addr,
-                    llvm::MaybeAlign(4),
-                    stack,
-                    llvm::MaybeAlign(1),
-                    builder_.getInt32(instruction.range_reg_encoding.count)
-            );
-
-            set_register(Register::SP, builder_.CreateAdd(stack_value, builder_.getInt32(instruction.range_reg_encoding.count)));
+            auto first_reg = static_cast<Register>(instruction.range_reg_encoding.rs - instruction.range_reg_encoding.count + 4);
+
+            for (std::int32_t offset = 0; offset < count; offset += 4)
+            {
+                auto value = create_memory_load(i32_type_, builder_.CreateAdd(stack_value, builder_.getInt32(offset)), llvm::MaybeAlign(1));
+                set_register(static_cast<Register>(first_reg + offset), value);
+            }
+
+            set_register(Register::SP, builder_.CreateAdd(stack_value, builder_.getInt32(count)));
         }
     }
 }
\ No newline at end of file
@@ -10,7 +10,7 @@ namespace Pip2 {
         auto src_ptr = get_memory_pointer(src);
         auto dst_ptr = get_memory_pointer(dst);
 
-        builder_.CreateMemCpy(dst_ptr, llvm::MaybeAlign(1), src_ptr, llvm::MaybeAlign(1), size);
+        builder_.CreateMemCpy(dst_ptr, llvm::MaybeAlign(1), src_ptr, llvm::MaybeAlign(1), size, false, tbaa_memory_);
     }
 
     void Translator::SYSSET(Instruction instruction)
@@ -21,6 +21,6 @@ namespace Pip2 {
 
         auto dst_ptr = get_memory_pointer(dst);
 
-        builder_.CreateMemSet(dst_ptr, value, size, llvm::MaybeAlign(1));
+        builder_.CreateMemSet(dst_ptr, value, size, llvm::MaybeAlign(1), false, tbaa_memory_);
     }
 }
\ No newline at end of file
@@ -6,55 +6,356 @@
 #include "SpecialFunction.h"
 
 #include <llvm/Support/TargetSelect.h>
-#include <llvm/Object/ObjectFile.h>
-#include <llvm/ExecutionEngine/MCJIT.h>
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
 #include <llvm/Analysis/LoopAnalysisManager.h>
+#include <llvm/IR/BuiltinGCs.h>
 #include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/raw_ostream.h>
 
+#include <algorithm>
+#include <atomic>
+#include <exception>
 #include <utility>
 #include <fstream>
 
 namespace Pip2 {
-    bool VMEngine::s_mcjit_initialized_ = false;
+    bool VMEngine::s_llvm_initialized_ = false;
     thread_local VMEngine *engine_instance = nullptr;
 
+    static void unimplemented_function(VMContext &context, std::uint32_t *memory_base, void **runtime_function_lookup,
+                                       HleHandler hle_handler, void *userdata) {
+        hle_handler(userdata, Common::exception_to_hle_code(Common::ExceptionCode::NotCompiledFunction));
+    }
+
+    static void lazy_function_resolver(VMContext &context, std::uint32_t *memory_base, void **runtime_function_lookup,
+                                       HleHandler hle_handler, void *userdata) {
+        // Every call site stores the callee address to PC before going through the lookup table
+        auto func = reinterpret_cast<RuntimeFunction>(engine_instance->resolve_lazy_function(context.regs_[Register::PC >> 2]));
+        func(context, memory_base, runtime_function_lookup, hle_handler, userdata);
+    }
+
+    [[gnu::noinline]] static void hle_handler_trampoline(void *userdata, int code) {
+        // Translated code calls the handler directly, so this returns to the HLE call
+        engine_instance->call_hle_handler(__builtin_return_address(0), userdata, code);
+    }
+
+    static void tier_up_request_handler(std::uint32_t addr) {
+        engine_instance->request_tier_up(addr);
+    }
+
+    static void call_site_cache_register_handler(std::uint32_t addr, CallSiteCache *cache) {
+        engine_instance->register_call_site_cache(addr, cache);
+    }
+
     VMEngine::VMEngine(std::string module_name, const VMConfigParameters &config, VMOptions &&options)
-        : module_name_(std::move(module_name))
+        : thread_safe_context_(std::make_unique<llvm::LLVMContext>())
+        , module_name_(std::move(module_name))
         , config_(config.memory_base_, static_cast<std::size_t>(config.memory_size_), config.pool_items_base_, static_cast<std::size_t>(config.pool_item_count_))
         , options_(options)
         , found_runtime_function_(nullptr) {
-        initialize_mcjit();
+        initialize_llvm();
+
+        if (options_.lazy_compile_) {
+            options_.tiered_compile_ = false;
+        }
+
+        if (options_.text_base_ > config_.memory_size()) {
+            throw std::runtime_error(std::format("Text base 0x{:08X} is outside of memory of size 0x{:X}", options_.text_base_,
+                                                 config_.memory_size()));
+        }
+
+        if (options_.text_size_ == 0) {
+            options_.text_size_ = static_cast<std::uint32_t>(config_.memory_size() - options_.text_base_);
+        } else if (static_cast<std::uint64_t>(options_.text_base_) + options_.text_size_ > config_.memory_size()) {
+            // The cache key hashes the whole text segment, and the analysis reads anywhere in it
+            throw std::runtime_error(std::format("Text segment 0x{:08X}+0x{:X} runs past memory of size 0x{:X}", options_.text_base_,
+                                                 options_.text_size_, config_.memory_size()));
+        }
 
         if (options_.cache_)
         {
-            object_cache_ = std::make_unique<ObjectCache>(options_.cache_root_path_ ? options_.cache_root_path_ : "");
+            object_cache_ = std::make_unique<ObjectCache>(options_.cache_root_path_ ? options_.cache_root_path_ : "",
+                                                         options_.cache_compression_level_);
+
+            // Modules are named after their content, so a changed program never reuses stale code, and the same
+            // program shipped under different names shares its cache
+            analysis_key_ = ObjectCache::get_analysis_key(config_, options_);
+            module_key_ = ObjectCache::get_module_key(analysis_key_, options_);
+        }
+        else
+        {
+            module_key_ = module_name_;
         }
 
         task_handler_ = std::make_unique<TaskHandler>(this, std::bind(&VMEngine::run_task, this, std::placeholders::_1, std::placeholders::_2),
                                                       config.stack_create_func_, config.stack_free_func_);
 
-        initialize_execution_engine();
+        initialize_jit();
         load_and_compile_module();
+
+        if (options_.tiered_compile_) {
+            initialize_optimizer();
+        }
     }
 
     VMEngine::~VMEngine() {
-        execution_engine_.reset();
+        stop_optimizer();
+
+        optimizer_jit_.reset();
+        jit_.reset();
         object_cache_.reset();
     }
 
-    void VMEngine::initialize_execution_engine() {
-        auto null_module = std::make_unique<llvm::Module>("_null_module_", llvm_context_);
+    std::unique_ptr<llvm::orc::LLJIT> VMEngine::create_jit(llvm::CodeGenOpt::Level opt_level) {
+        auto target_machine_builder = llvm::orc::JITTargetMachineBuilder::detectHost();
+        if (!target_machine_builder) {
+            throw std::runtime_error(std::format("Failed to detect host target: {}", llvm::toString(target_machine_builder.takeError())));
+        }
+
+        target_machine_builder->setCodeGenOptLevel(opt_level);
+        target_machine_builder->setRelocationModel(llvm::Reloc::Model::PIC_);
+        target_machine_builder->getOptions().EnableFastISel = (opt_level == llvm::CodeGenOpt::None);
+
+        // Modules are compiled on a thread pool, each compiler checks the object cache first
+        auto jit = llvm::orc::LLJITBuilder()
+            .setJITTargetMachineBuilder(std::move(*target_machine_builder))
+            .setNumCompileThreads(std::max(1u, std::thread::hardware_concurrency()))
+            .setCompileFunctionCreator([this](llvm::orc::JITTargetMachineBuilder builder)
+                    -> llvm::Expected<std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+                return std::make_unique<llvm::orc::ConcurrentIRCompiler>(std::move(builder), object_cache_.get());
+            })
+            .create();
+
+        if (!jit) {
+            throw std::runtime_error(std::format("Failed to create JIT: {}", llvm::toString(jit.takeError())));
+        }
+
+        return_address_table_.attach(**jit);
+
+        auto &main_dylib = (*jit)->getMainJITDylib();
+
+        // Intrinsics such as memcpy and memset are lowered to calls into the host C runtime
+        auto process_symbols = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess((*jit)->getDataLayout().getGlobalPrefix());
+        if (!process_symbols) {
+            throw std::runtime_error(std::format("Failed to expose host symbols: {}", llvm::toString(process_symbols.takeError())));
+        }
+
+        main_dylib.addGenerator(std::move(*process_symbols));
+
+        llvm::orc::SymbolMap host_functions;
+        auto add_host_function = [&](const std::string &name, void *func_ptr) {
+#if LLVM_VERSION_MAJOR >= 17
+            host_functions[(*jit)->mangleAndIntern(name)] = llvm::orc::ExecutorSymbolDef(llvm::orc::ExecutorAddr::fromPtr(func_ptr),
+                                                                                         llvm::JITSymbolFlags::Exported);
+#else
+            host_functions[(*jit)->mangleAndIntern(name)] = llvm::JITEvaluatedSymbol::fromPointer(func_ptr);
+#endif
+        };
+
+        for (const auto &[op, func_info] : SPECIAL_POOL_FUNCTION_INFOS) {
+            add_host_function(func_info.name_, func_info.func_ptr_);
+        }
+
+        add_host_function(Translator::TIER_UP_REQUEST_FUNCTION_NAME, reinterpret_cast<void*>(&tier_up_request_handler));
+        add_host_function(Translator::CALL_SITE_CACHE_REGISTER_FUNCTION_NAME, reinterpret_cast<void*>(&call_site_cache_register_handler));
+
+        if (auto error = main_dylib.define(llvm::orc::absoluteSymbols(std::move(host_functions)))) {
+            throw std::runtime_error(std::format("Failed to define host functions: {}", llvm::toString(std::move(error))));
+        }
+
+        return std::move(*jit);
+    }
+
+    bool VMEngine::add_cached_object(llvm::orc::LLJIT &jit, const std::string &module_name, bool *does_module_use_task) {
+        if (!object_cache_) {
+            return false;
+        }
 
-        execution_engine_.reset(llvm::EngineBuilder(std::move(null_module))
-            .setEngineKind(llvm::EngineKind::JIT)
-            .setOptLevel(llvm::CodeGenOpt::Aggressive)
-            .setRelocationModel(llvm::Reloc::Model::PIC_)
-            .create());
+        auto cache_buffer = object_cache_->load(module_name, does_module_use_task);
+        if (!cache_buffer) {
+            return false;
+        }
+
+        if (auto error = jit.addObjectFile(std::move(cache_buffer))) {
+            llvm::consumeError(std::move(error));
+            return false;
+        }
+
+        return true;
+    }
+
+    void VMEngine::add_translated_module(llvm::orc::LLJIT &jit, llvm::orc::ThreadSafeContext &context, const VMOptions &options,
+                                         const std::string &module_name, const std::vector<Function> &functions, bool optimize,
+                                         const std::vector<std::vector<Function>> &partitions,
+                                         const std::set<std::uint32_t> &exported_functions) {
+        std::unique_ptr<llvm::Module> module;
 
-        if (options_.cache_)
         {
-            execution_engine_->setObjectCache(object_cache_.get());
+            // Compile threads may be using the context at the same time
+            auto context_lock = context.getLock();
+
+            Translator translator(*context.getContext(), config_, options, *decoded_program_);
+            module = translator.translate(module_name, functions, module_use_task_, partitions, exported_functions);
+            module->setDataLayout(jit.getDataLayout());
+
+            if (optimize) {
+                default_optimize(*module);
+            }
+        }
+
+        if (auto error = jit.addIRModule(llvm::orc::ThreadSafeModule(std::move(module), context))) {
+            throw std::runtime_error(std::format("Failed to add module {}: {}", module_name, llvm::toString(std::move(error))));
+        }
+    }
+
+    static std::string partition_module_name(const std::string &module_name, std::size_t index) {
+        // The first partition holds the entry point and keeps the module name, so a cache hit can skip the analysis
+        return index == 0 ? module_name : std::format("{}.partitions/{}", module_name, index);
+    }
+
+    bool VMEngine::add_cached_partitions(const std::string &module_name, bool *does_module_use_task) {
+        if (!object_cache_) {
+            return false;
+        }
+
+        const std::size_t partition_count = object_cache_->load_partition_count(module_name);
+        if (partition_count == 0) {
+            return false;
+        }
+
+        // Open every partition before adding any, the JIT can't take back an object once added
+        std::vector<std::unique_ptr<llvm::MemoryBuffer>> partition_buffers;
+
+        for (std::size_t i = 0; i < partition_count; i++) {
+            auto buffer = object_cache_->load(partition_module_name(module_name, i), (i == 0) ? does_module_use_task : nullptr);
+            if (!buffer) {
+                return false;
+            }
+
+            partition_buffers.push_back(std::move(buffer));
+        }
+
+        for (auto &buffer: partition_buffers) {
+            if (auto error = jit_->addObjectFile(std::move(buffer))) {
+                throw std::runtime_error(std::format("Failed to add cached module {}: {}", module_name, llvm::toString(std::move(error))));
+            }
+        }
+
+        return true;
+    }
+
+    void VMEngine::add_translated_partitions(const std::string &module_name, const std::vector<Function> &functions, bool optimize) {
+        const auto partitions = Translator::partition_functions(functions);
+        const auto exported_functions = Translator::exported_functions(partitions);
+
+        std::vector<std::thread> partition_threads;
+        std::vector<std::exception_ptr> partition_errors(partitions.size());
+
+        // Each partition is translated and optimized in its own context. Code generation is done later by the JIT
+        // compile threads, cross-partition calls are resolved when the partitions are linked
+        for (std::size_t i = 0; i < partitions.size(); i++) {
+            partition_threads.emplace_back([&, i]() {
+                try {
+                    llvm::orc::ThreadSafeContext partition_context(std::make_unique<llvm::LLVMContext>());
+                    add_translated_module(*jit_, partition_context, options_, partition_module_name(module_name, i),
+                                          partitions[i], optimize, partitions, exported_functions);
+                } catch (...) {
+                    partition_errors[i] = std::current_exception();
+                }
+            });
+        }
+
+        for (auto &thread: partition_threads) {
+            thread.join();
         }
+
+        for (auto &error: partition_errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+        if (object_cache_) {
+            // Generate code for every partition now, so the whole program is cached before the module lock is released
+            auto &session = jit_->getExecutionSession();
+            llvm::orc::SymbolLookupSet partition_symbols;
+
+            for (const auto &partition: partitions) {
+                partition_symbols.add(jit_->mangleAndIntern(std::format("sub_{:08X}", partition.front().addr_)));
+            }
+
+            auto symbols = session.lookup(llvm::orc::makeJITDylibSearchOrder(&jit_->getMainJITDylib()), std::move(partition_symbols));
+            if (!symbols) {
+                throw std::runtime_error(std::format("Failed to compile module {}: {}", module_name, llvm::toString(symbols.takeError())));
+            }
+
+            // Published last, readers only trust the partitions once this is there
+            object_cache_->store_partition_count(module_name, partitions.size());
+        }
+    }
+
+    void *VMEngine::lookup_function(llvm::orc::LLJIT &jit, const std::string &name) {
+        // Looking up a symbol compiles the module defining it, if it has not been compiled yet
+        auto symbol = jit.lookup(name);
+        if (!symbol) {
+            throw std::runtime_error(std::format("Failed to compile function {}: {}", name, llvm::toString(symbol.takeError())));
+        }
+
+        return symbol->toPtr<void*>();
+    }
+
+    void VMEngine::initialize_jit() {
+        // With tiered compilation, the whole program is compiled quickly first, hot functions are optimized later
+        jit_ = create_jit(options_.tiered_compile_ ? llvm::CodeGenOpt::None : llvm::CodeGenOpt::Aggressive);
+    }
+
+    void VMEngine::initialize_optimizer() {
+        optimizer_thread_safe_context_ = llvm::orc::ThreadSafeContext(std::make_unique<llvm::LLVMContext>());
+        optimizer_jit_ = create_jit(llvm::CodeGenOpt::Aggressive);
+        optimizer_thread_ = std::thread(&VMEngine::run_optimizer, this);
+    }
+
+    void VMEngine::run_optimizer() {
+        while (true) {
+            std::uint32_t addr;
+
+            {
+                std::unique_lock<std::mutex> lock(optimizer_mutex_);
+                optimizer_condition_.wait(lock, [this]() {
+                    return optimizer_stop_ || !optimizer_queue_.empty();
+                });
+
+                if (optimizer_stop_) {
+                    return;
+                }
+
+                addr = optimizer_queue_.front();
+                optimizer_queue_.pop_front();
+            }
+
+            try {
+                compile_optimized_function(addr);
+            } catch (std::exception &ex) {
+                // The baseline version stays in the lookup table, the function only misses out on the speedup
+                llvm::errs() << std::format("Failed to optimize function {:08X}, keeping its baseline code: {}\n", addr, ex.what());
+            }
+        }
+    }
+
+    void VMEngine::stop_optimizer() {
+        if (!optimizer_thread_.joinable()) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(optimizer_mutex_);
+            optimizer_stop_ = true;
+        }
+
+        optimizer_condition_.notify_one();
+        optimizer_thread_.join();
     }
 
     void VMEngine::default_optimize(llvm::Module &module) {
@@ -88,59 +389,91 @@ namespace Pip2 {
     }
 
     void VMEngine::load_and_compile_module() {
-        for (const auto &[op, func_info] : SPECIAL_POOL_FUNCTION_INFOS) {
-            execution_engine_->addGlobalMapping(func_info.name_, reinterpret_cast<std::uint64_t>(func_info.func_ptr_));
-        }
+        // Baseline code of tiered compilation is instrumented, keep it apart from fully optimized modules
+        const std::string module_name = options_.tiered_compile_ ? std::format("{}.tiered/baseline", module_key_) : module_key_;
+        ObjectCacheLock cache_lock;
+
+        // Lazy compilation has no whole program module, each function is cached on its own when first compiled. It
+        // still goes through the analysis cache below, so a warm start skips the analysis
+        if (!options_.lazy_compile_) {
+            // Tiered compilation still needs the analysis to recompile hot functions, so it always runs it. Reading
+            // without the lock is safe, only a module whose manifest has been published is taken
+            if (!options_.tiered_compile_ && add_cached_partitions(module_name, &module_use_task_)) {
+                return;
+            }
 
-        if (options_.cache_) {
-            if (object_cache_->does_cache_exist(module_name_))
-            {
-                auto cache_buffer = object_cache_->load(module_name_, &module_use_task_);
-
-                if (cache_buffer)
-                {
-                    if (auto object_file = llvm::object::ObjectFile::createObjectFile(*cache_buffer))
-                    {
-                        execution_engine_->addObjectFile(llvm::object::OwningBinary<llvm::object::ObjectFile>(
-                                std::move(*object_file),
-                                std::move(cache_buffer)));
-
-                        return;
-                    }
+            if (object_cache_) {
+                // Another process may be compiling the same program, wait for it and use what it published
+                cache_lock = object_cache_->lock_module(module_name);
+
+                if (!options_.tiered_compile_ && add_cached_partitions(module_name, &module_use_task_)) {
+                    return;
                 }
             }
         }
 
-        // Need to recompile, first analyze
-        ProgramAnalysis analysis(reinterpret_cast<std::uint32_t*>(config_.memory_base()),
-                                 options_.text_base_, config_.memory_size(), config_.pool_items());
+        // Need to recompile, first decode and analyze. The decoded program is shared with translation, it's only
+        // decoded where read, so it costs little when the analysis is loaded
+        decoded_program_ = std::make_unique<DecodedProgram>(reinterpret_cast<std::uint32_t*>(config_.memory_base()),
+                                                            config_.memory_size(), config_.pool_items());
+
+        std::vector<Function> found_functions;
+
+        // The analysis only depends on the program, reuse it when only the generated code is out of date
+        if (!object_cache_ || !object_cache_->load_analysis(analysis_key_, found_functions, module_use_task_)) {
+            ProgramAnalysis analysis(reinterpret_cast<std::uint32_t*>(config_.memory_base()),
+                                     options_.text_base_, options_.text_size_, config_.pool_items(), *decoded_program_);
+
+            found_functions = analysis.analyze(options_.entry_point_, module_use_task_);
+
+            if (object_cache_) {
+                object_cache_->store_analysis(analysis_key_, found_functions, module_use_task_);
+            }
+        }
 
-        std::vector<Function> found_functions = analysis.analyze(options_.entry_point_, module_use_task_);
+        if (options_.lazy_compile_) {
+            // Translation is deferred to the first call of each function
+            for (auto &function: found_functions) {
+                const auto addr = function.addr_;
+                lazy_functions_.emplace(addr, std::move(function));
+            }
 
-        // Then translate
-        Translator translator(llvm_context_, config_, options_);
-        auto module = translator.translate(module_name_, found_functions, module_use_task_);
+            return;
+        }
 
-        // Optimize
-        default_optimize(*module);
+        if (options_.tiered_compile_) {
+            for (const auto &function: found_functions) {
+                tiered_functions_.emplace(function.addr_, function);
+            }
+
+            if (add_cached_partitions(module_name)) {
+                return;
+            }
+        }
 
         if (object_cache_) {
-            object_cache_->mark_module_use_task(module_name_, module_use_task_);
+            object_cache_->mark_module_use_task(module_name, module_use_task_);
         }
 
-        // Add to execution engine
-        execution_engine_->addModule(std::move(module));
-        execution_engine_->finalizeObject();
+        // Then translate and optimize. Code generation happens on the compile threads when the entry point is looked up
+        add_translated_partitions(module_name, found_functions, !options_.tiered_compile_);
+
+        if (!options_.tiered_compile_) {
+            // Everything is translated, nothing reads the decoded program anymore
+            decoded_program_.reset();
+        }
     }
 
-    void VMEngine::initialize_mcjit() {
-        if (!s_mcjit_initialized_) {
+    void VMEngine::initialize_llvm() {
+        if (!s_llvm_initialized_) {
             llvm::InitializeNativeTarget();
             llvm::InitializeNativeTargetAsmParser();
             llvm::InitializeNativeTargetAsmPrinter();
-            LLVMLinkInMCJIT();
 
-            s_mcjit_initialized_ = true;
+            // Functions making HLE calls use a builtin GC strategy for their statepoints
+            llvm::linkAllBuiltinGCs();
+
+            s_llvm_initialized_ = true;
         }
     }
 
@@ -148,18 +481,123 @@ namespace Pip2 {
         if (!found_runtime_function_) {
             static constexpr std::size_t TOTAL_LOOKUP_STORAGE = 0x100000;
 
-            found_runtime_function_ = reinterpret_cast<RuntimeFunction>(execution_engine_->getFunctionAddress("entry_point"));
             runtime_function_lookup_.resize(TOTAL_LOOKUP_STORAGE);
 
-            auto unimplemented_func_handler = execution_engine_->getFunctionAddress("sub_unimplemented");
+            if (options_.lazy_compile_) {
+                std::fill(runtime_function_lookup_.begin(), runtime_function_lookup_.end(), reinterpret_cast<void*>(&unimplemented_function));
 
-            std::fill(runtime_function_lookup_.begin(), runtime_function_lookup_.end(), reinterpret_cast<void*>(&unimplemented_func_handler));
+                for (const auto &[addr, function]: lazy_functions_) {
+                    runtime_function_lookup_[addr >> 2] = reinterpret_cast<void*>(&lazy_function_resolver);
+                }
+
+                found_runtime_function_ = runtime_function(options_.text_base_ + options_.entry_point_);
+            } else {
+                found_runtime_function_ = reinterpret_cast<RuntimeFunction>(lookup_function(*jit_, "entry_point"));
+
+                auto unimplemented_func_handler = lookup_function(*jit_, "sub_unimplemented");
+
+                std::fill(runtime_function_lookup_.begin(), runtime_function_lookup_.end(), unimplemented_func_handler);
+            }
         }
     }
 
+    void *VMEngine::compile_lazy_function(std::uint32_t addr) {
+        auto function = lazy_functions_.find(addr);
+        if (function == lazy_functions_.end()) {
+            return reinterpret_cast<void*>(&unimplemented_function);
+        }
+
+        const std::string function_name = std::format("sub_{:08X}", addr);
+        const std::string function_module_name = std::format("{}.lazy/{}", module_key_, function_name);
+
+        if (!add_cached_object(*jit_, function_module_name)) {
+            add_translated_module(*jit_, thread_safe_context_, options_, function_module_name, { function->second }, true);
+        }
+
+        auto function_address = lookup_function(*jit_, function_name);
+
+        lazy_functions_.erase(function);
+        runtime_function_lookup_[addr >> 2] = function_address;
+
+        return function_address;
+    }
+
+    void VMEngine::compile_optimized_function(std::uint32_t addr) {
+        auto function = tiered_functions_.find(addr);
+        if (function == tiered_functions_.end()) {
+            return;
+        }
+
+        const std::string function_name = std::format("sub_{:08X}", addr);
+        const std::string function_module_name = std::format("{}.tiered/{}", module_key_, function_name);
+
+        if (!add_cached_object(*optimizer_jit_, function_module_name)) {
+            // Translated as a standalone module without instrumentation, the same way lazily compiled functions are
+            VMOptions optimized_options = options_;
+            optimized_options.lazy_compile_ = true;
+            optimized_options.tiered_compile_ = false;
+
+            add_translated_module(*optimizer_jit_, optimizer_thread_safe_context_, optimized_options, function_module_name,
+                                  { function->second }, true);
+        }
+
+        auto function_address = lookup_function(*optimizer_jit_, function_name);
+
+        // Translated code keeps reading the table on the executing thread
+        static_assert(sizeof(std::atomic<void*>) == sizeof(void*));
+        reinterpret_cast<std::atomic<void*>&>(runtime_function_lookup_[addr >> 2]).store(function_address, std::memory_order_release);
+    }
+
+    void VMEngine::request_tier_up(std::uint32_t addr) {
+        {
+            std::lock_guard<std::mutex> lock(optimizer_mutex_);
+            optimizer_queue_.push_back(addr);
+        }
+
+        optimizer_condition_.notify_one();
+    }
+
+    void VMEngine::register_call_site_cache(std::uint32_t addr, const CallSiteCache *cache) {
+        call_site_caches_.emplace(addr, cache);
+    }
+
+    void VMEngine::call_hle_handler(const void *return_address, void *userdata, int code) {
+        // Handlers may run guest code again, restore the outer call's address once done
+        auto outer_return_address = std::exchange(hle_return_address_, return_address);
+        active_hle_handler_(userdata, code);
+        hle_return_address_ = outer_return_address;
+    }
+
+    std::optional<std::uint32_t> VMEngine::guest_pc(const void *return_address) const {
+        return return_address_table_.guest_pc(reinterpret_cast<std::uintptr_t>(return_address));
+    }
+
+    void *VMEngine::resolve_lazy_function(std::uint32_t addr) {
+        void *result = nullptr;
+
+        task_handler_->call_host_function_task_safe([this, addr, &result]() {
+            result = compile_lazy_function(addr);
+        });
+
+        return result;
+    }
+
+    RuntimeFunction VMEngine::runtime_function(std::uint32_t addr) {
+        auto func_ptr = runtime_function_lookup_[addr >> 2];
+
+        if (func_ptr == reinterpret_cast<void*>(&lazy_function_resolver)) {
+            func_ptr = resolve_lazy_function(addr);
+        }
+
+        return reinterpret_cast<RuntimeFunction>(func_ptr);
+    }
+
     void VMEngine::execute(HleHandler hle_handler, void *userdata) {
+        engine_instance = this;
+        active_hle_handler_ = hle_handler;
         prepare_runtime_function();
-        found_runtime_function_(context(), reinterpret_cast<std::uint32_t*>(config_.memory_base()), runtime_function_lookup_.data(), hle_handler, userdata);
+        found_runtime_function_(context(), reinterpret_cast<std::uint32_t*>(config_.memory_base()), runtime_function_lookup_.data(),
+                                &hle_handler_trampoline, userdata);
     }
 
     void VMEngine::run_task(TaskData &task_data, HleHandler hle_handler) {
@@ -168,27 +606,26 @@ namespace Pip2 {
         if (task_data.id_ == ENTRY_POINT_TASK) {
             func = found_runtime_function_;
         } else {
-            auto func_ptr = runtime_function_lookup_[task_data.entry_point_ >> 2];
-            if (func_ptr == nullptr) {
+            func = runtime_function(task_data.entry_point_);
+            if (func == nullptr) {
                 throw std::runtime_error(std::format("Invalid task function address! Address=0x{:08X}", task_data.entry_point_));
             }
-
-            func = reinterpret_cast<RuntimeFunction>(func_ptr);
         }
 
+        active_hle_handler_ = hle_handler;
         func(task_data.context_, reinterpret_cast<std::uint32_t*>(config_.memory_base()), runtime_function_lookup_.data(),
-             hle_handler, active_handler_userdata_);
+             &hle_handler_trampoline, active_handler_userdata_);
     }
 
     void VMEngine::execute_task_aware(HleHandler hle_handler, void *userdata) {
         if (!module_use_task_) {
             execute(hle_handler, userdata);
         } else {
-            prepare_runtime_function();
-
             active_handler_userdata_ = userdata;
             engine_instance = this;
 
+            prepare_runtime_function();
+
             task_handler_->run_entry_point_task(hle_handler);
         }
     }
@@ -198,6 +635,13 @@ namespace Pip2 {
             throw std::runtime_error("Invalid register");
         }
 
+        // Translated code doesn't keep PC in the context, during an HLE call it comes from the call's return address
+        if ((reg == Register::PC) && hle_return_address_) {
+            if (auto pc = guest_pc(hle_return_address_)) {
+                return pc.value();
+            }
+        }
+
         return context().regs_[reg >> 2];
     }
 
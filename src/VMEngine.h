@@ -2,12 +2,22 @@
 
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/LLVMContext.h>
-#include <llvm/ExecutionEngine/ExecutionEngine.h>
-
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
 #include <thread>
 
 #include "Callback.h"
+#include "CallSiteCache.h"
+#include "DecodedProgram.h"
+#include "Function.h"
 #include "ObjectCache.h"
+#include "ReturnAddressTable.h"
 #include "VMContext.h"
 #include "VMConfigParameters.h"
 #include "VMConfig.h"
@@ -20,30 +30,71 @@ namespace Pip2 {
 
     class VMEngine {
     private:
-        static bool s_mcjit_initialized_;
+        static bool s_llvm_initialized_;
 
-        llvm::LLVMContext llvm_context_;
+        llvm::orc::ThreadSafeContext thread_safe_context_;
 
         std::unique_ptr<ObjectCache> object_cache_;
-        std::unique_ptr<llvm::ExecutionEngine> execution_engine_;
+        std::unique_ptr<llvm::orc::LLJIT> jit_;
         std::unique_ptr<TaskHandler> task_handler_;
 
         std::vector<void*> runtime_function_lookup_;
 
+        // Guest memory decoded for analysis and translation, kept while functions may still be translated
+        std::unique_ptr<DecodedProgram> decoded_program_;
+
+        // Analysed but not yet compiled functions, when lazy compilation is enabled
+        std::map<std::uint32_t, Function> lazy_functions_;
+
+        // Optimizing tier of tiered compilation. It has its own context and JIT since it runs on its own thread
+        std::map<std::uint32_t, Function> tiered_functions_;
+        llvm::orc::ThreadSafeContext optimizer_thread_safe_context_;
+        std::unique_ptr<llvm::orc::LLJIT> optimizer_jit_;
+        std::thread optimizer_thread_;
+        std::mutex optimizer_mutex_;
+        std::condition_variable optimizer_condition_;
+        std::deque<std::uint32_t> optimizer_queue_;
+        bool optimizer_stop_ = false;
+
+        // Inline caches of CALLr sites that have run, by address of the CALLr. They live in the JIT's data sections
+        std::map<std::uint32_t, const CallSiteCache *> call_site_caches_;
+
+        // Guest PCs of the HLE calls in all compiled code, and the return address of the HLE call being handled
+        ReturnAddressTable return_address_table_;
+        const void *hle_return_address_{};
+        HleHandler active_hle_handler_{};
+
         VMConfig config_;
         VMOptions options_;
 
         std::string module_name_;
+        std::string module_key_;
+        std::string analysis_key_;
         RuntimeFunction found_runtime_function_{};
         void *active_handler_userdata_{};
         bool module_use_task_;
 
-        static void initialize_mcjit();
+        static void initialize_llvm();
 
     private:
-        void initialize_execution_engine();
+        std::unique_ptr<llvm::orc::LLJIT> create_jit(llvm::CodeGenOpt::Level opt_level);
+        bool add_cached_object(llvm::orc::LLJIT &jit, const std::string &module_name, bool *does_module_use_task = nullptr);
+        void add_translated_module(llvm::orc::LLJIT &jit, llvm::orc::ThreadSafeContext &context, const VMOptions &options,
+                                   const std::string &module_name, const std::vector<Function> &functions, bool optimize,
+                                   const std::vector<std::vector<Function>> &partitions = {},
+                                   const std::set<std::uint32_t> &exported_functions = {});
+        bool add_cached_partitions(const std::string &module_name, bool *does_module_use_task = nullptr);
+        void add_translated_partitions(const std::string &module_name, const std::vector<Function> &functions, bool optimize);
+        void *lookup_function(llvm::orc::LLJIT &jit, const std::string &name);
+
+        void initialize_jit();
+        void initialize_optimizer();
+        void run_optimizer();
+        void stop_optimizer();
         void load_and_compile_module();
         void prepare_runtime_function();
+        void *compile_lazy_function(std::uint32_t addr);
+        void compile_optimized_function(std::uint32_t addr);
 
         void run_task(TaskData &task_data, HleHandler hle_handler);
 
@@ -62,6 +113,26 @@ namespace Pip2 {
         [[nodiscard]] VMContext &context() { return task_handler_->current_task_context(); }
         [[nodiscard]] const VMContext &context() const { return task_handler_->current_task_context(); }
 
+        void *resolve_lazy_function(std::uint32_t addr);
+        void request_tier_up(std::uint32_t addr);
+        void register_call_site_cache(std::uint32_t addr, const CallSiteCache *cache);
+        void call_hle_handler(const void *return_address, void *userdata, int code);
+
+        /**
+         * @brief Get the guest PC of the HLE call in translated code that returns to the given host address.
+         *
+         * For hosts walking the host stack themselves, e.g. in crash reports or profilers. Inside the HLE handler,
+         * reading PC with reg() does this with the return address of the call being handled.
+         */
+        [[nodiscard]] std::optional<std::uint32_t> guest_pc(const void *return_address) const;
+
+        /**
+         * @brief Inline caches of the CALLr sites that have run so far, by address of the CALLr. Sites that rarely
+         * miss always call the same function. Only read them while the VM is not executing.
+         */
+        [[nodiscard]] const std::map<std::uint32_t, const CallSiteCache *> &call_site_caches() const { return call_site_caches_; }
+        RuntimeFunction runtime_function(std::uint32_t addr);
+
         TaskHandler *task_handler() { return task_handler_.get(); }
         void *userdata() { return active_handler_userdata_; }
     };
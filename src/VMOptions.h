@@ -1,7 +1,16 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+
 namespace Pip2
 {
+    /**
+     * @brief Options of a VM engine, shared with hosts through the C interface.
+     *
+     * New fields are only appended. Hosts pass the size of the struct they were built with to
+     * vm_engine_create_with_options_size, and vm_engine_create reads VM_OPTIONS_V1_SIZE bytes.
+     */
     struct VMOptions
     {
         /**
@@ -14,7 +23,41 @@ namespace Pip2
          */
         bool cache_;
 
-        std::uint8_t padding_[6];
+        /**
+         * @brief When this is set to true, guest registers used by a translated function are kept in locals and
+         * only written back to the context around calls, HLE calls and returns.
+         */
+        bool cache_registers_;
+
+        /**
+         * @brief When this is set to true, functions are only translated and compiled the first time they are called.
+         */
+        bool lazy_compile_;
+
+        /**
+         * @brief When this is set to true, the program is first compiled without optimizations, and functions that
+         * are called often are recompiled with full optimizations on a background thread. Ignored with lazy compilation.
+         */
+        bool tiered_compile_;
+
+        /**
+         * @brief The compression level of cached objects, zero stores them uncompressed. Objects are compressed with
+         * zstd, or zlib when the LLVM build has no zstd support. Used when cache is enabled.
+         */
+        std::int8_t cache_compression_level_;
+
+        /**
+         * @brief When this is set to true, direct calls between functions of the same module pass SP and P0 to P3 as
+         * host arguments, and get R0, R1 and SP back as host return values instead of going through the context.
+         * Requires cache_registers_, ignored with lazy or tiered compilation.
+         */
+        bool host_calling_convention_;
+
+        /**
+         * @brief When this is set to true, the inline cache of every CALLr site counts its hits and misses, see
+         * vm_engine_call_site_cache_counters. Each call then pays for updating a counter.
+         */
+        bool call_site_counters_;
 
         /**
          * @brief The path to the cache directory. Used when cache is enabled.
@@ -30,5 +73,15 @@ namespace Pip2
          * @brief The entry point of the program.
          */
         std::uint32_t entry_point_;
+
+        /**
+         * @brief The size of the text segment, zero when it runs to the end of memory. The segment must fit in memory.
+         * Only the text segment and the pool items are analyzed, so only they decide whether cached analysis results
+         * can be reused.
+         */
+        std::uint32_t text_size_;
     };
+
+    // Size of VMOptions up to entry_point_, before text_size_ was added
+    static constexpr std::size_t VM_OPTIONS_V1_SIZE = offsetof(VMOptions, text_size_);
 }
\ No newline at end of file
@@ -4,7 +4,7 @@ namespace Pip2::Test {
     std::uint32_t ModifiablePoolItems::get(const std::uint32_t value)
     {
         auto existing_item = std::find_if(pool_items_.begin(), pool_items_.end(), [value](const ModifiablePoolItem &item) {
-            return item.value_ == value;
+            return (item.flags_ == 0) && (item.value_ == value);
         });
 
         if (existing_item != pool_items_.end()) {
@@ -38,6 +38,17 @@ namespace Pip2::Test {
         return pool_items_.size();
     }
 
+    std::uint32_t ModifiablePoolItems::get_function_table(const std::uint32_t table_addr)
+    {
+        ModifiablePoolItem item{};
+        item.value_ = table_addr;
+        item.flags_ = 0x20000000'00000000;
+
+        pool_items_.push_back(item);
+
+        return pool_items_.size();
+    }
+
     std::vector<std::uint64_t> ModifiablePoolItems::build()
     {
         std::vector<std::uint64_t> pool_items;
@@ -46,7 +57,7 @@ namespace Pip2::Test {
             if (item.func_ != nullptr) {
                 pool_items.push_back(0x80000000'00000000);
             } else {
-                pool_items.push_back(item.value_);
+                pool_items.push_back(item.value_ | item.flags_);
             }
         }
 
@@ -14,6 +14,7 @@ namespace Pip2::Test {
             void *func_userdata_;
 
             std::uint32_t value_;
+            std::uint64_t flags_;
         };
 
         std::vector<ModifiablePoolItem> pool_items_;
@@ -25,6 +26,9 @@ namespace Pip2::Test {
         std::uint32_t get(std::uint32_t value);
         std::uint32_t get(ModifiablePoolFunction func, void *func_data);
 
+        // A constant pointing to a zero terminated table of function addresses
+        std::uint32_t get_function_table(std::uint32_t table_addr);
+
         std::vector<std::uint64_t> build();
 
         void hle_handler(int code);
@@ -1,5 +1,6 @@
 #include <catch2/catch_test_macros.hpp>
 #include "TestEnvironment.h"
+#include <Translator.h>
 #include "RandomIntGenerator.h"
 #include "LinkerFix.h"
 
@@ -459,4 +460,575 @@ TEST_CASE("CALLl: Call a function", "[PIP2][ControlFlow][Single]") {
         REQUIRE(env.reg(Register::P0) == p3);
         REQUIRE(temporary_data.collected_value_ == p3 + p4);
     }
-}
\ No newline at end of file
+}
+
+TEST_CASE("CALLl: HLE handler sees the PC of the next instruction", "[PIP2][ControlFlow][Single]") {
+    struct TemporaryData {
+        TestEnvironment *env_pointer = nullptr;
+        std::uint32_t collected_pc_ = 0;
+    } temporary_data;
+
+    ModifiablePoolItems pool_items;
+    std::vector<Instruction> instructions = {
+            make_single_argument_instruction(Opcode::CALLl, Register::RA),
+            make_constant(20),
+            make_single_argument_instruction(Opcode::CALLl, Register::RA),
+            make_pool_ref(pool_items.get([](void *userdata) {
+                    TemporaryData *temporary_data = reinterpret_cast<TemporaryData*>(userdata);
+                    temporary_data->collected_pc_ = temporary_data->env_pointer->reg(Register::PC);
+                }, &temporary_data)),
+            make_single_argument_instruction(Opcode::JPr, Register::RA),
+            make_binary_instruction(Opcode::ADD, Register::R0, Register::P1, Register::P2),
+            make_single_argument_instruction(Opcode::JPr, Register::RA)
+    };
+
+    RandomIntGenerator<std::uint32_t> rand_32;
+    auto p1 = rand_32.next();
+    auto p2 = rand_32.next();
+
+    TestEnvironment env("CALLl_pc", instructions, std::move(pool_items), 0);
+    temporary_data.env_pointer = &env;
+
+    env.reg(Register::P1, p1);
+    env.reg(Register::P2, p2);
+    env.run(&modifiable_pool_items_hle_handler, &pool_items);
+
+    REQUIRE(env.reg(Register::R0) == p1 + p2);
+    REQUIRE(temporary_data.collected_pc_ == 16);
+}
+
+TEST_CASE("CALLl: Direct calls and returns leave PC alone", "[PIP2][ControlFlow][Single]") {
+    ModifiablePoolItems pool_items;
+    std::vector<Instruction> instructions = {
+            make_single_argument_instruction(Opcode::CALLl, Register::RA),
+            make_constant(12),
+            make_single_argument_instruction(Opcode::JPr, Register::RA),
+            make_binary_instruction(Opcode::ADD, Register::R0, Register::P1, Register::P2),
+            make_single_argument_instruction(Opcode::JPr, Register::RA)
+    };
+
+    RandomIntGenerator<std::uint32_t> rand_32;
+    auto p1 = rand_32.next();
+    auto p2 = rand_32.next();
+
+    TestEnvironment env("CALLl_no_pc", instructions, std::move(pool_items), 0);
+    env.reg(Register::P1, p1);
+    env.reg(Register::P2, p2);
+    env.reg(Register::PC, 0xFFFFFFFF);
+    env.run();
+
+    REQUIRE(env.reg(Register::R0) == p1 + p2);
+    REQUIRE(env.reg(Register::PC) == 0xFFFFFFFF);
+}
+
+TEST_CASE("CALLl: Cached registers are synchronized around a local call", "[PIP2][ControlFlow][Single]") {
+    ModifiablePoolItems pool_items;
+    std::vector<Instruction> instructions = {
+            make_binary_instruction(Opcode::ADD, Register::P0, Register::P1, Register::P2),
+            make_single_argument_instruction(Opcode::CALLl, Register::RA),
+            make_constant(16),
+            make_binary_instruction(Opcode::ADD, Register::R1, Register::R0, Register::P0),
+            make_single_argument_instruction(Opcode::JPr, Register::RA),
+            make_binary_instruction(Opcode::ADD, Register::R0, Register::P0, Register::P0),
+            make_unary_instruction(Opcode::MOV, Register::P0, Register::P1),
+            make_single_argument_instruction(Opcode::JPr, Register::RA)
+    };
+
+    RandomIntGenerator<std::uint32_t> rand_32;
+    auto p1 = rand_32.next();
+    auto p2 = rand_32.next();
+
+    TestEnvironment env("CALLl_cached", instructions, std::move(pool_items), 0, 0, { .cache_registers_ = true });
+    env.reg(Register::P1, p1);
+    env.reg(Register::P2, p2);
+    env.run();
+
+    REQUIRE(env.reg(Register::R0) == (p1 + p2) * 2);
+    REQUIRE(env.reg(Register::P0) == p1);
+    REQUIRE(env.reg(Register::R1) == (p1 + p2) * 2 + p1);
+}
+
+TEST_CASE("CALLl: Memory written by a leaf callee is seen by a read-only callee and the caller", "[PIP2][ControlFlow][Single]") {
+    ModifiablePoolItems pool_items;
+    std::vector<Instruction> instructions = {
+            make_single_argument_instruction(Opcode::CALLl, Register::RA),
+            make_constant(28),
+            make_single_argument_instruction(Opcode::CALLl, Register::RA),
+            make_constant(32),
+            make_unary_instruction(Opcode::LDWd, Register::R1, Register::P0),
+            make_constant(12),
+            make_single_argument_instruction(Opcode::JPr, Register::RA),
+            make_unary_instruction(Opcode::STWd, Register::P1, Register::P0),
+            make_constant(12),
+            make_single_argument_instruction(Opcode::JPr, Register::RA),
+            make_unary_instruction(Opcode::LDWd, Register::R0, Register::P0),
+            make_constant(12),
+            make_binary_instruction(Opcode::ADD, Register::R0, Register::R0, Register::P1),
+            make_single_argument_instruction(Opcode::JPr, Register::RA)
+    };
+
+    RandomIntGenerator<std::uint32_t> rand_32;
+    auto p1 = rand_32.next();
+
+    TestEnvironment env("CALLl_attributes", instructions, std::move(pool_items), 0, 20, { .cache_registers_ = true });
+    env.reg(Register::P0, env.heap_address() + 4);
+    env.reg(Register::P1, p1);
+    env.run();
+
+    REQUIRE(reinterpret_cast<std::uint32_t*>(env.heap())[4] == p1);
+    REQUIRE(env.reg(Register::R0) == p1 * 2);
+    REQUIRE(env.reg(Register::R1) == p1);
+}
+
+TEST_CASE("CALLl: Arguments and results passed in host registers", "[PIP2][ControlFlow][Single]") {
+    RandomIntGenerator<std::uint32_t> rand_32;
+    const std::uint32_t p1 = rand_32.next();
+    const std::uint32_t p2 = rand_32.next();
+    const std::uint32_t p3 = rand_32.next();
+    const std::uint32_t s0 = rand_32.next();
+
+    for (const bool host_calling_convention: { false, true }) {
+        ModifiablePoolItems pool_items;
+        std::vector<Instruction> instructions = {
+                make_binary_instruction(Opcode::ADD, Register::P0, Register::P1, Register::P2),
+                make_single_argument_instruction(Opcode::CALLl, Register::RA),
+                make_constant(16),
+                make_binary_instruction(Opcode::ADD, Register::R1, Register::R0, Register::P1),
+                make_single_argument_instruction(Opcode::JPr, Register::RA),
+                // Moves the SP, and changes an argument register besides returning R0
+                make_range_reg_instruction(Opcode::STORE, Register::S0, 4),
+                make_binary_instruction(Opcode::ADD, Register::S0, Register::P0, Register::P3),
+                make_binary_instruction(Opcode::ADD, Register::R0, Register::S0, Register::P2),
+                make_unary_instruction(Opcode::MOV, Register::P1, Register::P3),
+                make_range_reg_instruction(Opcode::RESTORE, Register::S0, 4),
+                make_single_argument_instruction(Opcode::JPr, Register::RA)
+        };
+
+        TestEnvironment env("CALLl_host_registers", instructions, std::move(pool_items), 0, 16,
+                            { .cache_registers_ = true, .host_calling_convention_ = host_calling_convention });
+        env.reg(Register::SP, env.heap_address() + 16);
+        env.reg(Register::P1, p1);
+        env.reg(Register::P2, p2);
+        env.reg(Register::P3, p3);
+        env.reg(Register::S0, s0);
+        env.run();
+
+        REQUIRE(env.reg(Register::R0) == p1 + p2 + p3 + p2);
+        REQUIRE(env.reg(Register::R1) == p1 + p2 + p3 + p2 + p3);
+        REQUIRE(env.reg(Register::P0) == p1 + p2);
+        REQUIRE(env.reg(Register::P1) == p3);
+        REQUIRE(env.reg(Register::S0) == s0);
+        REQUIRE(env.reg(Register::SP) == env.heap_address() + 16);
+        REQUIRE(reinterpret_cast<std::uint32_t*>(env.heap())[3] == s0);
+    }
+}
+
+TEST_CASE("CALLl: Callee is compiled on first call with lazy compilation", "[PIP2][ControlFlow][Single]") {
+    ModifiablePoolItems pool_items;
+    std::vector<Instruction> instructions = {
+            make_binary_instruction(Opcode::ADD, Register::P0, Register::P1, Register::P2),
+            make_single_argument_instruction(Opcode::CALLl, Register::RA),
+            make_constant(16),
+            make_binary_instruction(Opcode::ADD, Register::R1, Register::R0, Register::P0),
+            make_single_argument_instruction(Opcode::JPr, Register::RA),
+            make_binary_instruction(Opcode::ADD, Register::R0, Register::P0, Register::P0),
+            make_unary_instruction(Opcode::MOV, Register::P0, Register::P1),
+            make_single_argument_instruction(Opcode::JPr, Register::RA)
+    };
+
+    RandomIntGenerator<std::uint32_t> rand_32;
+    auto p1 = rand_32.next();
+    auto p2 = rand_32.next();
+
+    TestEnvironment env("CALLl_lazy", instructions, std::move(pool_items), 0, 0, { .lazy_compile_ = true });
+    env.reg(Register::P1, p1);
+    env.reg(Register::P2, p2);
+    env.run();
+
+    REQUIRE(env.reg(Register::R0) == (p1 + p2) * 2);
+    REQUIRE(env.reg(Register::P0) == p1);
+    REQUIRE(env.reg(Register::R1) == (p1 + p2) * 2 + p1);
+}
+
+TEST_CASE("CALLl: Hot callee keeps working with tiered compilation", "[PIP2][ControlFlow][Single]") {
+    ModifiablePoolItems pool_items;
+    std::vector<Instruction> instructions = {
+            make_single_argument_instruction(Opcode::CALLl, Register::RA),
+            make_constant(24),
+            make_binary_instruction(Opcode::ADDQ, Register::P1, Register::P1, static_cast<Register>(0xFF)),
+            make_binary_instruction(Opcode::BNE, Register::P1, Register::ZR, Register::ZR),
+            make_constant(static_cast<std::uint32_t>(-12)),
+            make_single_argument_instruction(Opcode::JPr, Register::RA),
+            make_binary_instruction(Opcode::ADD, Register::R0, Register::R0, Register::P2),
+            make_single_argument_instruction(Opcode::JPr, Register::RA)
+    };
+
+    RandomIntGenerator<std::uint32_t> rand_32;
+    // Well past the tier up threshold, so the optimized callee may be swapped in while looping
+    const std::uint32_t call_count = 5000;
+    auto p2 = rand_32.next();
+
+    TestEnvironment env("CALLl_tiered", instructions, std::move(pool_items), 0, 0, { .tiered_compile_ = true });
+    env.reg(Register::P1, call_count);
+    env.reg(Register::P2, p2);
+    env.reg(Register::R0, 0);
+    env.run();
+
+    REQUIRE(env.reg(Register::R0) == p2 * call_count);
+    REQUIRE(env.reg(Register::P1) == 0);
+}
+
+TEST_CASE("CALLl: Call functions in other partitions", "[PIP2][ControlFlow][Single]") {
+    // Two callees big enough for the program to be split into two partitions
+    static constexpr std::size_t CALLEE_INSTRUCTION_COUNT = Translator::PARTITION_CODE_SIZE / sizeof(Instruction);
+    static constexpr std::uint32_t FIRST_CALLEE_ADDR = 20;
+    static constexpr std::uint32_t SECOND_CALLEE_ADDR = FIRST_CALLEE_ADDR + (CALLEE_INSTRUCTION_COUNT + 1) * sizeof(Instruction);
+
+    ModifiablePoolItems pool_items;
+    std::vector<Instruction> instructions = {
+            make_single_argument_instruction(Opcode::CALLl, Register::RA),
+            make_constant(FIRST_CALLEE_ADDR),
+            make_single_argument_instruction(Opcode::CALLl, Register::RA),
+            make_constant(SECOND_CALLEE_ADDR - 8),
+            make_single_argument_instruction(Opcode::JPr, Register::RA)
+    };
+
+    instructions.insert(instructions.end(), CALLEE_INSTRUCTION_COUNT,
+                        make_binary_instruction(Opcode::ADDQ, Register::R0, Register::R0, static_cast<Register>(1)));
+    instructions.push_back(make_single_argument_instruction(Opcode::JPr, Register::RA));
+
+    instructions.insert(instructions.end(), CALLEE_INSTRUCTION_COUNT,
+                        make_binary_instruction(Opcode::ADDQ, Register::R1, Register::R1, static_cast<Register>(1)));
+    instructions.push_back(make_single_argument_instruction(Opcode::JPr, Register::RA));
+
+    TestEnvironment env("CALLl_partitions", instructions, std::move(pool_items), 0);
+    env.reg(Register::R0, 0);
+    env.reg(Register::R1, 0);
+    env.run();
+
+    REQUIRE(env.reg(Register::R0) == CALLEE_INSTRUCTION_COUNT);
+    REQUIRE(env.reg(Register::R1) == CALLEE_INSTRUCTION_COUNT);
+}
+
+TEST_CASE("JPr: Jump table with a bound, scale and base outside the usual pattern", "[PIP2][ControlFlow][Single]") {
+    static constexpr std::uint32_t TABLE_ADDR = 64;
+    static constexpr std::uint32_t CASE_RESULTS[] = { 10, 20, 30, 99 };
+
+    for (std::uint32_t index = 0; index < 4; index++) {
+        ModifiablePoolItems pool_items;
+        std::vector<Instruction> instructions = {
+                // Index above 2 goes to the default block
+                make_binary_instruction(Opcode::BGEUI, Register::P0, static_cast<Register>(3), static_cast<Register>(14)),
+                make_single_argument_instruction(Opcode::LDI, Register::R1),
+                make_pool_ref(pool_items.get(TABLE_ADDR)),
+                make_binary_instruction(Opcode::MULQ, Register::R0, Register::P0, static_cast<Register>(4)),
+                make_binary_instruction(Opcode::ADD, Register::R0, Register::R1, Register::R0),
+                make_unary_instruction(Opcode::LDWd, Register::R0, Register::R0),
+                make_constant(0),
+                make_single_argument_instruction(Opcode::JPr, Register::R0),
+                make_word_instruction(Opcode::LDQ, Register::P1, CASE_RESULTS[0]),
+                make_single_argument_instruction(Opcode::JPr, Register::RA),
+                make_word_instruction(Opcode::LDQ, Register::P1, CASE_RESULTS[1]),
+                make_single_argument_instruction(Opcode::JPr, Register::RA),
+                make_word_instruction(Opcode::LDQ, Register::P1, CASE_RESULTS[2]),
+                make_single_argument_instruction(Opcode::JPr, Register::RA),
+                make_word_instruction(Opcode::LDQ, Register::P1, CASE_RESULTS[3]),
+                make_single_argument_instruction(Opcode::JPr, Register::RA),
+                make_pool_ref(32),
+                make_pool_ref(40),
+                make_pool_ref(48)
+        };
+
+        TestEnvironment env("JPr_jump_table", instructions, std::move(pool_items), 0);
+        env.reg(Register::P0, index);
+        env.reg(Register::P1, 0);
+        env.run();
+
+        REQUIRE(env.reg(Register::P1) == CASE_RESULTS[index]);
+    }
+}
+
+TEST_CASE("JPr: Negative index past a signed bound calls the loaded address", "[PIP2][ControlFlow][Single]") {
+    static constexpr std::uint32_t TABLE_ADDR = 68;
+    static constexpr std::uint32_t DEFAULT_FUNCTION_ADDR = 80;
+    static constexpr std::uint32_t FUNCTION_TABLE_ADDR = 88;
+
+    ModifiablePoolItems pool_items;
+    pool_items.get_function_table(FUNCTION_TABLE_ADDR);
+
+    std::vector<Instruction> instructions = {
+            // A signed bound, so a negative index reaches the switch
+            make_binary_instruction(Opcode::BGTI, Register::P0, static_cast<Register>(2), static_cast<Register>(14)),
+            make_single_argument_instruction(Opcode::LDI, Register::R1),
+            make_pool_ref(pool_items.get(TABLE_ADDR)),
+            make_binary_instruction(Opcode::MULQ, Register::R0, Register::P0, static_cast<Register>(4)),
+            make_binary_instruction(Opcode::ADD, Register::R0, Register::R1, Register::R0),
+            make_unary_instruction(Opcode::LDWd, Register::R0, Register::R0),
+            make_constant(0),
+            make_single_argument_instruction(Opcode::JPr, Register::R0),
+            // Every case overwrites the register the address was loaded to
+            make_word_instruction(Opcode::LDQ, Register::R0, 10),
+            make_single_argument_instruction(Opcode::JPr, Register::RA),
+            make_word_instruction(Opcode::LDQ, Register::R0, 20),
+            make_single_argument_instruction(Opcode::JPr, Register::RA),
+            make_word_instruction(Opcode::LDQ, Register::R0, 30),
+            make_single_argument_instruction(Opcode::JPr, Register::RA),
+            make_word_instruction(Opcode::LDQ, Register::R0, 99),
+            make_single_argument_instruction(Opcode::JPr, Register::RA),
+            // The word right before the table, where index -1 loads from
+            make_pool_ref(DEFAULT_FUNCTION_ADDR),
+            make_pool_ref(32),
+            make_pool_ref(40),
+            make_pool_ref(48),
+            make_word_instruction(Opcode::LDQ, Register::R0, 77),
+            make_single_argument_instruction(Opcode::JPr, Register::RA),
+            make_pool_ref(DEFAULT_FUNCTION_ADDR),
+            make_pool_ref(0)
+    };
+
+    TestEnvironment env("JPr_jump_table_negative", instructions, std::move(pool_items), 0);
+    env.reg(Register::P0, static_cast<std::uint32_t>(-1));
+    env.reg(Register::R0, 0);
+    env.run();
+
+    REQUIRE(env.reg(Register::R0) == 77);
+}
+
+TEST_CASE("CALLr: Call a function whose address is loaded from the pool", "[PIP2][ControlFlow][Single]") {
+    ModifiablePoolItems pool_items;
+    std::vector<Instruction> instructions = {
+            make_single_argument_instruction(Opcode::LDI, Register::R1),
+            make_pool_ref(pool_items.get(20)),
+            make_single_argument_instruction(Opcode::CALLr, Register::R1),
+            make_binary_instruction(Opcode::ADD, Register::P0, Register::R0, Register::R0),
+            make_single_argument_instruction(Opcode::JPr, Register::RA),
+            make_word_instruction(Opcode::LDQ, Register::R0, 21),
+            make_single_argument_instruction(Opcode::JPr, Register::RA)
+    };
+
+    TestEnvironment env("CALLr_constant", instructions, std::move(pool_items), 0);
+    env.reg(Register::R0, 0);
+    env.reg(Register::P0, 0);
+    env.run();
+
+    REQUIRE(env.reg(Register::P0) == 42);
+}
+
+TEST_CASE("JPr: Chained jumps through a register don't grow the host stack", "[PIP2][ControlFlow][Single]") {
+    static constexpr std::uint32_t HOP_COUNT = 1000000;
+
+    RandomIntGenerator<std::uint32_t> rand_32;
+    const std::uint32_t p2 = rand_32.next();
+
+    // Unoptimized code from tiered compilation gets no tail call elimination on its own
+    for (const TestEnvironmentOptions options: { TestEnvironmentOptions{}, TestEnvironmentOptions{ .cache_registers_ = true },
+                                                 TestEnvironmentOptions{ .tiered_compile_ = true } }) {
+        ModifiablePoolItems pool_items;
+        std::vector<Instruction> instructions = {
+                make_binary_instruction(Opcode::BEQ, Register::P0, Register::ZR, Register::ZR),
+                make_constant(20),
+                make_binary_instruction(Opcode::ADD, Register::R0, Register::R0, Register::P2),
+                make_binary_instruction(Opcode::SUB, Register::P0, Register::P0, Register::P3),
+                // Jumps back to the start of the function, every hop is a call through the lookup table
+                make_single_argument_instruction(Opcode::JPr, Register::P1),
+                make_single_argument_instruction(Opcode::JPr, Register::RA)
+        };
+
+        TestEnvironment env("JPr_chained", instructions, std::move(pool_items), 0, 0, options);
+        env.reg(Register::R0, 0);
+        env.reg(Register::P0, HOP_COUNT);
+        env.reg(Register::P1, 0);
+        env.reg(Register::P2, p2);
+        env.reg(Register::P3, 1);
+        env.run();
+
+        REQUIRE(env.reg(Register::P0) == 0);
+        REQUIRE(env.reg(Register::R0) == p2 * HOP_COUNT);
+    }
+}
+
+TEST_CASE("JPr: Tail call through a register every caller sets to the same function", "[PIP2][ControlFlow][Single]") {
+    for (const bool cache_registers: { false, true }) {
+        ModifiablePoolItems pool_items;
+        const auto target_ref = pool_items.get(48);
+
+        std::vector<Instruction> instructions = {
+                make_single_argument_instruction(Opcode::LDI, Register::P0),
+                make_pool_ref(target_ref),
+                make_single_argument_instruction(Opcode::CALLl, Register::RA),
+                make_constant(36),
+                make_binary_instruction(Opcode::ADD, Register::P1, Register::R0, Register::R0),
+                make_single_argument_instruction(Opcode::LDI, Register::P0),
+                make_pool_ref(target_ref),
+                make_single_argument_instruction(Opcode::CALLl, Register::RA),
+                make_constant(16),
+                make_binary_instruction(Opcode::ADD, Register::P1, Register::P1, Register::R0),
+                make_single_argument_instruction(Opcode::JPr, Register::RA),
+                // Only ever called with P0 set to the function below
+                make_single_argument_instruction(Opcode::JPr, Register::P0),
+                make_word_instruction(Opcode::LDQ, Register::R0, 7),
+                make_single_argument_instruction(Opcode::JPr, Register::RA)
+        };
+
+        TestEnvironment env("JPr_constant", instructions, std::move(pool_items), 0, 0, { .cache_registers_ = cache_registers });
+        env.reg(Register::R0, 0);
+        env.reg(Register::P1, 0);
+        env.run();
+
+        REQUIRE(env.reg(Register::P1) == 21);
+    }
+}
+
+TEST_CASE("CALLr: Call through a slot of a function table", "[PIP2][ControlFlow][Single]") {
+    static constexpr std::uint32_t TABLE_ADDR = 48;
+
+    for (std::uint32_t index = 0; index < 2; index++) {
+        ModifiablePoolItems pool_items;
+        std::vector<Instruction> instructions = {
+                make_single_argument_instruction(Opcode::LDI, Register::R1),
+                make_pool_ref(pool_items.get_function_table(TABLE_ADDR)),
+                make_binary_instruction(Opcode::MULQ, Register::R0, Register::P0, static_cast<Register>(4)),
+                make_binary_instruction(Opcode::ADD, Register::R0, Register::R1, Register::R0),
+                make_unary_instruction(Opcode::LDWd, Register::R0, Register::R0),
+                make_constant(0),
+                make_single_argument_instruction(Opcode::CALLr, Register::R0),
+                make_single_argument_instruction(Opcode::JPr, Register::RA),
+                make_word_instruction(Opcode::LDQ, Register::P1, 11),
+                make_single_argument_instruction(Opcode::JPr, Register::RA),
+                make_word_instruction(Opcode::LDQ, Register::P1, 22),
+                make_single_argument_instruction(Opcode::JPr, Register::RA),
+                make_pool_ref(32),
+                make_pool_ref(40),
+                make_pool_ref(0)
+        };
+
+        TestEnvironment env("CALLr_function_table", instructions, std::move(pool_items), 0);
+        env.reg(Register::P0, index);
+        env.reg(Register::P1, 0);
+        env.run();
+
+        REQUIRE(env.reg(Register::P1) == (index + 1) * 11);
+    }
+}
+
+TEST_CASE("CALLr: Inline cache counts hits and misses of a site", "[PIP2][ControlFlow][Single]") {
+    static constexpr std::uint32_t CALL_COUNT = 10;
+    static constexpr std::uint32_t CALL_SITE_ADDR = 16;
+
+    RandomIntGenerator<std::uint32_t> rand_32;
+    const std::uint32_t p1 = rand_32.next();
+
+    ModifiablePoolItems pool_items;
+    std::vector<Instruction> instructions = {
+            make_single_argument_instruction(Opcode::CALLl, Register::RA),
+            make_constant(36),
+            make_binary_instruction(Opcode::BEQ, Register::P0, Register::ZR, Register::ZR),
+            make_constant(24),
+            // Always calls the same function, through a register the analysis knows nothing about
+            make_single_argument_instruction(Opcode::CALLr, Register::P2),
+            make_binary_instruction(Opcode::SUB, Register::P0, Register::P0, Register::P3),
+            make_single_argument_instruction(Opcode::JPl, Register::RA),
+            make_constant(static_cast<std::uint32_t>(-16)),
+            make_single_argument_instruction(Opcode::JPr, Register::RA),
+            make_binary_instruction(Opcode::ADD, Register::R0, Register::R0, Register::P1),
+            make_single_argument_instruction(Opcode::JPr, Register::RA)
+    };
+
+    TestEnvironment env("CALLr_inline_cache", instructions, std::move(pool_items), 0, 0, TestEnvironmentOptions{ .call_site_counters_ = true });
+    env.reg(Register::R0, 0);
+    env.reg(Register::P0, CALL_COUNT);
+    env.reg(Register::P1, p1);
+    env.reg(Register::P2, 36);
+    env.reg(Register::P3, 1);
+    env.run();
+
+    REQUIRE(env.reg(Register::R0) == p1 * (CALL_COUNT + 1));
+
+    const auto &caches = env.engine().call_site_caches();
+    REQUIRE(caches.size() == 1);
+    REQUIRE(caches.contains(CALL_SITE_ADDR));
+    REQUIRE(caches.at(CALL_SITE_ADDR)->target_ == 36);
+    REQUIRE(caches.at(CALL_SITE_ADDR)->hits_ == CALL_COUNT - 1);
+    REQUIRE(caches.at(CALL_SITE_ADDR)->misses_ == 1);
+}
+
+TEST_CASE("CALLr: Function table slot changed at runtime", "[PIP2][ControlFlow][Single]") {
+    static constexpr std::uint32_t TABLE_ADDR = 56;
+
+    ModifiablePoolItems pool_items;
+    std::vector<Instruction> instructions = {
+            make_single_argument_instruction(Opcode::LDI, Register::R1),
+            make_pool_ref(pool_items.get_function_table(TABLE_ADDR)),
+            // Point the slot somewhere else, the guarded direct call must not be taken
+            make_unary_instruction(Opcode::STWd, Register::P2, Register::R1),
+            make_constant(0),
+            make_unary_instruction(Opcode::LDWd, Register::R0, Register::R1),
+            make_constant(0),
+            make_single_argument_instruction(Opcode::CALLr, Register::R0),
+            make_single_argument_instruction(Opcode::CALLl, Register::RA),
+            make_constant(20),
+            make_single_argument_instruction(Opcode::JPr, Register::RA),
+            make_word_instruction(Opcode::LDQ, Register::P1, 11),
+            make_single_argument_instruction(Opcode::JPr, Register::RA),
+            make_binary_instruction(Opcode::ADDQ, Register::P1, Register::P1, static_cast<Register>(1)),
+            make_single_argument_instruction(Opcode::JPr, Register::RA),
+            make_pool_ref(40),
+            make_pool_ref(0)
+    };
+
+    TestEnvironment env("CALLr_function_table_changed", instructions, std::move(pool_items), 0);
+    env.reg(Register::P1, 0);
+    env.reg(Register::P2, 48);
+    env.run();
+
+    REQUIRE(env.reg(Register::P1) == 2);
+}
+
+TEST_CASE("CALLr: Guarded call to a function of the entry point's partition", "[PIP2][ControlFlow][Single]") {
+    // The entry point and the small target fill the first partition, the caller with the guarded call the second
+    static constexpr std::size_t PADDING_INSTRUCTION_COUNT = Translator::PARTITION_CODE_SIZE / sizeof(Instruction);
+    static constexpr std::size_t TARGET_PADDING_INSTRUCTION_COUNT = 32;
+    static constexpr std::uint32_t TARGET_ADDR = (PADDING_INSTRUCTION_COUNT + 5) * sizeof(Instruction);
+    static constexpr std::uint32_t CALLER_ADDR = TARGET_ADDR + (TARGET_PADDING_INSTRUCTION_COUNT + 2) * sizeof(Instruction);
+    static constexpr std::uint32_t TABLE_ADDR = CALLER_ADDR + (PADDING_INSTRUCTION_COUNT + 8) * sizeof(Instruction);
+
+    ModifiablePoolItems pool_items;
+    std::vector<Instruction> instructions = {
+            make_single_argument_instruction(Opcode::CALLl, Register::RA),
+            make_constant(TARGET_ADDR),
+            make_single_argument_instruction(Opcode::CALLl, Register::RA),
+            make_constant(CALLER_ADDR - 8)
+    };
+
+    instructions.insert(instructions.end(), PADDING_INSTRUCTION_COUNT,
+                        make_binary_instruction(Opcode::ADDQ, Register::S2, Register::S2, static_cast<Register>(1)));
+    instructions.push_back(make_single_argument_instruction(Opcode::JPr, Register::RA));
+
+    instructions.insert(instructions.end(), TARGET_PADDING_INSTRUCTION_COUNT,
+                        make_binary_instruction(Opcode::ADDQ, Register::S1, Register::S1, static_cast<Register>(1)));
+    instructions.push_back(make_binary_instruction(Opcode::ADDQ, Register::P1, Register::P1, static_cast<Register>(1)));
+    instructions.push_back(make_single_argument_instruction(Opcode::JPr, Register::RA));
+
+    instructions.insert(instructions.end(), {
+            make_binary_instruction(Opcode::ADD, Register::S0, Register::RA, Register::ZR),
+            make_single_argument_instruction(Opcode::LDI, Register::R1),
+            make_pool_ref(pool_items.get_function_table(TABLE_ADDR)),
+            make_unary_instruction(Opcode::LDWd, Register::R0, Register::R1),
+            make_constant(0),
+            make_single_argument_instruction(Opcode::CALLr, Register::R0),
+            make_binary_instruction(Opcode::ADD, Register::RA, Register::S0, Register::ZR)
+    });
+
+    instructions.insert(instructions.end(), PADDING_INSTRUCTION_COUNT,
+                        make_binary_instruction(Opcode::ADDQ, Register::R1, Register::R1, static_cast<Register>(1)));
+    instructions.push_back(make_single_argument_instruction(Opcode::JPr, Register::RA));
+
+    instructions.push_back(make_pool_ref(TARGET_ADDR));
+    instructions.push_back(make_pool_ref(0));
+
+    TestEnvironment env("CALLr_guarded_call_other_partition", instructions, std::move(pool_items), 0);
+    env.reg(Register::P1, 0);
+    env.run();
+
+    REQUIRE(env.reg(Register::P1) == 2);
+}
@@ -4,7 +4,8 @@ namespace Pip2::Test {
     TestEnvironment::TestEnvironment(const std::string &case_name, std::vector<Pip2::Instruction> instructions,
                                      ModifiablePoolItems &&pool_items,
                                      std::uint32_t stack_size,
-                                     std::uint32_t heap_size)
+                                     std::uint32_t heap_size,
+                                     const TestEnvironmentOptions &test_options)
          : pool_items_(pool_items)
          , engine_(nullptr)
          , stack_size_(stack_size)
@@ -23,8 +24,14 @@ namespace Pip2::Test {
         vm_options_ = VMOptions {
              .divide_by_zero_result_zero = true,
              .cache_ = false,
+             .cache_registers_ = test_options.cache_registers_,
+             .lazy_compile_ = test_options.lazy_compile_,
+             .tiered_compile_ = test_options.tiered_compile_,
+             .host_calling_convention_ = test_options.host_calling_convention_,
+             .call_site_counters_ = test_options.call_site_counters_,
              .text_base_ = 0,
-             .entry_point_ = 0
+             .entry_point_ = 0,
+             .text_size_ = text_size_
         };
 
         VMConfigParameters params = {
@@ -12,6 +12,14 @@
 #include "ModifiablePoolItems.h"
 
 namespace Pip2::Test {
+    struct TestEnvironmentOptions {
+        bool cache_registers_ = false;
+        bool lazy_compile_ = false;
+        bool tiered_compile_ = false;
+        bool host_calling_convention_ = false;
+        bool call_site_counters_ = false;
+    };
+
     class TestEnvironment {
     private:
         std::vector<std::uint8_t> memory_;
@@ -32,7 +40,8 @@ namespace Pip2::Test {
         explicit TestEnvironment(const std::string &case_name, std::vector<Pip2::Instruction> instructions,
                                  ModifiablePoolItems &&pool_items,
                                  std::uint32_t stack_size,
-                                 std::uint32_t heap_size = 0);
+                                 std::uint32_t heap_size = 0,
+                                 const TestEnvironmentOptions &test_options = {});
 
         ~TestEnvironment() = default;
 
@@ -46,6 +55,10 @@ namespace Pip2::Test {
             return text_size_ + stack_size_;
         }
 
+        const Pip2::VMEngine &engine() const {
+            return *engine_;
+        }
+
         void run(HleHandler handler = nullptr, void *userdata = nullptr);
     };
 }
@@ -3,6 +3,8 @@
 #include "RandomIntGenerator.h"
 #include "LinkerFix.h"
 
+#include <cstring>
+
 using namespace Pip2;
 using namespace Pip2::Test;
 
@@ -301,4 +303,108 @@ TEST_CASE("RESTORE: Restore registers from stack", "[PIP2][LoadStore][Single]")
     REQUIRE(env.reg(Register::P1) == value2);
     REQUIRE(env.reg(Register::P2) == value3);
     REQUIRE(env.reg(Register::P3) == value4);
-}
\ No newline at end of file
+}
+
+TEST_CASE("STORE: Store and restore registers with the SP moved by half a word", "[PIP2][LoadStore][Single]") {
+    ModifiablePoolItems pool_items;
+
+    std::vector<Instruction> instructions = {
+            make_binary_instruction(Opcode::ADDQ, Register::SP, Register::SP, static_cast<Register>(0xFE)),
+            make_range_reg_instruction(Opcode::STORE, Register::P0, 8),
+            make_range_reg_instruction(Opcode::RESTORE, Register::R1, 8),
+            make_binary_instruction(Opcode::ADDQ, Register::SP, Register::SP, static_cast<Register>(2)),
+            make_single_argument_instruction(Opcode::JPr, Register::RA)
+    };
+
+    TestEnvironment env("STORE_unaligned", instructions, std::move(pool_items), 0, 20);
+
+    RandomIntGenerator<std::uint32_t> rand_32;
+    std::uint32_t value = rand_32.next();
+    std::uint32_t value2 = rand_32.next();
+
+    env.reg(Register::SP, env.heap_address() + 20);
+    env.reg(Register::P0, value);
+    env.reg(Register::P1, value2);
+
+    env.run();
+
+    std::uint32_t stored[2];
+    std::memcpy(stored, env.heap() + 10, sizeof(stored));
+
+    REQUIRE(stored[0] == value);
+    REQUIRE(stored[1] == value2);
+    REQUIRE(env.reg(Register::R0) == value);
+    REQUIRE(env.reg(Register::R1) == value2);
+    REQUIRE(env.reg(Register::SP) == env.heap_address() + 20);
+}
+
+TEST_CASE("Stack frame: Slots are written back for a callee and reloaded once it returns", "[PIP2][LoadStore][Single]") {
+    RandomIntGenerator<std::uint32_t> rand_32;
+    const std::uint32_t p1 = rand_32.next();
+
+    for (const bool cache_registers: { false, true }) {
+        ModifiablePoolItems pool_items;
+        std::vector<Instruction> instructions = {
+                make_range_reg_instruction(Opcode::STORE, Register::RA, 4),
+                make_binary_instruction(Opcode::SUBi, Register::SP, Register::SP, Register::ZR),
+                make_constant(8),
+                make_unary_instruction(Opcode::STWd, Register::P1, Register::SP),
+                make_constant(0),
+                make_single_argument_instruction(Opcode::CALLl, Register::RA),
+                make_constant(28),
+                make_unary_instruction(Opcode::LDWd, Register::P0, Register::SP),
+                make_constant(4),
+                make_binary_instruction(Opcode::ADDi, Register::SP, Register::SP, Register::ZR),
+                make_constant(8),
+                make_range_reg_instruction(Opcode::RET, Register::RA, 4),
+                // Reads its argument from the caller's frame, and writes its result there
+                make_unary_instruction(Opcode::LDWd, Register::R0, Register::SP),
+                make_constant(0),
+                make_binary_instruction(Opcode::ADDQ, Register::R0, Register::R0, static_cast<Register>(1)),
+                make_unary_instruction(Opcode::STWd, Register::R0, Register::SP),
+                make_constant(4),
+                make_single_argument_instruction(Opcode::JPr, Register::RA)
+        };
+
+        TestEnvironment env("StackFrameCall", instructions, std::move(pool_items), 0, 16, { .cache_registers_ = cache_registers });
+        env.reg(Register::SP, env.heap_address() + 16);
+        env.reg(Register::P1, p1);
+        env.run();
+
+        auto *heap = reinterpret_cast<std::uint32_t*>(env.heap());
+
+        REQUIRE(env.reg(Register::P0) == p1 + 1);
+        REQUIRE(env.reg(Register::SP) == env.heap_address() + 16);
+        REQUIRE(heap[1] == p1);
+        REQUIRE(heap[2] == p1 + 1);
+    }
+}
+
+TEST_CASE("Stack frame: Slot partially written by a byte store", "[PIP2][LoadStore][Single]") {
+    RandomIntGenerator<std::uint32_t> rand_32;
+    const std::uint32_t p1 = rand_32.next();
+    const std::uint32_t p2 = rand_32.next();
+
+    ModifiablePoolItems pool_items;
+    std::vector<Instruction> instructions = {
+            make_binary_instruction(Opcode::SUBi, Register::SP, Register::SP, Register::ZR),
+            make_constant(8),
+            make_unary_instruction(Opcode::STWd, Register::P1, Register::SP),
+            make_constant(0),
+            make_unary_instruction(Opcode::STBd, Register::P2, Register::SP),
+            make_constant(1),
+            make_unary_instruction(Opcode::LDWd, Register::P0, Register::SP),
+            make_constant(0),
+            make_binary_instruction(Opcode::ADDi, Register::SP, Register::SP, Register::ZR),
+            make_constant(8),
+            make_single_argument_instruction(Opcode::JPr, Register::RA)
+    };
+
+    TestEnvironment env("StackFrameByte", instructions, std::move(pool_items), 0, 16);
+    env.reg(Register::SP, env.heap_address() + 16);
+    env.reg(Register::P1, p1);
+    env.reg(Register::P2, p2);
+    env.run();
+
+    REQUIRE(env.reg(Register::P0) == ((p1 & 0xFFFF00FF) | ((p2 & 0xFF) << 8)));
+}
@@ -1,11 +1,58 @@
 #include <catch2/catch_test_macros.hpp>
 #include "TestEnvironment.h"
+#include <DecodedProgram.h>
+#include <ProgramAnalysis.h>
+#include <Translator.h>
+#include <VMEngine.h>
 #include "RandomIntGenerator.h"
 #include "LinkerFix.h"
 
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Operator.h>
+
 using namespace Pip2;
 using namespace Pip2::Test;
 
+// Stores the translated function at the start of the program makes to a register of its context argument
+static std::size_t count_context_stores(const std::vector<Instruction> &instructions, bool cache_registers, Register reg) {
+    std::vector<Instruction> memory = instructions;
+    std::vector<std::uint64_t> pool_items;
+
+    const VMConfig config(reinterpret_cast<std::uint8_t*>(memory.data()), memory.size() * sizeof(Instruction), pool_items.data(), 0);
+    const VMOptions options {
+        .divide_by_zero_result_zero = true,
+        .cache_registers_ = cache_registers,
+        .text_size_ = static_cast<std::uint32_t>(memory.size() * sizeof(Instruction))
+    };
+
+    DecodedProgram program(reinterpret_cast<const std::uint32_t*>(memory.data()), config.memory_size(), config.pool_items());
+    ProgramAnalysis analysis(reinterpret_cast<const std::uint32_t*>(memory.data()), 0, config.memory_size(), config.pool_items(), program);
+
+    bool use_task = false;
+    const std::vector<Function> functions = analysis.analyze(0, use_task);
+
+    llvm::LLVMContext context;
+    Translator translator(context, config, options, program);
+    auto module = translator.translate("count_context_stores", functions, use_task);
+    auto function = module->getFunction("sub_00000000");
+
+    std::size_t count = 0;
+
+    for (const auto &block: *function) {
+        for (const auto &instruction: block) {
+            auto store = llvm::dyn_cast<llvm::StoreInst>(&instruction);
+            auto address = store ? llvm::dyn_cast<llvm::GEPOperator>(store->getPointerOperand()) : nullptr;
+
+            if (address && (address->getPointerOperand() == function->getArg(0)) && (address->getNumIndices() == 2)) {
+                auto index = llvm::dyn_cast<llvm::ConstantInt>(address->getOperand(2));
+                count += (index && (index->getZExtValue() == (reg >> 2))) ? 1 : 0;
+            }
+        }
+    }
+
+    return count;
+}
+
 TEST_CASE("EXSB: Sign-extended byte", "[PIP2][Miscs][Single]") {
     WHEN("Destination and source are same") {
         ModifiablePoolItems pool_items;
@@ -116,4 +163,52 @@ TEST_CASE("NOT: Bitwise not", "[PIP2][Miscs][Single]") {
     env.run();
 
     REQUIRE(env.reg(Register::P0) == ~p1);
-}
\ No newline at end of file
+}
+
+TEST_CASE("Liveness: Overwritten and partially written registers keep their final value", "[PIP2][Miscs][Single]") {
+    RandomIntGenerator<std::uint32_t> rand_32;
+    const std::uint32_t p1 = rand_32.next();
+    const std::uint32_t p2 = rand_32.next();
+    const std::uint32_t r1 = rand_32.next();
+
+    for (const bool cache_registers: { false, true }) {
+        ModifiablePoolItems pool_items;
+        std::vector<Instruction> instructions = {
+                // Never read before the LDQ below overwrites it
+                make_binary_instruction(Opcode::ADD, Register::R0, Register::P1, Register::P2),
+                // Only the low byte is written, the rest must still come from the context
+                make_unary_instruction(Opcode::MOVB, Register::R1, Register::P1),
+                make_word_instruction(Opcode::LDQ, Register::R0, 5),
+                make_binary_instruction(Opcode::ADD, Register::P0, Register::R0, Register::P2),
+                make_single_argument_instruction(Opcode::JPr, Register::RA)
+        };
+
+        TestEnvironment env("Liveness", instructions, std::move(pool_items), 0, 0, { .cache_registers_ = cache_registers });
+        env.reg(Register::P1, p1);
+        env.reg(Register::P2, p2);
+        env.reg(Register::R1, r1);
+        env.run();
+
+        REQUIRE(env.reg(Register::R0) == 5);
+        REQUIRE(env.reg(Register::P0) == p2 + 5);
+        REQUIRE(env.reg(Register::R1) == ((r1 & 0xFFFFFF00) | (p1 & 0xFF)));
+
+        // Only the LDQ writes R0 back, the value of the ADD is never stored
+        REQUIRE(count_context_stores(instructions, cache_registers, Register::R0) == 1);
+    }
+}
+
+TEST_CASE("VMEngine: Reject a text segment past the end of memory", "[PIP2][Miscs][Single]") {
+    std::vector<Instruction> memory(4, make_single_argument_instruction(Opcode::JPr, Register::RA));
+
+    const VMConfigParameters params = {
+        .memory_base_ = reinterpret_cast<std::uint8_t*>(memory.data()),
+        .memory_size_ = memory.size() * sizeof(Instruction)
+    };
+
+    const VMOptions text_past_memory { .text_base_ = 8, .text_size_ = 12 };
+    const VMOptions text_base_past_memory { .text_base_ = 20 };
+
+    REQUIRE_THROWS_AS(VMEngine("text_past_memory", params, VMOptions(text_past_memory)), std::runtime_error);
+    REQUIRE_THROWS_AS(VMEngine("text_base_past_memory", params, VMOptions(text_base_past_memory)), std::runtime_error);
+}